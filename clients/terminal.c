@@ -50,6 +50,7 @@ static char *option_font;
 static int option_font_size;
 static char *option_term;
 static char *option_shell;
+static int option_scrollback_lines;
 
 static struct wl_list terminal_list;
 
@@ -82,6 +83,7 @@ terminal_run(struct terminal *terminal, const char *path);
 
 /* Buffer sizes */
 #define MAX_RESPONSE		256
+#define MAX_SCROLLBACK_LINES	(1 << 20)
 #define MAX_ESCAPE		255
 
 /* Terminal modes */
@@ -398,6 +400,26 @@ attr_init(struct attr *data_attr, struct attr attr, int n)
 	}
 }
 
+/* A run of cells sharing the same attributes */
+struct attr_run {
+	uint32_t count;
+	struct attr attr;
+};
+
+/* One line of the screen or scrollback.  Lines are allocated as they are
+ * first used and grow to the terminal width when accessed, so resizing
+ * doesn't touch lines that aren't looked at.  Lines that scroll out of
+ * view are packed: trailing empty cells are dropped and the attributes
+ * are kept as runs. */
+struct terminal_line {
+	union utf8_char *data;
+	struct attr *attr;	/* NULL while packed */
+	struct attr_run *runs;	/* only while packed */
+	int width;		/* cells, including dropped ones */
+	int length;		/* cells kept in data while packed */
+	int run_count;
+};
+
 enum escape_state {
 	escape_state_normal = 0,
 	escape_state_escape,
@@ -417,6 +439,16 @@ enum escape_state {
 #define ESC_FLAG_DQUOTE	0x20
 #define ESC_FLAG_SPACE	0x40
 
+#define GLYPH_CACHE_SIZE	1024
+
+struct glyph_cache_entry {
+	uint32_t ch;
+	int bold;
+	int valid;
+	int count;
+	cairo_glyph_t glyphs[4];
+};
+
 enum {
 	SELECT_NONE,
 	SELECT_CHAR,
@@ -429,10 +461,10 @@ struct terminal {
 	struct widget *widget;
 	struct display *display;
 	char *title;
-	union utf8_char *data;
+	struct terminal_line *lines;	/* buffer_height lines */
 	struct task io_task;
 	char *tab_ruler;
-	struct attr *data_attr;
+	struct attr fill_attr;	/* for cells added by a resize */
 	struct attr curr_attr;
 	uint32_t mode;
 	char origin_mode;
@@ -476,6 +508,21 @@ struct terminal {
 	int selection_start_row, selection_start_col;
 	int selection_end_row, selection_end_col;
 	struct wl_list link;
+
+	/* Rendering state, see redraw_handler() */
+	cairo_surface_t *backing;
+	int backing_scale;
+	unsigned char *dirty;	/* one flag per buffer row */
+	int redraw_all;
+	uint32_t drawn_start;
+	uint32_t drawn_mode;
+	int drawn_row;
+	int drawn_selection[4];
+	struct {
+		int top, bottom, d;
+		uint32_t start;
+	} blit;
+	struct glyph_cache_entry glyph_cache[GLYPH_CACHE_SIZE];
 };
 
 /* Create default tab stops, every 8 characters */
@@ -548,24 +595,231 @@ init_color_table(struct terminal *terminal)
 	}
 }
 
-static union utf8_char *
-terminal_get_row(struct terminal *terminal, int row)
+static int
+terminal_row_index(struct terminal *terminal, int row)
 {
-	int index;
+	return (row + terminal->start) & (terminal->buffer_height - 1);
+}
 
-	index = (row + terminal->start) & (terminal->buffer_height - 1);
+static void
+terminal_line_pack(struct terminal_line *line)
+{
+	struct attr_run *run;
+	int i, count;
+
+	if (!line->attr)
+		return;
 
-	return (void *) terminal->data + index * terminal->data_pitch;
+	count = 1;
+	for (i = 1; i < line->width; i++)
+		if (memcmp(&line->attr[i], &line->attr[i - 1],
+			   sizeof line->attr[i]) != 0)
+			count++;
+
+	line->runs = xmalloc(count * sizeof *line->runs);
+	line->run_count = count;
+	run = line->runs;
+	run->count = 1;
+	run->attr = line->attr[0];
+	for (i = 1; i < line->width; i++) {
+		if (memcmp(&line->attr[i], &run->attr,
+			   sizeof run->attr) == 0) {
+			run->count++;
+		} else {
+			run++;
+			run->count = 1;
+			run->attr = line->attr[i];
+		}
+	}
+	free(line->attr);
+	line->attr = NULL;
+
+	line->length = line->width;
+	while (line->length > 0 && line->data[line->length - 1].ch == 0)
+		line->length--;
+	if (line->length == 0) {
+		free(line->data);
+		line->data = NULL;
+	} else {
+		line->data = (union utf8_char *)
+			xrealloc((char *) line->data,
+				 line->length * sizeof *line->data);
+	}
+}
+
+static void
+terminal_line_unpack(struct terminal_line *line)
+{
+	struct attr *attr;
+	int i;
+
+	line->data = (union utf8_char *)
+		xrealloc((char *) line->data, line->width * sizeof *line->data);
+	memset(&line->data[line->length], 0,
+	       (line->width - line->length) * sizeof *line->data);
+
+	line->attr = xmalloc(line->width * sizeof *line->attr);
+	attr = line->attr;
+	for (i = 0; i < line->run_count; i++) {
+		attr_init(attr, line->runs[i].attr, line->runs[i].count);
+		attr += line->runs[i].count;
+	}
+
+	free(line->runs);
+	line->runs = NULL;
+	line->run_count = 0;
+	line->length = 0;
+}
+
+static struct terminal_line *
+terminal_get_line(struct terminal *terminal, int row)
+{
+	struct terminal_line *line;
+	int width = terminal->width;
+
+	line = &terminal->lines[terminal_row_index(terminal, row)];
+	if (line->runs)
+		terminal_line_unpack(line);
+
+	if (line->width < width) {
+		line->data = (union utf8_char *)
+			xrealloc((char *) line->data,
+				 width * sizeof *line->data);
+		line->attr = (struct attr *)
+			xrealloc((char *) line->attr,
+				 width * sizeof *line->attr);
+		memset(&line->data[line->width], 0,
+		       (width - line->width) * sizeof *line->data);
+		attr_init(&line->attr[line->width], terminal->fill_attr,
+			  width - line->width);
+		line->width = width;
+	}
+
+	return line;
+}
+
+static union utf8_char *
+terminal_get_row(struct terminal *terminal, int row)
+{
+	return terminal_get_line(terminal, row)->data;
 }
 
 static struct attr*
 terminal_get_attr_row(struct terminal *terminal, int row)
 {
-	int index;
+	return terminal_get_line(terminal, row)->attr;
+}
+
+/* Blanks a row, dropping whatever it held in the scrollback */
+static void
+terminal_clear_row(struct terminal *terminal, int row)
+{
+	struct terminal_line *line;
+
+	line = &terminal->lines[terminal_row_index(terminal, row)];
+	if (line->runs) {
+		free(line->runs);
+		free(line->data);
+		memset(line, 0, sizeof *line);
+	}
+
+	line = terminal_get_line(terminal, row);
+	memset(line->data, 0, terminal->data_pitch);
+	attr_init(line->attr, terminal->curr_attr, terminal->width);
+}
+
+/* Packs the lines first to last (inclusive, relative to the top of the
+ * screen) once they are out of view. */
+static void
+terminal_pack_lines(struct terminal *terminal, int first, int last)
+{
+	int i;
+
+	if (last - first >= (int) terminal->buffer_height)
+		first = last - terminal->buffer_height + 1;
+
+	for (i = first; i <= last; i++)
+		terminal_line_pack(&terminal->lines[terminal_row_index(terminal, i)]);
+}
+
+/* Exchanges two lines, along with their dirty flags */
+static void
+terminal_swap_lines(struct terminal *terminal, int a, int b)
+{
+	struct terminal_line line;
+	unsigned char dirty;
+	int i = terminal_row_index(terminal, a);
+	int j = terminal_row_index(terminal, b);
+
+	line = terminal->lines[i];
+	terminal->lines[i] = terminal->lines[j];
+	terminal->lines[j] = line;
+
+	dirty = terminal->dirty[i];
+	terminal->dirty[i] = terminal->dirty[j];
+	terminal->dirty[j] = dirty;
+}
+
+static void
+terminal_reverse_lines(struct terminal *terminal, int first, int last)
+{
+	while (first < last)
+		terminal_swap_lines(terminal, first++, last--);
+}
+
+/* Flags the visible rows first to last (inclusive) for the next redraw.
+ * The flags are kept per buffer row, so they move along with the
+ * contents when start changes. */
+static void
+terminal_mark_dirty(struct terminal *terminal, int first, int last)
+{
+	int i;
 
-	index = (row + terminal->start) & (terminal->buffer_height - 1);
+	if (first < 0)
+		first = 0;
+	if (last >= terminal->height)
+		last = terminal->height - 1;
 
-	return (void *) terminal->data_attr + index * terminal->attr_pitch;
+	for (i = first; i <= last; i++)
+		terminal->dirty[terminal_row_index(terminal, i)] = 1;
+}
+
+static int
+terminal_is_dirty(struct terminal *terminal, int row)
+{
+	return terminal->dirty[terminal_row_index(terminal, row)];
+}
+
+/* Records that the rows top to bottom are about to be scrolled by d, so
+ * the next redraw can move their pixels rather than draw them again.
+ * Only one such region is tracked; anything that doesn't fit is flagged
+ * dirty instead. */
+static void
+terminal_queue_blit(struct terminal *terminal, int top, int bottom, int d)
+{
+	int i;
+
+	if (terminal->blit.d != 0 &&
+	    (terminal->blit.top != top || terminal->blit.bottom != bottom ||
+	     terminal->blit.start != terminal->start)) {
+		for (i = terminal->blit.top; i <= terminal->blit.bottom; i++)
+			terminal->dirty[(i + terminal->blit.start) &
+					(terminal->buffer_height - 1)] = 1;
+		terminal->blit.d = 0;
+	}
+
+	if (terminal->redraw_all)
+		return;
+
+	if (terminal->start != terminal->drawn_start) {
+		terminal_mark_dirty(terminal, top, bottom);
+		return;
+	}
+
+	terminal->blit.top = top;
+	terminal->blit.bottom = bottom;
+	terminal->blit.start = terminal->start;
+	terminal->blit.d += d;
 }
 
 union decoded_attr {
@@ -631,68 +885,51 @@ terminal_scroll_buffer(struct terminal *terminal, int d)
 	terminal->start += d;
 	if (d < 0) {
 		d = 0 - d;
-		for (i = 0; i < d; i++) {
-			memset(terminal_get_row(terminal, i), 0, terminal->data_pitch);
-			attr_init(terminal_get_attr_row(terminal, i),
-			    terminal->curr_attr, terminal->width);
-		}
+		for (i = 0; i < d; i++)
+			terminal_clear_row(terminal, i);
+		terminal_mark_dirty(terminal, 0, d - 1);
 	} else {
-		for (i = terminal->height - d; i < terminal->height; i++) {
-			memset(terminal_get_row(terminal, i), 0, terminal->data_pitch);
-			attr_init(terminal_get_attr_row(terminal, i),
-			    terminal->curr_attr, terminal->width);
-		}
+		terminal_pack_lines(terminal, -d, -1);
+		for (i = terminal->height - d; i < terminal->height; i++)
+			terminal_clear_row(terminal, i);
+		terminal_mark_dirty(terminal, terminal->height - d,
+				    terminal->height - 1);
 	}
 
 	terminal->selection_start_row -= d;
 	terminal->selection_end_row -= d;
 }
 
+/* Scrolling within the margins rotates the lines in place; the ones that
+ * scroll out are blanked and reused for the ones that scroll in. */
 static void
 terminal_scroll_window(struct terminal *terminal, int d)
 {
 	int i;
 	int window_height;
-	int from_row, to_row;
+	int top, bottom;
 	
 	// scrolling range is inclusive
-	window_height = terminal->margin_bottom - terminal->margin_top + 1;
+	top = terminal->margin_top;
+	bottom = terminal->margin_bottom;
+	window_height = bottom - top + 1;
 	d = d % (window_height + 1);
+	terminal_queue_blit(terminal, top, bottom, d);
 	if(d < 0) {
 		d = 0 - d;
-		to_row = terminal->margin_bottom;
-		from_row = terminal->margin_bottom - d;
-		
-		for (i = 0; i < (window_height - d); i++) {
-			memcpy(terminal_get_row(terminal, to_row - i),
-			       terminal_get_row(terminal, from_row - i),
-			       terminal->data_pitch);
-			memcpy(terminal_get_attr_row(terminal, to_row - i),
-			       terminal_get_attr_row(terminal, from_row - i),
-			       terminal->attr_pitch);
-		}
-		for (i = terminal->margin_top; i < (terminal->margin_top + d); i++) {
-			memset(terminal_get_row(terminal, i), 0, terminal->data_pitch);
-			attr_init(terminal_get_attr_row(terminal, i),
-				terminal->curr_attr, terminal->width);
-		}
+		terminal_reverse_lines(terminal, top, bottom - d);
+		terminal_reverse_lines(terminal, bottom - d + 1, bottom);
+		terminal_reverse_lines(terminal, top, bottom);
+		for (i = top; i < top + d; i++)
+			terminal_clear_row(terminal, i);
+		terminal_mark_dirty(terminal, top, top + d - 1);
 	} else {
-		to_row = terminal->margin_top;
-		from_row = terminal->margin_top + d;
-		
-		for (i = 0; i < (window_height - d); i++) {
-			memcpy(terminal_get_row(terminal, to_row + i),
-			       terminal_get_row(terminal, from_row + i),
-			       terminal->data_pitch);
-			memcpy(terminal_get_attr_row(terminal, to_row + i),
-			       terminal_get_attr_row(terminal, from_row + i),
-			       terminal->attr_pitch);
-		}
-		for (i = terminal->margin_bottom - d + 1; i <= terminal->margin_bottom; i++) {
-			memset(terminal_get_row(terminal, i), 0, terminal->data_pitch);
-			attr_init(terminal_get_attr_row(terminal, i),
-				terminal->curr_attr, terminal->width);
-		}
+		terminal_reverse_lines(terminal, top, top + d - 1);
+		terminal_reverse_lines(terminal, top + d, bottom);
+		terminal_reverse_lines(terminal, top, bottom);
+		for (i = bottom - d + 1; i <= bottom; i++)
+			terminal_clear_row(terminal, i);
+		terminal_mark_dirty(terminal, bottom - d + 1, bottom);
 	}
 }
 
@@ -736,17 +973,13 @@ terminal_shift_line(struct terminal *terminal, int d)
 		memset(&row[terminal->column], 0, d * sizeof(union utf8_char));
 		attr_init(&attr_row[terminal->column], terminal->curr_attr, d);
 	}
+	terminal_mark_dirty(terminal, terminal->row, terminal->row);
 }
 
 static void
 terminal_resize_cells(struct terminal *terminal,
 		      int width, int height)
 {
-	union utf8_char *data;
-	struct attr *data_attr;
-	char *tab_ruler;
-	int data_pitch, attr_pitch;
-	int i, l, total_rows;
 	uint32_t d, uheight = height;
 	struct rectangle allocation;
 	struct winsize ws;
@@ -757,73 +990,36 @@ terminal_resize_cells(struct terminal *terminal,
 	if (terminal->width == width && terminal->height == height)
 		return;
 
-	if (terminal->data && width <= terminal->max_width) {
-		d = 0;
-		if (height < terminal->height && height <= terminal->row)
-			d = terminal->height - height;
-		else if (height > terminal->height &&
-			 terminal->height - 1 == terminal->row) {
-			d = terminal->height - height;
-			if (terminal->log_size < uheight)
-				d = -terminal->start;
-		}
-
-		terminal->start += d;
-		terminal->row -= d;
-	} else {
-		terminal->max_width = width;
-		data_pitch = width * sizeof(union utf8_char);
-		data = xzalloc(data_pitch * terminal->buffer_height);
-		attr_pitch = width * sizeof(struct attr);
-		data_attr = xmalloc(attr_pitch * terminal->buffer_height);
-		tab_ruler = xzalloc(width);
-		attr_init(data_attr, terminal->curr_attr,
-			  width * terminal->buffer_height);
-
-		if (terminal->data && terminal->data_attr) {
-			if (width > terminal->width)
-				l = terminal->width;
-			else
-				l = width;
-
-			if (terminal->height > height) {
-				total_rows = height;
-				i = 1 + terminal->row - height;
-				if (i > 0) {
-					terminal->start += i;
-					terminal->row = terminal->row - i;
-				}
-			} else {
-				total_rows = terminal->height;
-			}
-
-			for (i = 0; i < total_rows; i++) {
-				memcpy(&data[width * i],
-				       terminal_get_row(terminal, i),
-				       l * sizeof(union utf8_char));
-				memcpy(&data_attr[width * i],
-				       terminal_get_attr_row(terminal, i),
-				       l * sizeof(struct attr));
-			}
+	/* Only the position of the screen in the buffer changes here; the
+	 * lines pick up the new width when they are next accessed. */
+	d = 0;
+	if (height < terminal->height && height <= terminal->row)
+		d = terminal->height - height;
+	else if (height > terminal->height &&
+		 terminal->height - 1 == terminal->row) {
+		d = terminal->height - height;
+		if (terminal->log_size < uheight)
+			d = -terminal->start;
+	}
 
-			free(terminal->data);
-			free(terminal->data_attr);
-			free(terminal->tab_ruler);
-		}
+	terminal->start += d;
+	terminal->row -= d;
 
-		terminal->data_pitch = data_pitch;
-		terminal->attr_pitch = attr_pitch;
-		terminal->data = data;
-		terminal->data_attr = data_attr;
-		terminal->tab_ruler = tab_ruler;
-		terminal->start = 0;
+	if (width > terminal->max_width) {
+		terminal->max_width = width;
+		free(terminal->tab_ruler);
+		terminal->tab_ruler = xzalloc(width);
 	}
+	terminal->data_pitch = width * sizeof(union utf8_char);
+	terminal->attr_pitch = width * sizeof(struct attr);
+	terminal->fill_attr = terminal->curr_attr;
 
 	terminal->margin_bottom =
 		height - (terminal->height - terminal->margin_bottom);
 	terminal->width = width;
 	terminal->height = height;
 	terminal_init_tabs(terminal);
+	terminal->redraw_all = 1;
 
 	/* Update the window size */
 	ws.ws_row = terminal->height;
@@ -1002,20 +1198,79 @@ glyph_run_flush(struct glyph_run *run, union decoded_attr attr)
 	run->attr = attr;
 }
 
+/* Returns the glyphs for c at the origin, shaping them on a cache miss,
+ * or NULL if they don't fit in a cache entry. */
+static struct glyph_cache_entry *
+terminal_get_glyphs(struct terminal *terminal, union utf8_char *c, int bold)
+{
+	struct glyph_cache_entry *entry;
+	cairo_scaled_font_t *font;
+	cairo_glyph_t *glyphs;
+	cairo_status_t status;
+	uint32_t hash;
+	int num_glyphs;
+
+	hash = (c->ch * 2654435761u) >> 16;
+	entry = &terminal->glyph_cache[(hash ^ bold) & (GLYPH_CACHE_SIZE - 1)];
+	if (entry->valid && entry->ch == c->ch && entry->bold == bold)
+		return entry;
+
+	if (bold)
+		font = terminal->font_bold;
+	else
+		font = terminal->font_normal;
+
+	glyphs = entry->glyphs;
+	num_glyphs = ARRAY_LENGTH(entry->glyphs);
+	status = cairo_scaled_font_text_to_glyphs(font, 0, 0,
+						  (char *) c->byte, 4,
+						  &glyphs, &num_glyphs,
+						  NULL, NULL, NULL);
+	if (glyphs != entry->glyphs) {
+		cairo_glyph_free(glyphs);
+		entry->valid = 0;
+		return NULL;
+	}
+	if (status != CAIRO_STATUS_SUCCESS) {
+		entry->valid = 0;
+		return NULL;
+	}
+
+	entry->valid = 1;
+	entry->ch = c->ch;
+	entry->bold = bold;
+	entry->count = num_glyphs;
+
+	return entry;
+}
+
 static void
 glyph_run_add(struct glyph_run *run, int x, int y, union utf8_char *c)
 {
-	int num_glyphs;
+	struct glyph_cache_entry *entry;
+	int num_glyphs, bold, i;
 	cairo_scaled_font_t *font;
 
+	bold = (run->attr.attr.a & (ATTRMASK_BOLD | ATTRMASK_BLINK)) != 0;
+	entry = terminal_get_glyphs(run->terminal, c, bold);
+	if (entry) {
+		for (i = 0; i < entry->count; i++) {
+			run->g[i].index = entry->glyphs[i].index;
+			run->g[i].x = entry->glyphs[i].x + x;
+			run->g[i].y = entry->glyphs[i].y + y;
+		}
+		run->g += entry->count;
+		run->count += entry->count;
+		return;
+	}
+
 	num_glyphs = ARRAY_LENGTH(run->glyphs) - run->count;
 
-	if (run->attr.attr.a & (ATTRMASK_BOLD | ATTRMASK_BLINK))
+	if (bold)
 		font = run->terminal->font_bold;
 	else
 		font = run->terminal->font_normal;
 
-	cairo_move_to(run->cr, x, y);
 	cairo_scaled_font_text_to_glyphs (font, x, y,
 					  (char *) c->byte, 4,
 					  &run->g, &num_glyphs,
@@ -1024,123 +1279,278 @@ glyph_run_add(struct glyph_run *run, int x, int y, union utf8_char *c)
 	run->count += num_glyphs;
 }
 
-
+/* Draws one row into the backing store, from left to right in grid
+ * coordinates so the row's part of the side margins is painted too. */
 static void
-redraw_handler(struct widget *widget, void *data)
+terminal_draw_row(struct terminal *terminal, cairo_t *cr, int row,
+		  double left, double right)
 {
-	struct terminal *terminal = data;
-	struct rectangle allocation;
-	cairo_t *cr;
-	int top_margin, side_margin;
-	int row, col, cursor_x, cursor_y;
 	union utf8_char *p_row;
 	union decoded_attr attr;
-	int text_x, text_y;
-	cairo_surface_t *surface;
-	double d;
 	struct glyph_run run;
-	cairo_font_extents_t extents;
-	double average_width;
-	double unichar_width;
+	double average_width, height, y, start_x, end_x, d;
+	int col, bg, text_x, text_y;
 
-	surface = window_get_surface(terminal->window);
-	widget_get_allocation(terminal->widget, &allocation);
-	cr = widget_cairo_create(terminal->widget);
-	cairo_rectangle(cr, allocation.x, allocation.y,
-			allocation.width, allocation.height);
+	average_width = terminal->average_width;
+	height = terminal->extents.height;
+	y = row * height;
+	p_row = terminal_get_row(terminal, row);
+
+	cairo_save(cr);
+	cairo_rectangle(cr, left, y, right - left, height);
 	cairo_clip(cr);
-	cairo_push_group(cr);
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	terminal_set_color(terminal, cr, terminal->color_scheme->border);
 	cairo_paint(cr);
 
-	cairo_set_scaled_font(cr, terminal->font_normal);
-
-	extents = terminal->extents;
-	average_width = terminal->average_width;
-	side_margin = (allocation.width - terminal->width * average_width) / 2;
-	top_margin = (allocation.height - terminal->height * extents.height) / 2;
-
-	cairo_set_line_width(cr, 1.0);
-	cairo_translate(cr, allocation.x + side_margin,
-			allocation.y + top_margin);
-	/* paint the background */
-	for (row = 0; row < terminal->height; row++) {
-		p_row = terminal_get_row(terminal, row);
-		for (col = 0; col < terminal->width; col++) {
-			/* get the attributes for this character cell */
+	/* paint the background, one rectangle per run of cells that
+	 * share a colour */
+	bg = terminal->color_scheme->border;
+	start_x = end_x = 0;
+	for (col = 0; col <= terminal->width; col++) {
+		if (col < terminal->width)
 			terminal_decode_attr(terminal, row, col, &attr);
 
-			if (attr.attr.bg == terminal->color_scheme->border)
-				continue;
-
-			if (is_wide(p_row[col]))
-				unichar_width = 2 * average_width;
-			else
-				unichar_width = average_width;
-
-			terminal_set_color(terminal, cr, attr.attr.bg);
-			cairo_move_to(cr, col * average_width,
-				      row * extents.height);
-			cairo_rel_line_to(cr, unichar_width, 0);
-			cairo_rel_line_to(cr, 0, extents.height);
-			cairo_rel_line_to(cr, -unichar_width, 0);
-			cairo_close_path(cr);
-			cairo_fill(cr);
+		if (col == terminal->width || attr.attr.bg != bg) {
+			if (bg != terminal->color_scheme->border) {
+				terminal_set_color(terminal, cr, bg);
+				cairo_rectangle(cr, start_x, y,
+						end_x - start_x, height);
+				cairo_fill(cr);
+			}
+			if (col == terminal->width)
+				break;
+			bg = attr.attr.bg;
+			start_x = end_x = col * average_width;
 		}
+
+		if (is_wide(p_row[col]))
+			d = (col + 2) * average_width;
+		else
+			d = (col + 1) * average_width;
+		if (d > end_x)
+			end_x = d;
 	}
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 
 	/* paint the foreground */
 	glyph_run_init(&run, terminal, cr);
-	for (row = 0; row < terminal->height; row++) {
-		p_row = terminal_get_row(terminal, row);
-		for (col = 0; col < terminal->width; col++) {
-			/* get the attributes for this character cell */
-			terminal_decode_attr(terminal, row, col, &attr);
-
-			glyph_run_flush(&run, attr);
-
-			text_x = col * average_width;
-			text_y = extents.ascent + row * extents.height;
-			if (attr.attr.a & ATTRMASK_UNDERLINE) {
-				terminal_set_color(terminal, cr, attr.attr.fg);
-				cairo_move_to(cr, text_x, (double)text_y + 1.5);
-				cairo_line_to(cr, text_x + average_width, (double) text_y + 1.5);
-				cairo_stroke(cr);
-			}
+	for (col = 0; col < terminal->width; col++) {
+		/* get the attributes for this character cell */
+		terminal_decode_attr(terminal, row, col, &attr);
+
+		glyph_run_flush(&run, attr);
+
+		text_x = col * average_width;
+		text_y = terminal->extents.ascent + y;
+		if (attr.attr.a & ATTRMASK_UNDERLINE) {
+			terminal_set_color(terminal, cr, attr.attr.fg);
+			cairo_move_to(cr, text_x, (double)text_y + 1.5);
+			cairo_line_to(cr, text_x + average_width, (double) text_y + 1.5);
+			cairo_stroke(cr);
+		}
 
-                        /* skip space glyph (RLE) we use as a placeholder of
-                           the right half of a double-width character,
-                           because RLE is not available in every font. */
-			if (p_row[col].ch == 0x200B)
-				continue;
+                /* skip space glyph (RLE) we use as a placeholder of
+                   the right half of a double-width character,
+                   because RLE is not available in every font. */
+		if (p_row[col].ch == 0x200B)
+			continue;
 
-			glyph_run_add(&run, text_x, text_y, &p_row[col]);
-		}
+		glyph_run_add(&run, text_x, text_y, &p_row[col]);
 	}
 
 	attr.key = ~0;
 	glyph_run_flush(&run, attr);
 
-	if ((terminal->mode & MODE_SHOW_CURSOR) &&
+	if (row == terminal->row &&
+	    (terminal->mode & MODE_SHOW_CURSOR) &&
 	    !window_has_focus(terminal->window)) {
 		d = 0.5;
 
 		cairo_set_line_width(cr, 1);
 		cairo_move_to(cr, terminal->column * average_width + d,
-			      terminal->row * extents.height + d);
+			      y + d);
 		cairo_rel_line_to(cr, average_width - 2 * d, 0);
-		cairo_rel_line_to(cr, 0, extents.height - 2 * d);
+		cairo_rel_line_to(cr, 0, height - 2 * d);
 		cairo_rel_line_to(cr, -average_width + 2 * d, 0);
 		cairo_close_path(cr);
 
 		cairo_stroke(cr);
 	}
 
-	cairo_pop_group_to_source(cr);
+	cairo_restore(cr);
+}
+
+/* Moves the rendered rows first to last of the backing store by d rows,
+ * upwards for positive d, the way terminal_scroll() moves their
+ * contents. */
+static void
+terminal_blit_rows(struct terminal *terminal, int top_margin,
+		   int first, int last, int d)
+{
+	unsigned char *data;
+	int stride, row_size, rows;
+
+	rows = last - first + 1 - abs(d);
+	if (d == 0 || rows <= 0)
+		return;
+
+	stride = cairo_image_surface_get_stride(terminal->backing);
+	row_size = terminal->extents.height * terminal->backing_scale * stride;
+
+	cairo_surface_flush(terminal->backing);
+	data = cairo_image_surface_get_data(terminal->backing) +
+		top_margin * terminal->backing_scale * stride;
+	if (d > 0)
+		memmove(data + first * row_size,
+			data + (first + d) * row_size, rows * row_size);
+	else
+		memmove(data + (first - d) * row_size,
+			data + first * row_size, rows * row_size);
+	cairo_surface_mark_dirty(terminal->backing);
+}
+
+static void
+terminal_mark_selection(struct terminal *terminal, int *selection, int shift)
+{
+	if (selection[0] == selection[2] && selection[1] == selection[3])
+		return;
+
+	if (selection[0] < selection[2])
+		terminal_mark_dirty(terminal, selection[0] - shift,
+				    selection[2] - shift);
+	else
+		terminal_mark_dirty(terminal, selection[2] - shift,
+				    selection[0] - shift);
+}
+
+static void
+redraw_handler(struct widget *widget, void *data)
+{
+	struct terminal *terminal = data;
+	struct rectangle allocation;
+	cairo_t *cr;
+	int top_margin, side_margin;
+	int row, i, cursor_x, cursor_y, scale, shift;
+	int selection[4];
+	cairo_surface_t *surface;
+	cairo_font_extents_t extents;
+	double average_width;
+
+	surface = window_get_surface(terminal->window);
+	widget_get_allocation(terminal->widget, &allocation);
+	scale = window_get_buffer_scale(terminal->window);
+
+	extents = terminal->extents;
+	average_width = terminal->average_width;
+	side_margin = (allocation.width - terminal->width * average_width) / 2;
+	top_margin = (allocation.height - terminal->height * extents.height) / 2;
+
+	/* The cells are rendered into a backing store that persists
+	 * between frames, so only the rows that changed since the last
+	 * frame need to be drawn again and scrolling can move the rows
+	 * that are already there. */
+	if (!terminal->backing || terminal->backing_scale != scale ||
+	    cairo_image_surface_get_width(terminal->backing) !=
+	    allocation.width * scale ||
+	    cairo_image_surface_get_height(terminal->backing) !=
+	    allocation.height * scale) {
+		if (terminal->backing)
+			cairo_surface_destroy(terminal->backing);
+		terminal->backing =
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+						   allocation.width * scale,
+						   allocation.height * scale);
+		terminal->backing_scale = scale;
+		terminal->redraw_all = 1;
+	}
+
+	if (allocation.height < terminal->height * extents.height ||
+	    ((terminal->mode ^ terminal->drawn_mode) & MODE_INVERSE))
+		terminal->redraw_all = 1;
+
+	shift = terminal->start - terminal->drawn_start;
+	if (abs(shift) >= terminal->height)
+		terminal->redraw_all = 1;
+
+	if (terminal->blit.d != 0) {
+		if (!terminal->redraw_all &&
+		    terminal->blit.start == terminal->start)
+			terminal_blit_rows(terminal, top_margin,
+					   terminal->blit.top,
+					   terminal->blit.bottom,
+					   terminal->blit.d);
+		else
+			for (i = terminal->blit.top;
+			     i <= terminal->blit.bottom; i++)
+				terminal->dirty[(i + terminal->blit.start) &
+						(terminal->buffer_height - 1)] = 1;
+		terminal->blit.d = 0;
+	}
+
+	if (!terminal->redraw_all && shift != 0) {
+		terminal_blit_rows(terminal, top_margin,
+				   0, terminal->height - 1, shift);
+		if (shift > 0)
+			terminal_mark_dirty(terminal, terminal->height - shift,
+					    terminal->height - 1);
+		else
+			terminal_mark_dirty(terminal, 0, -shift - 1);
+	}
+
+	/* The cursor and the selection aren't part of the cells, so redraw
+	 * wherever they were and are now. */
+	terminal_mark_dirty(terminal, terminal->drawn_row - shift,
+			    terminal->drawn_row - shift);
+	terminal_mark_dirty(terminal, terminal->row, terminal->row);
+
+	selection[0] = terminal->selection_start_row;
+	selection[1] = terminal->selection_start_col;
+	selection[2] = terminal->selection_end_row;
+	selection[3] = terminal->selection_end_col;
+	if (selection[0] != terminal->drawn_selection[0] - shift ||
+	    selection[1] != terminal->drawn_selection[1] ||
+	    selection[2] != terminal->drawn_selection[2] - shift ||
+	    selection[3] != terminal->drawn_selection[3]) {
+		terminal_mark_selection(terminal,
+					terminal->drawn_selection, shift);
+		terminal_mark_selection(terminal, selection, 0);
+	}
+
+	cr = cairo_create(terminal->backing);
+	cairo_scale(cr, scale, scale);
+	if (terminal->redraw_all) {
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+		terminal_set_color(terminal, cr,
+				   terminal->color_scheme->border);
+		cairo_paint(cr);
+	}
+
+	cairo_set_line_width(cr, 1.0);
+	cairo_translate(cr, side_margin, top_margin);
+	for (row = 0; row < terminal->height; row++) {
+		if (terminal->redraw_all || terminal_is_dirty(terminal, row))
+			terminal_draw_row(terminal, cr, row, -side_margin,
+					  allocation.width - side_margin);
+		terminal->dirty[terminal_row_index(terminal, row)] = 0;
+	}
+	cairo_destroy(cr);
+
+	terminal->redraw_all = 0;
+	terminal->drawn_start = terminal->start;
+	terminal->drawn_mode = terminal->mode;
+	terminal->drawn_row = terminal->row;
+	memcpy(terminal->drawn_selection, selection, sizeof selection);
+
+	cr = widget_cairo_create(terminal->widget);
+	cairo_rectangle(cr, allocation.x, allocation.y,
+			allocation.width, allocation.height);
+	cairo_clip(cr);
+	cairo_translate(cr, allocation.x, allocation.y);
+	cairo_scale(cr, 1.0 / scale, 1.0 / scale);
+	cairo_set_source_surface(cr, terminal->backing, 0, 0);
 	cairo_paint(cr);
 	cairo_destroy(cr);
 	cairo_surface_destroy(surface);
@@ -1156,6 +1566,67 @@ redraw_handler(struct widget *widget, void *data)
 	}
 }
 
+static void
+terminal_damage_rows(struct terminal *terminal, struct rectangle *allocation,
+		     int top_margin, int first, int last)
+{
+	if (first < 0)
+		first = 0;
+	if (last >= terminal->height)
+		last = terminal->height - 1;
+	if (first > last)
+		return;
+
+	widget_schedule_redraw_area(terminal->widget, allocation->x,
+				    allocation->y + top_margin +
+				    first * terminal->extents.height,
+				    allocation->width,
+				    (last - first + 1) *
+				    terminal->extents.height);
+}
+
+/* Like widget_schedule_redraw(), but only damages the rows that
+ * redraw_handler() is going to draw again. */
+static void
+terminal_schedule_redraw(struct terminal *terminal)
+{
+	struct rectangle allocation;
+	int top_margin, row, first;
+
+	if (terminal->redraw_all || !terminal->backing ||
+	    terminal->start != terminal->drawn_start ||
+	    ((terminal->mode ^ terminal->drawn_mode) & MODE_INVERSE)) {
+		widget_schedule_redraw(terminal->widget);
+		return;
+	}
+
+	widget_get_allocation(terminal->widget, &allocation);
+	top_margin = (allocation.height -
+		      terminal->height * terminal->extents.height) / 2;
+
+	if (terminal->blit.d != 0)
+		terminal_damage_rows(terminal, &allocation, top_margin,
+				     terminal->blit.top, terminal->blit.bottom);
+
+	terminal_damage_rows(terminal, &allocation, top_margin,
+			     terminal->drawn_row, terminal->drawn_row);
+	terminal_damage_rows(terminal, &allocation, top_margin,
+			     terminal->row, terminal->row);
+
+	row = 0;
+	while (row < terminal->height) {
+		if (!terminal_is_dirty(terminal, row)) {
+			row++;
+			continue;
+		}
+		first = row;
+		while (row < terminal->height && terminal_is_dirty(terminal, row))
+			row++;
+		terminal_damage_rows(terminal, &allocation, top_margin,
+				     first, row - 1);
+	}
+}
+
 static void
 terminal_write(struct terminal *terminal, const char *data, size_t length)
 {
@@ -1204,6 +1675,7 @@ handle_term_parameter(struct terminal *terminal, int code, int sr)
 				attr_init(terminal_get_attr_row(terminal, i),
 				    terminal->curr_attr, terminal->width);
 			}
+			terminal->redraw_all = 1;
 			break;
 		case 5:  /* DECSCNM */
 			if (sr)	terminal->mode |=  MODE_INVERSE;
@@ -1431,6 +1903,8 @@ handle_escape(struct terminal *terminal)
 				attr_init(terminal_get_attr_row(terminal, i),
 				    terminal->curr_attr, terminal->width);
 			}
+			terminal_mark_dirty(terminal, terminal->row,
+					    terminal->height - 1);
 		} else if (args[0] == 1) {
 			memset(row, 0, (terminal->column+1) * sizeof(union utf8_char));
 			attr_init(attr_row, terminal->curr_attr, terminal->column+1);
@@ -1440,6 +1914,7 @@ handle_escape(struct terminal *terminal)
 				attr_init(terminal_get_attr_row(terminal, i),
 				    terminal->curr_attr, terminal->width);
 			}
+			terminal_mark_dirty(terminal, 0, terminal->row);
 		} else if (args[0] == 2) {
 			/* Clear screen by scrolling contents out */
 			terminal_scroll_buffer(terminal,
@@ -1461,6 +1936,7 @@ handle_escape(struct terminal *terminal)
 			memset(row, 0, terminal->data_pitch);
 			attr_init(attr_row, terminal->curr_attr, terminal->width);
 		}
+		terminal_mark_dirty(terminal, terminal->row, terminal->row);
 		break;
 	case 'L':    /* IL */
 		count = set[0] ? args[0] : 1;
@@ -1477,6 +1953,8 @@ handle_escape(struct terminal *terminal)
 			       0, terminal->data_pitch);
 			attr_init(terminal_get_attr_row(terminal, terminal->row),
 				terminal->curr_attr, terminal->width);
+			terminal_mark_dirty(terminal, terminal->row,
+					    terminal->row);
 		}
 		break;
 	case 'M':    /* DL */
@@ -1492,6 +1970,8 @@ handle_escape(struct terminal *terminal)
 		} else if (terminal->row == terminal->margin_bottom) {
 			memset(terminal_get_row(terminal, terminal->row),
 			       0, terminal->data_pitch);
+			terminal_mark_dirty(terminal, terminal->row,
+					    terminal->row);
 		}
 		break;
 	case 'P':    /* DCH */
@@ -1514,6 +1994,7 @@ handle_escape(struct terminal *terminal)
 		attr_row = terminal_get_attr_row(terminal, terminal->row);
 		memset(&row[terminal->column], 0, count * sizeof(union utf8_char));
 		attr_init(&attr_row[terminal->column], terminal->curr_attr, count);
+		terminal_mark_dirty(terminal, terminal->row, terminal->row);
 		break;
 	case 'Z':    /* CBT */
 		count = set[0] ? args[0] : 1;
@@ -1743,17 +2224,20 @@ handle_non_csi_escape(struct terminal *terminal, char code)
 static void
 handle_special_escape(struct terminal *terminal, char special, char code)
 {
-	int i, numChars;
+	union utf8_char *row;
+	int i, j;
 
 	if (special == '#') {
 		switch(code) {
 		case '8':
 			/* fill with 'E', no cheap way to do this */
-			memset(terminal->data, 0, terminal->data_pitch * terminal->height);
-			numChars = terminal->width * terminal->height;
-			for(i = 0; i < numChars; i++) {
-				terminal->data[i].byte[0] = 'E';
+			for (i = 0; i < terminal->height; i++) {
+				row = terminal_get_row(terminal, i);
+				memset(row, 0, terminal->data_pitch);
+				for (j = 0; j < terminal->width; j++)
+					row[j].byte[0] = 'E';
 			}
+			terminal->redraw_all = 1;
 			break;
 		default:
 			fprintf(stderr, "Unknown HASH escape #%c\n", code);
@@ -1902,6 +2386,7 @@ handle_special_char(struct terminal *terminal, char c)
 			terminal->column++;
 			if (terminal->tab_ruler[terminal->column]) break;
 		}
+		terminal_mark_dirty(terminal, terminal->row, terminal->row);
 		if (terminal->column >= terminal->width) {
 			terminal->column = terminal->width - 1;
 		}
@@ -1984,6 +2469,7 @@ handle_char(struct terminal *terminal, union utf8_char utf8)
 		terminal_shift_line(terminal, +1);
 	row[terminal->column] = utf8;
 	attr_row[terminal->column++] = terminal->curr_attr;
+	terminal_mark_dirty(terminal, terminal->row, terminal->row);
 
 	if (terminal->row + terminal->start + 1 > terminal->end)
 		terminal->end = terminal->row + terminal->start + 1;
@@ -2167,7 +2653,7 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 		} /* if */
 	} /* for */
 
-	window_schedule_redraw(terminal->window);
+	terminal_schedule_redraw(terminal);
 }
 
 static void
@@ -2910,7 +3396,15 @@ terminal_create(struct display *display)
 
 	terminal->display = display;
 	terminal->margin = 5;
-	terminal->buffer_height = 1024;
+	/* Rows are found by masking, so keep the buffer a power of two */
+	terminal->buffer_height = 256;
+	while (terminal->buffer_height < (uint32_t) option_scrollback_lines &&
+	       terminal->buffer_height < MAX_SCROLLBACK_LINES)
+		terminal->buffer_height <<= 1;
+	terminal->lines = xzalloc(terminal->buffer_height *
+				  sizeof *terminal->lines);
+	terminal->dirty = xzalloc(terminal->buffer_height);
+	terminal->redraw_all = 1;
 	terminal->end = 1;
 
 	window_set_user_data(terminal->window, terminal);
@@ -2951,6 +3445,8 @@ terminal_create(struct display *display)
 	cairo_scaled_font_reference(terminal->font_normal);
 
 	cairo_font_extents(cr, &terminal->extents);
+	/* Whole pixel rows, so scrolling can move the rendered rows as is */
+	terminal->extents.height = ceil(terminal->extents.height);
 
 	/* Compute the average ascii glyph width */
 	cairo_text_extents(cr, TERMINAL_DRAW_SINGLE_WIDE_CHARACTERS,
@@ -2974,6 +3470,8 @@ terminal_create(struct display *display)
 static void
 terminal_destroy(struct terminal *terminal)
 {
+	uint32_t i;
+
 	display_unwatch_fd(terminal->display, terminal->master);
 	window_destroy(terminal->window);
 	close(terminal->master);
@@ -2982,6 +3480,16 @@ terminal_destroy(struct terminal *terminal)
 	if (wl_list_empty(&terminal_list))
 		display_exit(terminal->display);
 
+	if (terminal->backing)
+		cairo_surface_destroy(terminal->backing);
+	for (i = 0; i < terminal->buffer_height; i++) {
+		free(terminal->lines[i].data);
+		free(terminal->lines[i].attr);
+		free(terminal->lines[i].runs);
+	}
+	free(terminal->lines);
+	free(terminal->tab_ruler);
+	free(terminal->dirty);
 	free(terminal->title);
 	free(terminal);
 }
@@ -3044,6 +3552,8 @@ static const struct weston_option terminal_options[] = {
 	{ WESTON_OPTION_STRING, "font", 0, &option_font },
 	{ WESTON_OPTION_INTEGER, "font-size", 0, &option_font_size },
 	{ WESTON_OPTION_STRING, "shell", 0, &option_shell },
+	{ WESTON_OPTION_INTEGER, "scrollback-lines", 0,
+	  &option_scrollback_lines },
 };
 
 int main(int argc, char *argv[])
@@ -3066,6 +3576,8 @@ int main(int argc, char *argv[])
 	weston_config_section_get_string(s, "font", &option_font, "mono");
 	weston_config_section_get_int(s, "font-size", &option_font_size, 14);
 	weston_config_section_get_string(s, "term", &option_term, "xterm");
+	weston_config_section_get_int(s, "scrollback-lines",
+				      &option_scrollback_lines, 1024);
 	weston_config_destroy(config);
 
 	if (parse_options(terminal_options,
@@ -3074,7 +3586,8 @@ int main(int argc, char *argv[])
 		       "  --fullscreen or -f\n"
 		       "  --font=NAME\n"
 		       "  --font-size=SIZE\n"
-		       "  --shell=NAME\n", argv[0]);
+		       "  --shell=NAME\n"
+		       "  --scrollback-lines=LINES\n", argv[0]);
 		return 1;
 	}
 
@@ -87,6 +87,8 @@ struct display {
 	struct wl_compositor *compositor;
 	struct wl_subcompositor *subcompositor;
 	struct wl_shm *shm;
+	struct wl_list shm_pool_list;
+	size_t shm_allocated;		/* bytes in blocks in use */
 	struct wl_data_device_manager *data_device_manager;
 	struct text_cursor_position *text_cursor_position;
 	struct workspace_manager *workspace_manager;
@@ -148,11 +150,15 @@ struct toysurface {
 	 * width,height are the new buffer size.
 	 * If flags has SURFACE_HINT_RESIZE set, the user is
 	 * doing continuous resizing.
+	 * damage is the area, in surface coordinates, that is going to
+	 * be redrawn. It is extended by what the buffer does not
+	 * already hold.
 	 * Returns the Cairo surface to draw to.
 	 */
 	cairo_surface_t *(*prepare)(struct toysurface *base, int dx, int dy,
 				    int32_t width, int32_t height, uint32_t flags,
-				    enum wl_output_transform buffer_transform, int32_t buffer_scale);
+				    enum wl_output_transform buffer_transform, int32_t buffer_scale,
+				    cairo_region_t *damage);
 
 	/*
 	 * Post the surface to the server, returning the server allocation
@@ -161,6 +167,7 @@ struct toysurface {
 	 */
 	void (*swap)(struct toysurface *base,
 		     enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		     cairo_region_t *damage,
 		     struct rectangle *server_allocation);
 
 	/*
@@ -198,6 +205,12 @@ struct surface {
 	struct rectangle allocation;
 	struct rectangle server_allocation;
 
+	/* In surface coordinates: what to redraw next time, and what
+	 * is being redrawn now */
+	cairo_region_t *pending_damage;
+	int pending_damage_all;
+	cairo_region_t *damage;
+
 	struct wl_region *input_region;
 	struct wl_region *opaque_region;
 
@@ -396,13 +409,30 @@ struct tooltip {
 	float x, y;
 };
 
+/* Buffers of a display are sub-allocated from a few shared pools, so
+ * that neither side has to map new memory for every buffer. */
 struct shm_pool {
+	struct display *display;
 	struct wl_shm_pool *pool;
 	size_t size;
-	size_t used;
 	void *data;
+	int allocated;			/* blocks in use */
+	struct wl_list block_list;	/* in address order */
+	struct wl_list link;		/* display::shm_pool_list */
+};
+
+struct shm_block {
+	struct shm_pool *pool;
+	size_t offset;
+	size_t size;
+	int free;
+	struct wl_list link;		/* shm_pool::block_list */
 };
 
+/* Pools are never smaller than this */
+#define SHM_POOL_MIN_SIZE (1024 * 1024)
+#define SHM_PAGE_SIZE 4096
+
 enum {
 	CURSOR_DEFAULT = 100,
 	CURSOR_UNSET
@@ -517,9 +547,14 @@ to_egl_window_surface(struct toysurface *base)
 static cairo_surface_t *
 egl_window_surface_prepare(struct toysurface *base, int dx, int dy,
 			   int32_t width, int32_t height, uint32_t flags,
-			   enum wl_output_transform buffer_transform, int32_t buffer_scale)
+			   enum wl_output_transform buffer_transform, int32_t buffer_scale,
+			   cairo_region_t *damage)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
+	cairo_rectangle_int_t all = { 0, 0, width, height };
+
+	/* Nothing is known about what the back buffer holds */
+	cairo_region_union_rectangle(damage, &all);
 
 	surface_to_buffer_size (buffer_transform, buffer_scale, &width, &height);
 
@@ -532,6 +567,7 @@ egl_window_surface_prepare(struct toysurface *base, int dx, int dy,
 static void
 egl_window_surface_swap(struct toysurface *base,
 			enum wl_output_transform buffer_transform, int32_t buffer_scale,
+			cairo_region_t *damage,
 			struct rectangle *server_allocation)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
@@ -660,7 +696,7 @@ egl_window_surface_create(struct display *display,
 
 struct shm_surface_data {
 	struct wl_buffer *buffer;
-	struct shm_pool *pool;
+	struct shm_block *block;
 };
 
 struct wl_buffer *
@@ -675,7 +711,7 @@ display_get_buffer_for_surface(struct display *display,
 }
 
 static void
-shm_pool_destroy(struct shm_pool *pool);
+shm_block_free(struct shm_block *block);
 
 static void
 shm_surface_data_destroy(void *p)
@@ -683,8 +719,7 @@ shm_surface_data_destroy(void *p)
 	struct shm_surface_data *data = p;
 
 	wl_buffer_destroy(data->buffer);
-	if (data->pool)
-		shm_pool_destroy(data->pool);
+	shm_block_free(data->block);
 
 	free(data);
 }
@@ -720,70 +755,170 @@ static struct shm_pool *
 shm_pool_create(struct display *display, size_t size)
 {
 	struct shm_pool *pool = malloc(sizeof *pool);
+	struct shm_block *block;
 
 	if (!pool)
 		return NULL;
 
+	block = malloc(sizeof *block);
+	if (!block) {
+		free(pool);
+		return NULL;
+	}
+
 	pool->pool = make_shm_pool(display, size, &pool->data);
 	if (!pool->pool) {
+		free(block);
 		free(pool);
 		return NULL;
 	}
 
+	pool->display = display;
 	pool->size = size;
-	pool->used = 0;
+	pool->allocated = 0;
+	wl_list_init(&pool->block_list);
+	wl_list_insert(display->shm_pool_list.prev, &pool->link);
 
-	return pool;
-}
+	block->pool = pool;
+	block->offset = 0;
+	block->size = size;
+	block->free = 1;
+	wl_list_insert(&pool->block_list, &block->link);
 
-static void *
-shm_pool_allocate(struct shm_pool *pool, size_t size, int *offset)
-{
-	if (pool->used + size > pool->size)
-		return NULL;
-
-	*offset = pool->used;
-	pool->used += size;
-
-	return (char *) pool->data + *offset;
+	return pool;
 }
 
-/* destroy the pool. this does not unmap the memory though */
+/* destroy the pool, along with whatever blocks are left in it */
 static void
 shm_pool_destroy(struct shm_pool *pool)
 {
+	struct shm_block *block, *next;
+
+	wl_list_for_each_safe(block, next, &pool->block_list, link)
+		free(block);
+
 	munmap(pool->data, pool->size);
 	wl_shm_pool_destroy(pool->pool);
+	wl_list_remove(&pool->link);
 	free(pool);
 }
 
-/* Start allocating from the beginning of the pool again */
+/* Rounds a buffer size up to whole pages, and then to one of eight
+ * sizes per power of two, so a released block is likely to be the right
+ * size for a later buffer of about the same dimensions. */
+static size_t
+shm_size_class(size_t size)
+{
+	size_t step = SHM_PAGE_SIZE;
+
+	while (step * 16 <= size)
+		step *= 2;
+
+	return (size + step - 1) & ~(step - 1);
+}
+
+/* Best fit over the free blocks of all pools of the display. Only when
+ * nothing fits is a new pool created, large enough for the request and
+ * for as much again as is in use, so the number of pools stays small
+ * while it grows with what the display actually uses. */
+static struct shm_block *
+shm_block_alloc(struct display *display, size_t size)
+{
+	struct shm_pool *pool;
+	struct shm_block *block, *best = NULL, *rest;
+	size_t pool_size;
+
+	size = shm_size_class(size);
+
+	wl_list_for_each(pool, &display->shm_pool_list, link) {
+		wl_list_for_each(block, &pool->block_list, link) {
+			if (block->free && block->size >= size &&
+			    (!best || block->size < best->size))
+				best = block;
+		}
+	}
+
+	if (!best) {
+		pool_size = display->shm_allocated + size;
+		if (pool_size < SHM_POOL_MIN_SIZE)
+			pool_size = SHM_POOL_MIN_SIZE;
+		pool = shm_pool_create(display, pool_size);
+		if (!pool)
+			return NULL;
+		best = container_of(pool->block_list.next,
+				    struct shm_block, link);
+	}
+
+	if (best->size > size) {
+		rest = malloc(sizeof *rest);
+		if (rest) {
+			rest->pool = best->pool;
+			rest->offset = best->offset + size;
+			rest->size = best->size - size;
+			rest->free = 1;
+			wl_list_insert(&best->link, &rest->link);
+			best->size = size;
+		}
+	}
+
+	best->free = 0;
+	best->pool->allocated++;
+	display->shm_allocated += best->size;
+
+	return best;
+}
+
 static void
-shm_pool_reset(struct shm_pool *pool)
+shm_block_merge(struct shm_block *block, struct shm_block *next)
 {
-	pool->used = 0;
+	block->size += next->size;
+	wl_list_remove(&next->link);
+	free(next);
 }
 
-static int
-data_length_for_shm_surface(struct rectangle *rect)
+/* Returns the block to its pool. A pool that is left empty is unmapped,
+ * unless it is the only one the display has and not larger than the
+ * minimum, which keeps a display that was briefly using a lot from
+ * holding on to it. */
+static void
+shm_block_free(struct shm_block *block)
 {
-	int stride;
+	struct shm_pool *pool = block->pool;
+	struct display *display = pool->display;
+	struct shm_block *other;
+
+	block->free = 1;
+	pool->allocated--;
+	display->shm_allocated -= block->size;
+
+	if (block->link.next != &pool->block_list) {
+		other = container_of(block->link.next, struct shm_block, link);
+		if (other->free)
+			shm_block_merge(block, other);
+	}
+	if (block->link.prev != &pool->block_list) {
+		other = container_of(block->link.prev, struct shm_block, link);
+		if (other->free)
+			shm_block_merge(other, block);
+	}
 
-	stride = cairo_format_stride_for_width (CAIRO_FORMAT_ARGB32,
-						rect->width);
-	return stride * rect->height;
+	if (pool->allocated == 0 &&
+	    (pool->size > SHM_POOL_MIN_SIZE ||
+	     pool->link.prev != &display->shm_pool_list ||
+	     pool->link.next != &display->shm_pool_list))
+		shm_pool_destroy(pool);
 }
 
 static cairo_surface_t *
-display_create_shm_surface_from_pool(struct display *display,
-				     struct rectangle *rectangle,
-				     uint32_t flags, struct shm_pool *pool)
+display_create_shm_surface(struct display *display,
+			   struct rectangle *rectangle, uint32_t flags,
+			   struct shm_surface_data **data_ret)
 {
 	struct shm_surface_data *data;
 	uint32_t format;
 	cairo_surface_t *surface;
 	cairo_format_t cairo_format;
-	int stride, length, offset;
+	int stride, length;
 	void *map;
 
 	data = malloc(sizeof *data);
@@ -797,13 +932,12 @@ display_create_shm_surface_from_pool(struct display *display,
 
 	stride = cairo_format_stride_for_width (cairo_format, rectangle->width);
 	length = stride * rectangle->height;
-	data->pool = NULL;
-	map = shm_pool_allocate(pool, length, &offset);
-
-	if (!map) {
+	data->block = shm_block_alloc(display, length);
+	if (!data->block) {
 		free(data);
 		return NULL;
 	}
+	map = (char *) data->block->pool->data + data->block->offset;
 
 	surface = cairo_image_surface_create_for_data (map,
 						       cairo_format,
@@ -823,56 +957,12 @@ display_create_shm_surface_from_pool(struct display *display,
 			format = WL_SHM_FORMAT_ARGB8888;
 	}
 
-	data->buffer = wl_shm_pool_create_buffer(pool->pool, offset,
+	data->buffer = wl_shm_pool_create_buffer(data->block->pool->pool,
+						 data->block->offset,
 						 rectangle->width,
 						 rectangle->height,
 						 stride, format);
 
-	return surface;
-}
-
-static cairo_surface_t *
-display_create_shm_surface(struct display *display,
-			   struct rectangle *rectangle, uint32_t flags,
-			   struct shm_pool *alternate_pool,
-			   struct shm_surface_data **data_ret)
-{
-	struct shm_surface_data *data;
-	struct shm_pool *pool;
-	cairo_surface_t *surface;
-
-	if (alternate_pool) {
-		shm_pool_reset(alternate_pool);
-		surface = display_create_shm_surface_from_pool(display,
-							       rectangle,
-							       flags,
-							       alternate_pool);
-		if (surface) {
-			data = cairo_surface_get_user_data(surface,
-							   &shm_surface_data_key);
-			goto out;
-		}
-	}
-
-	pool = shm_pool_create(display,
-			       data_length_for_shm_surface(rectangle));
-	if (!pool)
-		return NULL;
-
-	surface =
-		display_create_shm_surface_from_pool(display, rectangle,
-						     flags, pool);
-
-	if (!surface) {
-		shm_pool_destroy(pool);
-		return NULL;
-	}
-
-	/* make sure we destroy the pool when the surface is destroyed */
-	data = cairo_surface_get_user_data(surface, &shm_surface_data_key);
-	data->pool = pool;
-
-out:
 	if (data_ret)
 		*data_ret = data;
 
@@ -900,8 +990,7 @@ display_create_surface(struct display *display,
 		return NULL;
 
 	assert(flags & SURFACE_SHM);
-	return display_create_shm_surface(display, rectangle, flags,
-					  NULL, NULL);
+	return display_create_shm_surface(display, rectangle, flags, NULL);
 }
 
 struct shm_surface_leaf {
@@ -909,8 +998,11 @@ struct shm_surface_leaf {
 	/* 'data' is automatically destroyed, when 'cairo_surface' is */
 	struct shm_surface_data *data;
 
-	struct shm_pool *resize_pool;
 	int busy;
+
+	/* What was posted from other leaves since this one was, in
+	 * buffer coordinates. NULL when the contents are undefined. */
+	cairo_region_t *damage;
 };
 
 static void
@@ -920,8 +1012,8 @@ shm_surface_leaf_release(struct shm_surface_leaf *leaf)
 		cairo_surface_destroy(leaf->cairo_surface);
 	/* leaf->data already destroyed via cairo private */
 
-	if (leaf->resize_pool)
-		shm_pool_destroy(leaf->resize_pool);
+	if (leaf->damage)
+		cairo_region_destroy(leaf->damage);
 
 	memset(leaf, 0, sizeof *leaf);
 }
@@ -937,6 +1029,11 @@ struct shm_surface {
 
 	struct shm_surface_leaf leaf[MAX_LEAVES];
 	struct shm_surface_leaf *current;
+	struct shm_surface_leaf *last;
+
+	/* What the contents of the leaves were drawn with */
+	enum wl_output_transform buffer_transform;
+	int32_t buffer_scale;
 };
 
 static struct shm_surface *
@@ -1009,12 +1106,108 @@ static const struct wl_buffer_listener shm_surface_buffer_listener = {
 	shm_surface_buffer_release
 };
 
+/* Adds damage, in surface coordinates, to a region in the coordinates
+ * of a width x height buffer. */
+static void
+shm_surface_add_buffer_damage(cairo_region_t *region, cairo_region_t *damage,
+			      enum wl_output_transform buffer_transform,
+			      int32_t buffer_scale,
+			      int32_t width, int32_t height)
+{
+	cairo_rectangle_int_t r;
+	int i, n;
+
+	if (buffer_transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+		r.x = 0;
+		r.y = 0;
+		r.width = width;
+		r.height = height;
+		cairo_region_union_rectangle(region, &r);
+		return;
+	}
+
+	n = cairo_region_num_rectangles(damage);
+	for (i = 0; i < n; i++) {
+		cairo_region_get_rectangle(damage, i, &r);
+		r.x *= buffer_scale;
+		r.y *= buffer_scale;
+		r.width *= buffer_scale;
+		r.height *= buffer_scale;
+		cairo_region_union_rectangle(region, &r);
+	}
+}
+
+/*
+ * Makes the leaf hold the last posted contents everywhere outside of
+ * damage, which the caller redraws. Leaves rotate, so rather than
+ * redrawing what changed since this leaf was posted, that is copied
+ * from the last posted leaf. When there is nothing to copy from,
+ * damage is extended to the whole surface instead.
+ */
+static void
+shm_surface_repair(struct shm_surface *surface, struct shm_surface_leaf *leaf,
+		   cairo_region_t *damage,
+		   enum wl_output_transform buffer_transform,
+		   int32_t buffer_scale,
+		   int32_t width, int32_t height)
+{
+	struct shm_surface_leaf *last = surface->last;
+	cairo_rectangle_int_t all = { 0, 0, width, height }, r;
+	cairo_region_t *copy, *redraw;
+	cairo_t *cr;
+	int i, n;
+
+	if (!leaf->damage ||
+	    buffer_transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    (leaf != last &&
+	     (!last || !last->cairo_surface ||
+	      cairo_image_surface_get_width(last->cairo_surface) !=
+	      cairo_image_surface_get_width(leaf->cairo_surface) ||
+	      cairo_image_surface_get_height(last->cairo_surface) !=
+	      cairo_image_surface_get_height(leaf->cairo_surface)))) {
+		buffer_to_surface_size(buffer_transform, buffer_scale,
+				       &all.width, &all.height);
+		cairo_region_union_rectangle(damage, &all);
+		goto out;
+	}
+
+	if (leaf == last)
+		goto out;
+
+	redraw = cairo_region_create();
+	shm_surface_add_buffer_damage(redraw, damage, buffer_transform,
+				      buffer_scale, width, height);
+	copy = cairo_region_copy(leaf->damage);
+	cairo_region_subtract(copy, redraw);
+	cairo_region_destroy(redraw);
+
+	n = cairo_region_num_rectangles(copy);
+	if (n > 0) {
+		cr = cairo_create(leaf->cairo_surface);
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(cr, last->cairo_surface, 0, 0);
+		for (i = 0; i < n; i++) {
+			cairo_region_get_rectangle(copy, i, &r);
+			cairo_rectangle(cr, r.x, r.y, r.width, r.height);
+		}
+		cairo_fill(cr);
+		cairo_destroy(cr);
+	}
+
+	cairo_region_destroy(copy);
+
+out:
+	if (leaf->damage)
+		cairo_region_destroy(leaf->damage);
+	leaf->damage = cairo_region_create();
+}
+
 static cairo_surface_t *
 shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		    int32_t width, int32_t height, uint32_t flags,
-		    enum wl_output_transform buffer_transform, int32_t buffer_scale)
+		    enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		    cairo_region_t *damage)
 {
-	int resize_hint = !!(flags & SURFACE_HINT_RESIZE);
 	struct shm_surface *surface = to_shm_surface(base);
 	struct rectangle rect = { 0};
 	struct shm_surface_leaf *leaf = NULL;
@@ -1023,6 +1216,17 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 	surface->dx = dx;
 	surface->dy = dy;
 
+	if (buffer_transform != surface->buffer_transform ||
+	    buffer_scale != surface->buffer_scale) {
+		for (i = 0; i < MAX_LEAVES; i++) {
+			if (surface->leaf[i].damage)
+				cairo_region_destroy(surface->leaf[i].damage);
+			surface->leaf[i].damage = NULL;
+		}
+		surface->buffer_transform = buffer_transform;
+		surface->buffer_scale = buffer_scale;
+	}
+
 	/* pick a free buffer, preferrably one that already has storage */
 	for (i = 0; i < MAX_LEAVES; i++) {
 		if (surface->leaf[i].busy)
@@ -1031,6 +1235,12 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		if (!leaf || surface->leaf[i].cairo_surface)
 			leaf = &surface->leaf[i];
 	}
+
+	/* the last posted one needs no repair, if it is free already */
+	if (surface->last && !surface->last->busy &&
+	    surface->last->cairo_surface)
+		leaf = surface->last;
+
 	DBG_OBJ(surface->surface, "pick leaf %d\n",
 		(int)(leaf - &surface->leaf[0]));
 
@@ -1041,13 +1251,6 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		return NULL;
 	}
 
-	if (!resize_hint && leaf->resize_pool) {
-		cairo_surface_destroy(leaf->cairo_surface);
-		leaf->cairo_surface = NULL;
-		shm_pool_destroy(leaf->resize_pool);
-		leaf->resize_pool = NULL;
-	}
-
 	surface_to_buffer_size (buffer_transform, buffer_scale, &width, &height);
 
 	if (leaf->cairo_surface &&
@@ -1057,28 +1260,16 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 
 	if (leaf->cairo_surface)
 		cairo_surface_destroy(leaf->cairo_surface);
-
-#ifdef USE_RESIZE_POOL
-	if (resize_hint && !leaf->resize_pool) {
-		/* Create a big pool to allocate from, while continuously
-		 * resizing. Mmapping a new pool in the server
-		 * is relatively expensive, so reusing a pool performs
-		 * better, but may temporarily reserve unneeded memory.
-		 */
-		/* We should probably base this number on the output size. */
-		leaf->resize_pool = shm_pool_create(surface->display,
-						    6 * 1024 * 1024);
-	}
-#endif
+	if (leaf->damage)
+		cairo_region_destroy(leaf->damage);
+	leaf->damage = NULL;
 
 	rect.width = width;
 	rect.height = height;
 
 	leaf->cairo_surface =
 		display_create_shm_surface(surface->display, &rect,
-					   surface->flags,
-					   leaf->resize_pool,
-					   &leaf->data);
+					   surface->flags, &leaf->data);
 	if (!leaf->cairo_surface)
 		return NULL;
 
@@ -1088,21 +1279,30 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 out:
 	surface->current = leaf;
 
+	shm_surface_repair(surface, leaf, damage,
+			   buffer_transform, buffer_scale, width, height);
+
 	return cairo_surface_reference(leaf->cairo_surface);
 }
 
 static void
 shm_surface_swap(struct toysurface *base,
 		 enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		 cairo_region_t *damage,
 		 struct rectangle *server_allocation)
 {
 	struct shm_surface *surface = to_shm_surface(base);
 	struct shm_surface_leaf *leaf = surface->current;
+	struct shm_surface_leaf *other;
+	cairo_rectangle_int_t r;
+	int32_t width, height;
+	int i, n;
 
-	server_allocation->width =
-		cairo_image_surface_get_width(leaf->cairo_surface);
-	server_allocation->height =
-		cairo_image_surface_get_height(leaf->cairo_surface);
+	width = cairo_image_surface_get_width(leaf->cairo_surface);
+	height = cairo_image_surface_get_height(leaf->cairo_surface);
+
+	server_allocation->width = width;
+	server_allocation->height = height;
 
 	buffer_to_surface_size (buffer_transform, buffer_scale,
 				&server_allocation->width,
@@ -1110,10 +1310,32 @@ shm_surface_swap(struct toysurface *base,
 
 	wl_surface_attach(surface->surface, leaf->data->buffer,
 			  surface->dx, surface->dy);
-	wl_surface_damage(surface->surface, 0, 0,
-			  server_allocation->width, server_allocation->height);
+
+	n = cairo_region_num_rectangles(damage);
+	if (n > 32) {
+		cairo_region_get_extents(damage, &r);
+		wl_surface_damage(surface->surface,
+				  r.x, r.y, r.width, r.height);
+	} else {
+		for (i = 0; i < n; i++) {
+			cairo_region_get_rectangle(damage, i, &r);
+			wl_surface_damage(surface->surface,
+					  r.x, r.y, r.width, r.height);
+		}
+	}
 	wl_surface_commit(surface->surface);
 
+	for (i = 0; i < MAX_LEAVES; i++) {
+		other = &surface->leaf[i];
+		if (other == leaf || !other->damage)
+			continue;
+
+		shm_surface_add_buffer_damage(other->damage, damage,
+					      buffer_transform, buffer_scale,
+					      width, height);
+	}
+	surface->last = leaf;
+
 	DBG_OBJ(surface->surface, "leaf %d busy\n",
 		(int)(leaf - &surface->leaf[0]));
 
@@ -1330,11 +1552,20 @@ display_get_pointer_image(struct display *display, int pointer)
 	return cursor ? cursor->images[0] : NULL;
 }
 
+static void
+surface_clear_damage(struct surface *surface)
+{
+	cairo_region_destroy(surface->damage);
+	surface->damage = cairo_region_create();
+}
+
 static void
 surface_flush(struct surface *surface)
 {
-	if (!surface->cairo_surface)
+	if (!surface->cairo_surface) {
+		surface_clear_damage(surface);
 		return;
+	}
 
 	if (surface->opaque_region) {
 		wl_surface_set_opaque_region(surface->surface,
@@ -1352,10 +1583,12 @@ surface_flush(struct surface *surface)
 
 	surface->toysurface->swap(surface->toysurface,
 				  surface->buffer_transform, surface->buffer_scale,
+				  surface->damage,
 				  &surface->server_allocation);
 
 	cairo_surface_destroy(surface->cairo_surface);
 	surface->cairo_surface = NULL;
+	surface_clear_damage(surface);
 }
 
 int
@@ -1384,6 +1617,12 @@ surface_create_surface(struct surface *surface, uint32_t flags)
 {
 	struct display *display = surface->window->display;
 	struct rectangle allocation = surface->allocation;
+	cairo_rectangle_int_t all = { 0, 0,
+				      allocation.width, allocation.height };
+
+	/* Drawing outside of a redraw, assume all of it changes */
+	if (cairo_region_is_empty(surface->damage))
+		cairo_region_union_rectangle(surface->damage, &all);
 
 	if (!surface->toysurface && display->dpy &&
 	    surface->buffer_type == WINDOW_BUFFER_TYPE_EGL_WINDOW) {
@@ -1402,7 +1641,8 @@ surface_create_surface(struct surface *surface, uint32_t flags)
 	surface->cairo_surface = surface->toysurface->prepare(
 		surface->toysurface, 0, 0,
 		allocation.width, allocation.height, flags,
-		surface->buffer_transform, surface->buffer_scale);
+		surface->buffer_transform, surface->buffer_scale,
+		surface->damage);
 }
 
 static void
@@ -1488,6 +1728,9 @@ surface_destroy(struct surface *surface)
 	if (surface->toysurface)
 		surface->toysurface->destroy(surface->toysurface);
 
+	cairo_region_destroy(surface->pending_damage);
+	cairo_region_destroy(surface->damage);
+
 	wl_list_remove(&surface->link);
 	free(surface);
 }
@@ -1779,7 +2022,9 @@ widget_cairo_create(struct widget *widget)
 {
 	struct surface *surface = widget->surface;
 	cairo_surface_t *cairo_surface;
+	cairo_rectangle_int_t r;
 	cairo_t *cr;
+	int i, n;
 
 	cairo_surface = widget_get_cairo_surface(widget);
 	cr = cairo_create(cairo_surface);
@@ -1788,6 +2033,18 @@ widget_cairo_create(struct widget *widget)
 
 	cairo_translate(cr, -surface->allocation.x, -surface->allocation.y);
 
+	/* Everything outside of the damage is still valid */
+	n = cairo_region_num_rectangles(surface->damage);
+	if (n > 0) {
+		for (i = 0; i < n; i++) {
+			cairo_region_get_rectangle(surface->damage, i, &r);
+			cairo_rectangle(cr, r.x + surface->allocation.x,
+					r.y + surface->allocation.y,
+					r.width, r.height);
+		}
+		cairo_clip(cr);
+	}
+
 	return cr;
 }
 
@@ -1912,8 +2169,36 @@ window_schedule_redraw_task(struct window *window);
 void
 widget_schedule_redraw(struct widget *widget)
 {
-	DBG_OBJ(widget->surface->surface, "widget %p\n", widget);
-	widget->surface->redraw_needed = 1;
+	widget_schedule_redraw_area(widget,
+				    widget->allocation.x,
+				    widget->allocation.y,
+				    widget->allocation.width,
+				    widget->allocation.height);
+}
+
+/* The area is in the same coordinates as the widget allocation. */
+void
+widget_schedule_redraw_area(struct widget *widget, int32_t x, int32_t y,
+			    int32_t width, int32_t height)
+{
+	struct surface *surface = widget->surface;
+	cairo_rectangle_int_t r;
+
+	DBG_OBJ(surface->surface, "widget %p, %dx%d@%d,%d\n",
+		widget, width, height, x, y);
+
+	/* A widget without an allocation draws wherever it likes */
+	if (width <= 0 || height <= 0) {
+		surface->pending_damage_all = 1;
+	} else {
+		r.x = x - surface->allocation.x;
+		r.y = y - surface->allocation.y;
+		r.width = width;
+		r.height = height;
+		cairo_region_union_rectangle(surface->pending_damage, &r);
+	}
+
+	surface->redraw_needed = 1;
 	window_schedule_redraw_task(widget->window);
 }
 
@@ -4098,12 +4383,35 @@ window_get_allocation(struct window *window,
 	*allocation = window->main_surface->allocation;
 }
 
+static int
+widget_is_damaged(struct widget *widget)
+{
+	struct surface *surface = widget->surface;
+	cairo_rectangle_int_t r;
+
+	/* The root widget's redraw handler may do more than drawing,
+	 * as may those that do not draw with cairo */
+	if (widget == surface->widget || !widget->use_cairo)
+		return 1;
+
+	if (widget->allocation.width <= 0 || widget->allocation.height <= 0)
+		return 1;
+
+	r.x = widget->allocation.x - surface->allocation.x;
+	r.y = widget->allocation.y - surface->allocation.y;
+	r.width = widget->allocation.width;
+	r.height = widget->allocation.height;
+
+	return cairo_region_contains_rectangle(surface->damage, &r) !=
+		CAIRO_REGION_OVERLAP_OUT;
+}
+
 static void
 widget_redraw(struct widget *widget)
 {
 	struct widget *child;
 
-	if (widget->redraw_handler)
+	if (widget->redraw_handler && widget_is_damaged(widget))
 		widget->redraw_handler(widget, widget->user_data);
 	wl_list_for_each(child, &widget->child_list, link)
 		widget_redraw(child);
@@ -4131,6 +4439,25 @@ static const struct wl_callback_listener listener = {
 	frame_callback
 };
 
+/* Adds the damage scheduled so far to what the coming redraw covers */
+static void
+surface_take_damage(struct surface *surface)
+{
+	cairo_rectangle_int_t all = { 0, 0,
+				      surface->allocation.width,
+				      surface->allocation.height };
+
+	if (surface->pending_damage_all || surface->window->redraw_needed)
+		cairo_region_union_rectangle(surface->damage, &all);
+
+	cairo_region_union(surface->damage, surface->pending_damage);
+	cairo_region_intersect_rectangle(surface->damage, &all);
+
+	cairo_region_destroy(surface->pending_damage);
+	surface->pending_damage = cairo_region_create();
+	surface->pending_damage_all = 0;
+}
+
 static int
 surface_redraw(struct surface *surface)
 {
@@ -4150,6 +4477,8 @@ surface_redraw(struct surface *surface)
 		wl_callback_destroy(surface->frame_cb);
 	}
 
+	surface_take_damage(surface);
+
 	if (surface->widget->use_cairo &&
 	    !widget_get_cairo_surface(surface->widget)) {
 		DBG_OBJ(surface->surface, "cancelled due buffer failure\n");
@@ -4236,8 +4565,10 @@ window_schedule_redraw(struct window *window)
 
 	DBG_OBJ(window->main_surface->surface, "window %p\n", window);
 
-	wl_list_for_each(surface, &window->subsurface_list, link)
+	wl_list_for_each(surface, &window->subsurface_list, link) {
 		surface->redraw_needed = 1;
+		surface->pending_damage_all = 1;
+	}
 
 	window_schedule_redraw_task(window);
 }
@@ -4480,6 +4811,8 @@ surface_create(struct window *window)
 	surface->window = window;
 	surface->surface = wl_compositor_create_surface(display->compositor);
 	surface->buffer_scale = 1;
+	surface->pending_damage = cairo_region_create();
+	surface->damage = cairo_region_create();
 	wl_surface_add_listener(surface->surface, &surface_listener, window);
 
 	wl_list_insert(&window->subsurface_list, &surface->link);
@@ -5470,6 +5803,7 @@ display_create(int *argc, char *argv[])
 	wl_list_init(&d->input_list);
 	wl_list_init(&d->output_list);
 	wl_list_init(&d->global_list);
+	wl_list_init(&d->shm_pool_list);
 
 	d->workspace = 0;
 	d->workspace_count = 1;
@@ -5522,6 +5856,8 @@ display_destroy_inputs(struct display *display)
 void
 display_destroy(struct display *display)
 {
+	struct shm_pool *pool, *next;
+
 	if (!wl_list_empty(&display->window_list))
 		fprintf(stderr, "toytoolkit warning: %d windows exist.\n",
 			wl_list_length(&display->window_list));
@@ -5540,6 +5876,9 @@ display_destroy(struct display *display)
 	theme_destroy(display->theme);
 	destroy_cursors(display);
 
+	wl_list_for_each_safe(pool, next, &display->shm_pool_list, link)
+		shm_pool_destroy(pool);
+
 #ifdef HAVE_CAIRO_EGL
 	if (display->argb_device)
 		fini_egl(display);
@@ -526,6 +526,9 @@ widget_set_axis_handler(struct widget *widget,
 void
 widget_schedule_redraw(struct widget *widget);
 void
+widget_schedule_redraw_area(struct widget *widget, int32_t x, int32_t y,
+			    int32_t width, int32_t height);
+void
 widget_set_use_cairo(struct widget *widget, int use_cairo);
 
 struct widget *
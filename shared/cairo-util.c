@@ -47,90 +47,110 @@ surface_flush_device(cairo_surface_t *surface)
 		cairo_device_flush(device);
 }
 
+static inline uint64_t
+blur_unpack(uint32_t p)
+{
+	return (p & 0xff) | (p & 0xff00) << 8 |
+		(uint64_t) (p & 0xff0000) << 16 |
+		(uint64_t) (p & 0xff000000) << 24;
+}
+
+static inline uint32_t
+blur_pack(uint64_t sum, uint64_t mul)
+{
+	uint64_t rb, ag;
+
+	/* Dividing two lanes at a time leaves room for the products */
+	rb = ((sum & 0x0000ffff0000ffffULL) * mul >> 16) &
+		0x000000ff000000ffULL;
+	ag = ((sum >> 16 & 0x0000ffff0000ffffULL) * mul >> 16) &
+		0x000000ff000000ffULL;
+
+	return ((rb | rb >> 16) & 0x00ff00ff) |
+		((ag | ag >> 16) & 0x00ff00ff) << 8;
+}
+
+/* Box blur of n pixels, treating the pixels past either end as
+ * transparent.  The four channels are summed at once, as 16 bit lanes
+ * of a 64 bit integer. */
+static void
+blur_line(uint32_t *dst, const uint32_t *src, int n, int size)
+{
+	uint64_t sum, mul;
+	int i, half;
+
+	/* Rounded up, so the product truncates to the exact quotient */
+	mul = (65536 + size - 1) / size;
+	half = size / 2;
+
+	sum = 0;
+	for (i = 0; i < half && i < n; i++)
+		sum += blur_unpack(src[i]);
+
+	for (i = 0; i < n; i++) {
+		if (i + half < n)
+			sum += blur_unpack(src[i + half]);
+		dst[i] = blur_pack(sum, mul);
+		if (i - half >= 0)
+			sum -= blur_unpack(src[i - half]);
+	}
+}
+
+/* Three box blurs in a row approximate a gaussian, here the one with
+ * a variance of 35.5 the shadow has always used.  Returns whichever of
+ * the two buffers holds the result. */
+static uint32_t *
+blur_gaussian(uint32_t *a, uint32_t *b, int n)
+{
+	blur_line(b, a, n, 11);
+	blur_line(a, b, n, 11);
+	blur_line(b, a, n, 13);
+
+	return b;
+}
+
 static int
 blur_surface(cairo_surface_t *surface, int margin)
 {
-	int32_t width, height, stride, x, y, z, w;
-	uint8_t *src, *dst;
-	uint32_t *s, *d, a, p;
-	int i, j, k, size, half;
-	uint32_t kernel[71];
-	double f;
-
-	size = ARRAY_LENGTH(kernel);
+	int32_t width, height, stride;
+	uint8_t *data;
+	uint32_t *buffer, *a, *b, *s, *blurred;
+	int i, j, n;
+
 	width = cairo_image_surface_get_width(surface);
 	height = cairo_image_surface_get_height(surface);
 	stride = cairo_image_surface_get_stride(surface);
-	src = cairo_image_surface_get_data(surface);
+	data = cairo_image_surface_get_data(surface);
 
-	dst = malloc(height * stride);
-	if (dst == NULL)
+	n = width > height ? width : height;
+	buffer = malloc(2 * n * sizeof *buffer);
+	if (buffer == NULL)
 		return -1;
-
-	half = size / 2;
-	a = 0;
-	for (i = 0; i < size; i++) {
-		f = (i - half);
-		kernel[i] = exp(- f * f / ARRAY_LENGTH(kernel)) * 10000;
-		a += kernel[i];
-	}
+	a = buffer;
+	b = buffer + n;
 
 	for (i = 0; i < height; i++) {
-		s = (uint32_t *) (src + i * stride);
-		d = (uint32_t *) (dst + i * stride);
+		s = (uint32_t *) (data + i * stride);
+		memcpy(a, s, width * sizeof *a);
+		blurred = blur_gaussian(a, b, width);
 		for (j = 0; j < width; j++) {
-			if (margin < j && j < width - margin) {
-				d[j] = s[j];
-				continue;
-			}
-
-			x = 0;
-			y = 0;
-			z = 0;
-			w = 0;
-			for (k = 0; k < size; k++) {
-				if (j - half + k < 0 || j - half + k >= width)
-					continue;
-				p = s[j - half + k];
-
-				x += (p >> 24) * kernel[k];
-				y += ((p >> 16) & 0xff) * kernel[k];
-				z += ((p >> 8) & 0xff) * kernel[k];
-				w += (p & 0xff) * kernel[k];
-			}
-			d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
+			if (j <= margin || j >= width - margin)
+				s[j] = blurred[j];
 		}
 	}
 
-	for (i = 0; i < height; i++) {
-		s = (uint32_t *) (dst + i * stride);
-		d = (uint32_t *) (src + i * stride);
-		for (j = 0; j < width; j++) {
-			if (margin <= i && i < height - margin) {
-				d[j] = s[j];
-				continue;
-			}
-
-			x = 0;
-			y = 0;
-			z = 0;
-			w = 0;
-			for (k = 0; k < size; k++) {
-				if (i - half + k < 0 || i - half + k >= height)
-					continue;
-				s = (uint32_t *) (dst + (i - half + k) * stride);
-				p = s[j];
-
-				x += (p >> 24) * kernel[k];
-				y += ((p >> 16) & 0xff) * kernel[k];
-				z += ((p >> 8) & 0xff) * kernel[k];
-				w += (p & 0xff) * kernel[k];
-			}
-			d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
+	for (j = 0; j < width; j++) {
+		for (i = 0; i < height; i++)
+			a[i] = ((uint32_t *) (data + i * stride))[j];
+		blurred = blur_gaussian(a, b, height);
+		for (i = 0; i < height; i++) {
+			if (i < margin || i >= height - margin)
+				((uint32_t *) (data + i * stride))[j] =
+					blurred[i];
 		}
 	}
 
-	free(dst);
+	free(buffer);
 	cairo_surface_mark_dirty(surface);
 
 	return 0;
@@ -337,6 +357,62 @@ theme_set_background_source(struct theme *t, cairo_t *cr, uint32_t flags)
 	}
 }
 
+/* The blurred shadow only depends on the theme metrics, so it is
+ * rendered once per process and shared by every theme that uses the
+ * same ones.  The cache keeps its references until the process exits. */
+static struct {
+	int margin;
+	int frame_radius;
+	cairo_surface_t *surface;
+} shadow_cache[4];
+
+static cairo_surface_t *
+shadow_create(int margin, int frame_radius)
+{
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(shadow_cache); i++) {
+		if (shadow_cache[i].surface &&
+		    shadow_cache[i].margin == margin &&
+		    shadow_cache[i].frame_radius == frame_radius)
+			return cairo_surface_reference(shadow_cache[i].surface);
+	}
+
+	surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 128, 128);
+	cr = cairo_create(surface);
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+	cairo_set_source_rgba(cr, 0, 0, 0, 1);
+	rounded_rect(cr, margin, margin, 128 - margin, 128 - margin,
+		     frame_radius);
+	cairo_fill(cr);
+	if (cairo_status (cr) != CAIRO_STATUS_SUCCESS) {
+		cairo_destroy(cr);
+		cairo_surface_destroy(surface);
+		return NULL;
+	}
+	cairo_destroy(cr);
+
+	cairo_surface_flush(surface);
+	if (blur_surface(surface, 64) == -1) {
+		cairo_surface_destroy(surface);
+		return NULL;
+	}
+
+	for (i = 0; i < ARRAY_LENGTH(shadow_cache); i++) {
+		if (!shadow_cache[i].surface) {
+			shadow_cache[i].margin = margin;
+			shadow_cache[i].frame_radius = frame_radius;
+			shadow_cache[i].surface =
+				cairo_surface_reference(surface);
+			break;
+		}
+	}
+
+	return surface;
+}
+
 struct theme *
 theme_create(void)
 {
@@ -351,17 +427,11 @@ theme_create(void)
 	t->width = 6;
 	t->titlebar_height = 27;
 	t->frame_radius = 3;
-	t->shadow = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 128, 128);
-	cr = cairo_create(t->shadow);
-	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-	cairo_set_source_rgba(cr, 0, 0, 0, 1);
-	rounded_rect(cr, 32, 32, 96, 96, t->frame_radius);
-	cairo_fill(cr);
-	if (cairo_status (cr) != CAIRO_STATUS_SUCCESS)
-		goto err_shadow;
-	cairo_destroy(cr);
-	if (blur_surface(t->shadow, 64) == -1)
-		goto err_shadow;
+	t->shadow = shadow_create(t->margin, t->frame_radius);
+	if (t->shadow == NULL) {
+		free(t);
+		return NULL;
+	}
 
 	t->active_frame =
 		cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 128, 128);
@@ -396,7 +466,6 @@ theme_create(void)
 	cairo_surface_destroy(t->inactive_frame);
  err_active_frame:
 	cairo_surface_destroy(t->active_frame);
- err_shadow:
 	cairo_surface_destroy(t->shadow);
 	free(t);
 	return NULL;
@@ -0,0 +1,209 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ * Copyright © 2013 Vasily Khoruzhick <anarsoul@gmail.com>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "worker-pool.h"
+
+struct worker_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	pthread_t *threads;
+	int nthreads;
+	int quit;
+
+	/* The job currently being run, protected by the mutex */
+	worker_func_t func;
+	void *data;
+	int next;
+	int count;
+	int pending;
+};
+
+/* Called with the pool mutex held, returns with it held. */
+static void
+worker_pool_drain(struct worker_pool *pool)
+{
+	worker_func_t func = pool->func;
+	void *data = pool->data;
+	int index;
+
+	while (pool->next < pool->count) {
+		index = pool->next++;
+
+		pthread_mutex_unlock(&pool->mutex);
+		func(data, index);
+		pthread_mutex_lock(&pool->mutex);
+
+		if (--pool->pending == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+}
+
+static void *
+worker_thread(void *data)
+{
+	struct worker_pool *pool = data;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->quit && pool->next >= pool->count)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+
+		if (pool->quit)
+			break;
+
+		worker_pool_drain(pool);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/* Starts a thread like pthread_create() does, but with asynchronous
+ * signals blocked: they must keep being delivered to the main thread,
+ * which handles them through signalfd. */
+int
+worker_thread_create(pthread_t *thread, void *(*func)(void *), void *data)
+{
+	sigset_t mask, old_mask;
+	int ret;
+
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(thread, NULL, func, data);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	return ret;
+}
+
+struct worker_pool *
+worker_pool_create(int nthreads)
+{
+	struct worker_pool *pool;
+	int i;
+
+	if (nthreads < 1)
+		return NULL;
+
+	pool = calloc(1, sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = calloc(nthreads, sizeof *pool->threads);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		if (worker_thread_create(&pool->threads[i],
+					 worker_thread, pool) != 0)
+			break;
+		pool->nthreads++;
+	}
+
+	if (pool->nthreads == 0) {
+		worker_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void
+worker_pool_destroy(struct worker_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+int
+worker_pool_get_size(struct worker_pool *pool)
+{
+	/* The calling thread always participates */
+	return pool ? pool->nthreads + 1 : 1;
+}
+
+void
+worker_pool_run(struct worker_pool *pool, int count,
+		worker_func_t func, void *data)
+{
+	int i;
+
+	if (count <= 0)
+		return;
+
+	if (!pool || count == 1) {
+		for (i = 0; i < count; i++)
+			func(data, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+
+	pool->func = func;
+	pool->data = data;
+	pool->next = 0;
+	pool->count = count;
+	pool->pending = count;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	worker_pool_drain(pool);
+
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	pthread_mutex_unlock(&pool->mutex);
+}
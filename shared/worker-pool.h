@@ -0,0 +1,60 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ * Copyright © 2013 Vasily Khoruzhick <anarsoul@gmail.com>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+
+/* A minimal fork-join thread pool.
+ *
+ * worker_pool_run() splits a job into 'count' independent pieces and
+ * calls func(data, index) once for every index in [0, count).  The
+ * calling thread takes part in the work and the call returns only
+ * once every piece has completed, so callers need no further
+ * synchronisation of their own.  A NULL pool runs everything on the
+ * calling thread.
+ */
+
+struct worker_pool;
+
+typedef void (*worker_func_t)(void *data, int index);
+
+struct worker_pool *
+worker_pool_create(int nthreads);
+
+void
+worker_pool_destroy(struct worker_pool *pool);
+
+int
+worker_pool_get_size(struct worker_pool *pool);
+
+void
+worker_pool_run(struct worker_pool *pool, int count,
+		worker_func_t func, void *data);
+
+int
+worker_thread_create(pthread_t *thread, void *(*func)(void *), void *data);
+
+#endif /* WORKER_POOL_H */
@@ -67,6 +67,8 @@
 #define GBM_BO_USE_CURSOR GBM_BO_USE_CURSOR_64X64
 #endif
 
+#define MAX_DUMB_BUFFERS 4
+
 static int option_current_mode = 0;
 
 enum output_config {
@@ -176,10 +178,13 @@ struct drm_output {
 	struct drm_fb *current, *next;
 	struct backlight *backlight;
 
-	struct drm_fb *dumb[2];
-	pixman_image_t *image[2];
+	struct drm_fb *dumb[MAX_DUMB_BUFFERS];
+	pixman_image_t *image[MAX_DUMB_BUFFERS];
+	/* what changed since each buffer was last painted, in output
+	 * coordinates so that it survives the output moving */
+	pixman_region32_t image_damage[MAX_DUMB_BUFFERS];
+	int dumb_count;
 	int current_image;
-	pixman_region32_t previous_damage;
 
 	struct vaapi_recorder *recorder;
 	struct wl_listener recorder_frame_listener;
@@ -413,14 +418,25 @@ drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer)
 	weston_buffer_reference(&fb->buffer_ref, buffer);
 }
 
+static int
+drm_output_is_dumb_fb(struct drm_output *output, struct drm_fb *fb)
+{
+	int i;
+
+	for (i = 0; i < output->dumb_count; i++)
+		if (fb == output->dumb[i])
+			return 1;
+
+	return 0;
+}
+
 static void
 drm_output_release_fb(struct drm_output *output, struct drm_fb *fb)
 {
 	if (!fb)
 		return;
 
-	if (fb->map &&
-            (fb != output->dumb[0] && fb != output->dumb[1])) {
+	if (fb->map && !drm_output_is_dumb_fb(output, fb)) {
 		drm_fb_destroy_dumb(fb);
 	} else if (fb->bo) {
 		if (fb->is_client_buffer)
@@ -533,26 +549,36 @@ static void
 drm_output_render_pixman(struct drm_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *ec = output->base.compositor;
-	pixman_region32_t total_damage, previous_damage;
-
-	pixman_region32_init(&total_damage);
-	pixman_region32_init(&previous_damage);
+	pixman_region32_t *image_damage, local_damage;
+	int i;
 
-	pixman_region32_copy(&previous_damage, damage);
+	/* The oldest buffer of the ring is never the one being scanned
+	 * out, so it is always safe to paint into. */
+	output->current_image =
+		(output->current_image + 1) % output->dumb_count;
 
-	pixman_region32_union(&total_damage, damage, &output->previous_damage);
-	pixman_region32_copy(&output->previous_damage, &previous_damage);
+	pixman_region32_init(&local_damage);
+	pixman_region32_copy(&local_damage, damage);
+	pixman_region32_translate(&local_damage,
+				  -output->base.x, -output->base.y);
+	for (i = 0; i < output->dumb_count; i++)
+		pixman_region32_union(&output->image_damage[i],
+				      &output->image_damage[i], &local_damage);
 
-	output->current_image ^= 1;
+	image_damage = &output->image_damage[output->current_image];
 
 	output->next = output->dumb[output->current_image];
 	pixman_renderer_output_set_buffer(&output->base,
 					  output->image[output->current_image]);
 
-	ec->renderer->repaint_output(&output->base, &total_damage);
+	/* The renderer wants global coordinates */
+	pixman_region32_copy(&local_damage, image_damage);
+	pixman_region32_translate(&local_damage,
+				  output->base.x, output->base.y);
+	ec->renderer->repaint_output(&output->base, &local_damage);
+	pixman_region32_fini(&local_damage);
 
-	pixman_region32_fini(&total_damage);
-	pixman_region32_fini(&previous_damage);
+	pixman_region32_clear(image_damage);
 }
 
 static void
@@ -1625,11 +1651,11 @@ drm_output_init_pixman(struct drm_output *output, struct drm_compositor *c)
 {
 	int w = output->base.current_mode->width;
 	int h = output->base.current_mode->height;
-	unsigned int i;
+	int i;
 
 	/* FIXME error checking */
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
 		output->dumb[i] = drm_fb_create_dumb(c, w, h);
 		if (!output->dumb[i])
 			goto err;
@@ -1642,16 +1668,19 @@ drm_output_init_pixman(struct drm_output *output, struct drm_compositor *c)
 			goto err;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (pixman_renderer_output_create(&output->base, 0) < 0)
 		goto err;
 
-	pixman_region32_init_rect(&output->previous_damage,
-				  output->base.x, output->base.y, output->base.width, output->base.height);
+	for (i = 0; i < output->dumb_count; i++)
+		pixman_region32_init_rect(&output->image_damage[i], 0, 0,
+					  output->base.width,
+					  output->base.height);
+	output->current_image = 0;
 
 	return 0;
 
 err:
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
 		if (output->dumb[i])
 			drm_fb_destroy_dumb(output->dumb[i]);
 		if (output->image[i])
@@ -1667,12 +1696,12 @@ err:
 static void
 drm_output_fini_pixman(struct drm_output *output)
 {
-	unsigned int i;
+	int i;
 
 	pixman_renderer_output_destroy(&output->base);
-	pixman_region32_fini(&output->previous_damage);
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
+		pixman_region32_fini(&output->image_damage[i]);
 		drm_fb_destroy_dumb(output->dumb[i]);
 		pixman_image_unref(output->image[i]);
 		output->dumb[i] = NULL;
@@ -1998,6 +2027,15 @@ create_output_for_connector(struct drm_compositor *ec,
 	free(s);
 
 	weston_config_section_get_int(section, "scale", &scale, 1);
+	weston_config_section_get_int(section, "pixman-buffers",
+				      &output->dumb_count, 2);
+	if (output->dumb_count < 2 || output->dumb_count > MAX_DUMB_BUFFERS) {
+		weston_log("Invalid pixman-buffers %d for output %s, "
+			   "must be between 2 and %d\n",
+			   output->dumb_count, output->base.name,
+			   MAX_DUMB_BUFFERS);
+		output->dumb_count = 2;
+	}
 	weston_config_section_get_string(section, "transform", &s, "normal");
 	transform = parse_transform(s, output->base.name);
 	free(s);
@@ -25,62 +25,218 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
 
 #include "compositor.h"
+#include "pixman-renderer.h"
+
+enum headless_repaint_mode {
+	/* frames finish on a timer, like a real display */
+	HEADLESS_REPAINT_TIMER,
+	/* frames finish as soon as they are rendered */
+	HEADLESS_REPAINT_UNCAPPED,
+	/* as uncapped, but the presentation clock advances by exactly
+	 * one refresh period per frame */
+	HEADLESS_REPAINT_VIRTUAL_CLOCK,
+};
+
+struct headless_parameters {
+	int width;
+	int height;
+	int refresh;		/* mHz */
+	int use_pixman;
+	enum headless_repaint_mode repaint_mode;
+	int benchmark_frames;
+};
 
 struct headless_compositor {
 	struct weston_compositor base;
 	struct weston_seat fake_seat;
+	int use_pixman;
+	enum headless_repaint_mode repaint_mode;
+	int benchmark_frames;
 };
 
 struct headless_output {
 	struct weston_output base;
 	struct weston_mode mode;
 	struct wl_event_source *finish_frame_timer;
+	pixman_image_t *image;
+
+	/* uncapped and virtual clock modes */
+	int frame_fd;
+	struct wl_event_source *frame_source;
+	struct timespec virtual_time;
+
+	/* benchmark statistics */
+	uint32_t frames;
+	uint64_t composite_nsec;
+	uint64_t composite_max_nsec;
+	struct timespec first_frame;
+	struct timespec last_frame;
 };
 
+static uint64_t
+timespec_sub_nsec(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000000LL +
+		(a->tv_nsec - b->tv_nsec);
+}
 
 static void
-headless_output_start_repaint_loop(struct weston_output *output)
+headless_output_finish_frame(struct headless_output *output)
 {
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
 	struct timespec ts;
 
-	clock_gettime(output->compositor->presentation_clock, &ts);
-	weston_output_finish_frame(output, &ts);
+	if (c->repaint_mode == HEADLESS_REPAINT_VIRTUAL_CLOCK)
+		ts = output->virtual_time;
+	else
+		clock_gettime(c->base.presentation_clock, &ts);
+
+	weston_output_finish_frame(&output->base, &ts);
+}
+
+static void
+headless_output_start_repaint_loop(struct weston_output *output)
+{
+	headless_output_finish_frame((struct headless_output *) output);
 }
 
 static int
 finish_frame_handler(void *data)
 {
-	headless_output_start_repaint_loop(data);
+	headless_output_finish_frame(data);
 
 	return 1;
 }
 
+static int
+frame_fd_handler(int fd, uint32_t mask, void *data)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) != sizeof count)
+		return 1;
+
+	headless_output_finish_frame(data);
+
+	return 1;
+}
+
+static void
+headless_output_queue_frame(struct headless_output *output)
+{
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
+	uint64_t one = 1;
+	int period_msec;
+
+	switch (c->repaint_mode) {
+	case HEADLESS_REPAINT_TIMER:
+		period_msec = 1000000 / output->mode.refresh;
+		wl_event_source_timer_update(output->finish_frame_timer,
+					     period_msec > 0 ? period_msec : 1);
+		break;
+	case HEADLESS_REPAINT_VIRTUAL_CLOCK:
+		output->virtual_time.tv_nsec +=
+			1000000000000LL / output->mode.refresh;
+		while (output->virtual_time.tv_nsec >= 1000000000) {
+			output->virtual_time.tv_nsec -= 1000000000;
+			output->virtual_time.tv_sec++;
+		}
+		/* fall through */
+	case HEADLESS_REPAINT_UNCAPPED:
+		/* Going through the event loop, rather than an idle
+		 * callback, lets clients run between frames. */
+		if (write(output->frame_fd, &one, sizeof one) != sizeof one)
+			weston_log("failed to queue headless frame: %m\n");
+		break;
+	}
+}
+
 static int
 headless_output_repaint(struct weston_output *output_base,
 		       pixman_region32_t *damage)
 {
 	struct headless_output *output = (struct headless_output *) output_base;
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
 	struct weston_compositor *ec = output->base.compositor;
+	struct timespec begin, end;
+	uint64_t nsec;
 
+	clock_gettime(CLOCK_MONOTONIC, &begin);
 	ec->renderer->repaint_output(&output->base, damage);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	nsec = timespec_sub_nsec(&end, &begin);
+	if (output->frames == 0)
+		output->first_frame = begin;
+	output->last_frame = end;
+	output->frames++;
+	output->composite_nsec += nsec;
+	if (nsec > output->composite_max_nsec)
+		output->composite_max_nsec = nsec;
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	if (c->benchmark_frames > 0 &&
+	    output->frames >= (uint32_t) c->benchmark_frames)
+		wl_display_terminate(ec->wl_display);
+
+	headless_output_queue_frame(output);
 
 	return 0;
 }
 
+static void
+headless_output_report(struct headless_output *output)
+{
+	double seconds, average;
+
+	if (output->frames == 0)
+		return;
+
+	seconds = timespec_sub_nsec(&output->last_frame,
+				    &output->first_frame) / 1e9;
+	average = (double) output->composite_nsec / output->frames / 1e6;
+
+	weston_log("headless output %s: %u frames in %.3f s, %.1f fps, "
+		   "composite avg %.3f ms, max %.3f ms\n",
+		   output->base.name ? output->base.name : "(unnamed)",
+		   output->frames, seconds,
+		   seconds > 0 ? output->frames / seconds : 0.0,
+		   average, output->composite_max_nsec / 1e6);
+}
+
 static void
 headless_output_destroy(struct weston_output *output_base)
 {
 	struct headless_output *output = (struct headless_output *) output_base;
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
+
+	headless_output_report(output);
 
 	wl_event_source_remove(output->finish_frame_timer);
+	if (output->frame_source)
+		wl_event_source_remove(output->frame_source);
+	if (output->frame_fd >= 0)
+		close(output->frame_fd);
+
+	if (c->use_pixman) {
+		pixman_renderer_output_destroy(&output->base);
+		pixman_image_unref(output->image);
+	}
+
+	weston_output_destroy(&output->base);
+
 	free(output);
 
 	return;
@@ -88,20 +244,24 @@ headless_output_destroy(struct weston_output *output_base)
 
 static int
 headless_compositor_create_output(struct headless_compositor *c,
-				 int width, int height)
+				 struct headless_parameters *param)
 {
 	struct headless_output *output;
 	struct wl_event_loop *loop;
+	int width = param->width;
+	int height = param->height;
 
 	output = zalloc(sizeof *output);
 	if (output == NULL)
 		return -1;
 
+	output->frame_fd = -1;
+
 	output->mode.flags =
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = width;
 	output->mode.height = height;
-	output->mode.refresh = 60;
+	output->mode.refresh = param->refresh;
 	wl_list_init(&output->base.mode_list);
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
@@ -112,10 +272,45 @@ headless_compositor_create_output(struct headless_compositor *c,
 	output->base.make = "weston";
 	output->base.model = "headless";
 
+	if (c->repaint_mode == HEADLESS_REPAINT_VIRTUAL_CLOCK)
+		weston_output_frame_stats_virtual_clock(&output->base);
+
 	loop = wl_display_get_event_loop(c->base.wl_display);
 	output->finish_frame_timer =
 		wl_event_loop_add_timer(loop, finish_frame_handler, output);
 
+	if (c->repaint_mode != HEADLESS_REPAINT_TIMER) {
+		output->frame_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (output->frame_fd < 0)
+			goto err_output;
+
+		output->frame_source =
+			wl_event_loop_add_fd(loop, output->frame_fd,
+					     WL_EVENT_READABLE,
+					     frame_fd_handler, output);
+		if (!output->frame_source)
+			goto err_output;
+
+		clock_gettime(c->base.presentation_clock,
+			      &output->virtual_time);
+	}
+
+	if (c->use_pixman) {
+		output->image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+							 width, height,
+							 NULL, width * 4);
+		if (!output->image)
+			goto err_output;
+
+		if (pixman_renderer_output_create(&output->base, 0) < 0) {
+			pixman_image_unref(output->image);
+			goto err_output;
+		}
+
+		pixman_renderer_output_set_buffer(&output->base,
+						  output->image);
+	}
+
 	output->base.start_repaint_loop = headless_output_start_repaint_loop;
 	output->base.repaint = headless_output_repaint;
 	output->base.destroy = headless_output_destroy;
@@ -127,6 +322,18 @@ headless_compositor_create_output(struct headless_compositor *c,
 	wl_list_insert(c->base.output_list.prev, &output->base.link);
 
 	return 0;
+
+err_output:
+	wl_list_init(&output->base.link);
+	if (output->frame_source)
+		wl_event_source_remove(output->frame_source);
+	if (output->frame_fd >= 0)
+		close(output->frame_fd);
+	wl_event_source_remove(output->finish_frame_timer);
+	weston_output_destroy(&output->base);
+	free(output);
+
+	return -1;
 }
 
 static int
@@ -166,7 +373,8 @@ headless_destroy(struct weston_compositor *ec)
 
 static struct weston_compositor *
 headless_compositor_create(struct wl_display *display,
-			   int width, int height, const char *display_name,
+			   struct headless_parameters *param,
+			   const char *display_name,
 			   int *argc, char *argv[],
 			   struct weston_config *config)
 {
@@ -188,10 +396,19 @@ headless_compositor_create(struct wl_display *display,
 	c->base.destroy = headless_destroy;
 	c->base.restore = headless_restore;
 
-	if (headless_compositor_create_output(c, width, height) < 0)
-		goto err_input;
+	c->use_pixman = param->use_pixman;
+	c->repaint_mode = param->repaint_mode;
+	c->benchmark_frames = param->benchmark_frames;
+
+	if (c->use_pixman) {
+		if (pixman_renderer_init(&c->base) < 0)
+			goto err_input;
+	} else {
+		if (noop_renderer_init(&c->base) < 0)
+			goto err_input;
+	}
 
-	if (noop_renderer_init(&c->base) < 0)
+	if (headless_compositor_create_output(c, param) < 0)
 		goto err_input;
 
 	return &c->base;
@@ -209,17 +426,38 @@ WL_EXPORT struct weston_compositor *
 backend_init(struct wl_display *display, int *argc, char *argv[],
 	     struct weston_config *config)
 {
-	int width = 1024, height = 640;
+	struct headless_parameters param = { 0, };
 	char *display_name = NULL;
+	int uncapped = 0, virtual_clock = 0;
 
 	const struct weston_option headless_options[] = {
-		{ WESTON_OPTION_INTEGER, "width", 0, &width },
-		{ WESTON_OPTION_INTEGER, "height", 0, &height },
+		{ WESTON_OPTION_INTEGER, "width", 0, &param.width },
+		{ WESTON_OPTION_INTEGER, "height", 0, &param.height },
+		{ WESTON_OPTION_INTEGER, "refresh", 0, &param.refresh },
+		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &param.use_pixman },
+		{ WESTON_OPTION_BOOLEAN, "uncapped", 0, &uncapped },
+		{ WESTON_OPTION_BOOLEAN, "virtual-clock", 0, &virtual_clock },
+		{ WESTON_OPTION_INTEGER, "benchmark-frames", 0,
+		  &param.benchmark_frames },
 	};
 
+	param.width = 1024;
+	param.height = 640;
+	param.refresh = 60000;
+
 	parse_options(headless_options,
 		      ARRAY_LENGTH(headless_options), argc, argv);
 
-	return headless_compositor_create(display, width, height, display_name,
+	if (param.refresh <= 0)
+		param.refresh = 60000;
+
+	if (virtual_clock)
+		param.repaint_mode = HEADLESS_REPAINT_VIRTUAL_CLOCK;
+	else if (uncapped)
+		param.repaint_mode = HEADLESS_REPAINT_UNCAPPED;
+	else
+		param.repaint_mode = HEADLESS_REPAINT_TIMER;
+
+	return headless_compositor_create(display, &param, display_name,
 					  argc, argv, config);
 }
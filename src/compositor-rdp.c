@@ -25,6 +25,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <linux/input.h>
 
 #if HAVE_FREERDP_VERSION_H
@@ -47,10 +50,20 @@
 
 #include "compositor.h"
 #include "pixman-renderer.h"
+#include "worker-pool.h"
 
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE wl_fixed_from_int(10)
 #define RDP_MODE_FREQ 60 * 1000
+#define RDP_TILE_SIZE 64
+
+/* Frame pacing: the interval used when no peer acknowledges frames,
+ * how long to wait for an acknowledgement, and how far a peer may be
+ * behind before it only gets coalesced updates */
+#define RDP_FRAME_INTERVAL 16
+#define RDP_FRAME_ACK_TIMEOUT 100
+#define RDP_MAX_FRAMES_IN_FLIGHT 3
+#define RDP_DEFAULT_MAX_QUEUED (256 * 1024)
 
 struct rdp_compositor_config {
 	int width;
@@ -62,6 +75,7 @@ struct rdp_compositor_config {
 	char *server_key;
 	int env_socket;
 	int no_clients_resize;
+	int encoder_threads;
 };
 
 struct rdp_output;
@@ -78,11 +92,15 @@ struct rdp_compositor {
 	char *rdp_key;
 	int tls_enabled;
 	int no_clients_resize;
+	int encoder_threads;
 };
 
 enum peer_item_flags {
 	RDP_PEER_ACTIVATED      = (1 << 0),
 	RDP_PEER_OUTPUT_ENABLED = (1 << 1),
+	RDP_PEER_FRAME_ACKS     = (1 << 2), /* acknowledges frame markers */
+	RDP_PEER_BEHIND         = (1 << 3), /* damage is held back */
+	RDP_PEER_FRAME_SENT     = (1 << 4), /* got the current frame */
 };
 
 struct rdp_peers_item {
@@ -90,13 +108,69 @@ struct rdp_peers_item {
 	freerdp_peer *peer;
 	struct weston_seat seat;
 
+	/* Congestion tracking */
+	uint32_t frame_id;
+	uint32_t acked_frame_id;
+	int max_queued;
+	pixman_region32_t pending_damage;
+	struct wl_event_source *drain_timer;
+
 	struct wl_list link;
 };
 
+/* A damaged tile of the shadow surface */
+struct rdp_tile {
+	int index;
+	pixman_box32_t box;	/* the damage inside the tile */
+	int changed;
+	size_t raw_offset;	/* into rdp_encoder.raw_data */
+};
+
+/* Encodes the damage of a frame once, for all the peers using the same
+ * codec. */
+struct rdp_encoder {
+	struct worker_pool *pool;
+	int nslots;
+	pixman_image_t *image;
+
+	/* Content hash of every tile of the shadow surface, 0 when
+	 * unknown, and where each tile is in the tile list */
+	int tiles_x, tiles_y;
+	uint64_t *hashes;
+	int *tile_entries;
+
+	struct rdp_tile *tiles;
+	int ntiles, tiles_size;
+
+	/* The peers to send the frame to */
+	freerdp_peer **peers;
+	int npeers, peers_size;
+	freerdp_peer **rfx_peers;
+	int nrfx_peers;
+	int need_raw, need_nsc;
+
+	/* Raw: the rows of every tile bottom-up, one tile after another */
+	BYTE *raw_data;
+	size_t raw_size;
+
+	/* NSCodec: one context per slot and one stream per tile */
+	NSC_CONTEXT **nsc_contexts;
+	wStream **nsc_streams;
+	int nsc_streams_size;
+
+	/* RemoteFX keeps per peer state, so it is encoded for every peer,
+	 * but over the same rectangles */
+	RFX_RECT *rfx_rects;
+	int rfx_rects_size;
+	pixman_box32_t extents;
+};
+
 struct rdp_output {
 	struct weston_output base;
 	struct wl_event_source *finish_frame_timer;
 	pixman_image_t *shadow_surface;
+	struct rdp_encoder encoder;
+	int waiting_for_ack;
 
 	struct wl_list peers;
 };
@@ -108,8 +182,6 @@ struct rdp_peer_context {
 	struct wl_event_source *events[MAX_FREERDP_FDS];
 	RFX_CONTEXT *rfx_context;
 	wStream *encode_stream;
-	RFX_RECT *rfx_rects;
-	NSC_CONTEXT *nsc_context;
 
 	struct rdp_peers_item item;
 };
@@ -126,95 +198,334 @@ rdp_compositor_config_init(struct rdp_compositor_config *config) {
 	config->server_key = NULL;
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
+	config->encoder_threads = 0;
+}
+
+static int
+rdp_encoder_init(struct rdp_encoder *enc, int threads)
+{
+	int i;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	enc->pool = worker_pool_create(threads - 1);
+
+	/* A few slots per thread to even out the load */
+	enc->nslots = worker_pool_get_size(enc->pool) * 2;
+	enc->nsc_contexts = zalloc(enc->nslots * sizeof *enc->nsc_contexts);
+	if (!enc->nsc_contexts)
+		return -1;
+
+	for (i = 0; i < enc->nslots; i++) {
+		enc->nsc_contexts[i] = nsc_context_new();
+		if (!enc->nsc_contexts[i])
+			return -1;
+		nsc_context_set_pixel_format(enc->nsc_contexts[i],
+					     RDP_PIXEL_FORMAT_B8G8R8A8);
+	}
+
+	weston_log("RDP encoder using %d threads\n",
+		   worker_pool_get_size(enc->pool));
+
+	return 0;
 }
 
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_encoder_release(struct rdp_encoder *enc)
 {
-	int width, height, nrects, i;
-	pixman_box32_t *region, *rects;
-	uint32_t *ptr;
-	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	int i;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	worker_pool_destroy(enc->pool);
 
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
+	if (enc->nsc_contexts) {
+		for (i = 0; i < enc->nslots; i++)
+			if (enc->nsc_contexts[i])
+				nsc_context_free(enc->nsc_contexts[i]);
+		free(enc->nsc_contexts);
+	}
 
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->RemoteFxCodecId;
-	cmd->width = width;
-	cmd->height = height;
+	for (i = 0; i < enc->nsc_streams_size; i++)
+		if (enc->nsc_streams[i])
+			Stream_Free(enc->nsc_streams[i], TRUE);
+	free(enc->nsc_streams);
+
+	free(enc->hashes);
+	free(enc->tile_entries);
+	free(enc->tiles);
+	free(enc->peers);
+	free(enc->rfx_peers);
+	free(enc->raw_data);
+	free(enc->rfx_rects);
+}
+
+/* Starts over with a new shadow surface, knowing nothing of its
+ * contents.  On failure the encoder is left as it was. */
+static int
+rdp_encoder_set_image(struct rdp_encoder *enc, pixman_image_t *image)
+{
+	int i, count, tiles_x, tiles_y;
+	uint64_t *hashes;
+	int *tile_entries;
+
+	tiles_x = (pixman_image_get_width(image) + RDP_TILE_SIZE - 1) /
+		RDP_TILE_SIZE;
+	tiles_y = (pixman_image_get_height(image) + RDP_TILE_SIZE - 1) /
+		RDP_TILE_SIZE;
+	count = tiles_x * tiles_y;
+
+	hashes = zalloc(count * sizeof *hashes);
+	tile_entries = malloc(count * sizeof *tile_entries);
+	if (!hashes || !tile_entries) {
+		free(hashes);
+		free(tile_entries);
+		return -1;
+	}
 
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+	for (i = 0; i < count; i++)
+		tile_entries[i] = -1;
 
-	rects = pixman_region32_rectangles(damage, &nrects);
-	context->rfx_rects = realloc(context->rfx_rects, nrects * sizeof *rfxRect);
+	free(enc->hashes);
+	free(enc->tile_entries);
+	enc->hashes = hashes;
+	enc->tile_entries = tile_entries;
+	enc->image = image;
+	enc->tiles_x = tiles_x;
+	enc->tiles_y = tiles_y;
+
+	return 0;
+}
 
+static int
+rdp_encoder_add_peer(struct rdp_encoder *enc, freerdp_peer *peer)
+{
+	freerdp_peer **peers, **rfx_peers;
+	int size;
+
+	if (enc->npeers == enc->peers_size) {
+		size = enc->peers_size ? enc->peers_size * 2 : 4;
+		peers = realloc(enc->peers, size * sizeof *peers);
+		if (!peers)
+			return -1;
+		enc->peers = peers;
+
+		rfx_peers = realloc(enc->rfx_peers, size * sizeof *rfx_peers);
+		if (!rfx_peers)
+			return -1;
+		enc->rfx_peers = rfx_peers;
+
+		enc->peers_size = size;
+	}
+
+	enc->peers[enc->npeers++] = peer;
+
+	if (peer->settings->RemoteFxCodec)
+		enc->rfx_peers[enc->nrfx_peers++] = peer;
+	else if (peer->settings->NSCodec)
+		enc->need_nsc = 1;
+	else
+		enc->need_raw = 1;
+
+	return 0;
+}
+
+/* Splits the damage along the tile grid */
+static int
+rdp_encoder_collect_tiles(struct rdp_encoder *enc, pixman_region32_t *damage)
+{
+	struct rdp_tile *tiles, *tile;
+	pixman_box32_t *rects, box;
+	int width, height, nrects, i, tx, ty, index, size, ret = -1;
+
+	width = pixman_image_get_width(enc->image);
+	height = pixman_image_get_height(enc->image);
+	enc->ntiles = 0;
+
+	rects = pixman_region32_rectangles(damage, &nrects);
 	for (i = 0; i < nrects; i++) {
-		region = &rects[i];
-		rfxRect = &context->rfx_rects[i];
+		box.x1 = MAX(rects[i].x1, 0);
+		box.y1 = MAX(rects[i].y1, 0);
+		box.x2 = MIN(rects[i].x2, width);
+		box.y2 = MIN(rects[i].y2, height);
+		if (box.x1 >= box.x2 || box.y1 >= box.y2)
+			continue;
 
-		rfxRect->x = (region->x1 - damage->extents.x1);
-		rfxRect->y = (region->y1 - damage->extents.y1);
-		rfxRect->width = (region->x2 - region->x1);
-		rfxRect->height = (region->y2 - region->y1);
+		for (ty = box.y1 / RDP_TILE_SIZE;
+		     ty * RDP_TILE_SIZE < box.y2; ty++) {
+			for (tx = box.x1 / RDP_TILE_SIZE;
+			     tx * RDP_TILE_SIZE < box.x2; tx++) {
+				index = ty * enc->tiles_x + tx;
+
+				if (enc->tile_entries[index] >= 0) {
+					tile = &enc->tiles[enc->tile_entries[index]];
+				} else {
+					if (enc->ntiles == enc->tiles_size) {
+						size = enc->tiles_size ?
+							enc->tiles_size * 2 : 64;
+						tiles = realloc(enc->tiles,
+								size * sizeof *tiles);
+						if (!tiles)
+							goto out;
+						enc->tiles = tiles;
+						enc->tiles_size = size;
+					}
+
+					enc->tile_entries[index] = enc->ntiles;
+					tile = &enc->tiles[enc->ntiles++];
+					tile->index = index;
+					tile->box.x1 = INT32_MAX;
+					tile->box.y1 = INT32_MAX;
+					tile->box.x2 = INT32_MIN;
+					tile->box.y2 = INT32_MIN;
+					tile->changed = 1;
+				}
+
+				tile->box.x1 = MIN(tile->box.x1,
+						   MAX(box.x1, tx * RDP_TILE_SIZE));
+				tile->box.y1 = MIN(tile->box.y1,
+						   MAX(box.y1, ty * RDP_TILE_SIZE));
+				tile->box.x2 = MAX(tile->box.x2,
+						   MIN(box.x2, (tx + 1) * RDP_TILE_SIZE));
+				tile->box.y2 = MAX(tile->box.y2,
+						   MIN(box.y2, (ty + 1) * RDP_TILE_SIZE));
+			}
+		}
 	}
 
-	rfx_compose_message(context->rfx_context, context->encode_stream, context->rfx_rects, nrects,
-			(BYTE *)ptr, width, height,
-			pixman_image_get_stride(image)
-	);
+	ret = 0;
 
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
+out:
+	for (i = 0; i < enc->ntiles; i++)
+		enc->tile_entries[enc->tiles[i].index] = -1;
 
-	update->SurfaceBits(update->context, cmd);
+	return ret;
 }
 
+static void
+rdp_encoder_hash_tile(void *data, int index)
+{
+	struct rdp_encoder *enc = data;
+	struct rdp_tile *tile = &enc->tiles[index];
+	int stride = pixman_image_get_stride(enc->image) / sizeof(uint32_t);
+	int x1, y1, x2, y2, x, y;
+	const uint32_t *row;
+	uint64_t h[4] = {
+		0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL,
+		0x9e3779b97f4a7c15ULL, 0x7f4a7c159e3779b9ULL
+	};
+	uint64_t hash;
+
+	/* The whole tile is hashed, not just the damage in it */
+	x1 = (tile->index % enc->tiles_x) * RDP_TILE_SIZE;
+	y1 = (tile->index / enc->tiles_x) * RDP_TILE_SIZE;
+	x2 = MIN(x1 + RDP_TILE_SIZE, pixman_image_get_width(enc->image));
+	y2 = MIN(y1 + RDP_TILE_SIZE, pixman_image_get_height(enc->image));
+
+	/* FNV-1a on four interleaved lanes, ignoring the padding byte
+	 * of x8r8g8b8 */
+	for (y = y1; y < y2; y++) {
+		row = pixman_image_get_data(enc->image) + y * stride;
+		for (x = x1; x + 4 <= x2; x += 4) {
+			h[0] = (h[0] ^ (row[x] & 0xffffff)) * 0x100000001b3ULL;
+			h[1] = (h[1] ^ (row[x + 1] & 0xffffff)) * 0x100000001b3ULL;
+			h[2] = (h[2] ^ (row[x + 2] & 0xffffff)) * 0x100000001b3ULL;
+			h[3] = (h[3] ^ (row[x + 3] & 0xffffff)) * 0x100000001b3ULL;
+		}
+		for (; x < x2; x++)
+			h[0] = (h[0] ^ (row[x] & 0xffffff)) * 0x100000001b3ULL;
+	}
+
+	hash = h[0];
+	for (x = 1; x < 4; x++)
+		hash = (hash ^ (hash >> 29) ^ h[x]) * 0x100000001b3ULL;
+
+	/* 0 means unknown */
+	if (hash == 0)
+		hash = 1;
+
+	tile->changed = hash != enc->hashes[tile->index];
+	enc->hashes[tile->index] = hash;
+}
 
+/* Drops the tiles whose contents are the same as what was sent last */
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_encoder_skip_unchanged(struct rdp_encoder *enc)
 {
-	int width, height;
-	uint32_t *ptr;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	int i, n;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	worker_pool_run(enc->pool, enc->ntiles, rdp_encoder_hash_tile, enc);
 
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
+	for (i = 0, n = 0; i < enc->ntiles; i++)
+		if (enc->tiles[i].changed)
+			enc->tiles[n++] = enc->tiles[i];
+	enc->ntiles = n;
+}
 
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->NSCodecId;
-	cmd->width = width;
-	cmd->height = height;
+static int
+rdp_encoder_prepare(struct rdp_encoder *enc)
+{
+	struct rdp_tile *tile;
+	wStream **streams;
+	RFX_RECT *rects;
+	size_t size = 0;
+	BYTE *raw_data;
+	int i, count;
+
+	enc->extents = enc->tiles[0].box;
+	for (i = 0; i < enc->ntiles; i++) {
+		tile = &enc->tiles[i];
+		tile->raw_offset = size;
+		size += (tile->box.x2 - tile->box.x1) *
+			(tile->box.y2 - tile->box.y1) * 4;
+
+		enc->extents.x1 = MIN(enc->extents.x1, tile->box.x1);
+		enc->extents.y1 = MIN(enc->extents.y1, tile->box.y1);
+		enc->extents.x2 = MAX(enc->extents.x2, tile->box.x2);
+		enc->extents.y2 = MAX(enc->extents.y2, tile->box.y2);
+	}
 
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+	if (enc->need_raw && size > enc->raw_size) {
+		raw_data = realloc(enc->raw_data, size);
+		if (!raw_data)
+			return -1;
+		enc->raw_data = raw_data;
+		enc->raw_size = size;
+	}
 
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			cmd->width,	cmd->height,
-			pixman_image_get_stride(image));
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
-	update->SurfaceBits(update->context, cmd);
+	if (enc->need_nsc && enc->ntiles > enc->nsc_streams_size) {
+		count = enc->ntiles;
+		streams = realloc(enc->nsc_streams, count * sizeof *streams);
+		if (!streams)
+			return -1;
+		enc->nsc_streams = streams;
+
+		for (i = enc->nsc_streams_size; i < count; i++) {
+			streams[i] = Stream_New(NULL, 65536);
+			if (!streams[i])
+				break;
+		}
+		enc->nsc_streams_size = i;
+		if (i < count)
+			return -1;
+	}
+
+	if (enc->nrfx_peers && enc->ntiles > enc->rfx_rects_size) {
+		rects = realloc(enc->rfx_rects, enc->ntiles * sizeof *rects);
+		if (!rects)
+			return -1;
+		enc->rfx_rects = rects;
+		enc->rfx_rects_size = enc->ntiles;
+	}
+
+	for (i = 0; enc->nrfx_peers && i < enc->ntiles; i++) {
+		tile = &enc->tiles[i];
+		enc->rfx_rects[i].x = tile->box.x1 - enc->extents.x1;
+		enc->rfx_rects[i].y = tile->box.y1 - enc->extents.y1;
+		enc->rfx_rects[i].width = tile->box.x2 - tile->box.x1;
+		enc->rfx_rects[i].height = tile->box.y2 - tile->box.y1;
+	}
+
+	return 0;
 }
 
 static void
@@ -230,76 +541,261 @@ pixman_image_flipped_subrect(const pixman_box32_t *rect, pixman_image_t *img, BY
 		   memcpy(dest, src, toCopy);
 }
 
+static BYTE *
+rdp_encoder_image_data(struct rdp_encoder *enc, const pixman_box32_t *box)
+{
+	return (BYTE *) (pixman_image_get_data(enc->image) + box->x1 +
+		box->y1 * (pixman_image_get_stride(enc->image) / sizeof(uint32_t)));
+}
+
+/* The first nslots jobs encode a share of the tiles for the raw and
+ * NSCodec peers, the others encode the RemoteFX message of a peer. */
 static void
-rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_peer *peer)
+rdp_encoder_encode(void *data, int index)
+{
+	struct rdp_encoder *enc = data;
+	RdpPeerContext *context;
+	struct rdp_tile *tile;
+	int i, first, last;
+
+	if (index >= enc->nslots) {
+		context = (RdpPeerContext *)
+			enc->rfx_peers[index - enc->nslots]->context;
+
+		Stream_Clear(context->encode_stream);
+		Stream_SetPosition(context->encode_stream, 0);
+
+		rfx_compose_message(context->rfx_context,
+				    context->encode_stream,
+				    enc->rfx_rects, enc->ntiles,
+				    rdp_encoder_image_data(enc, &enc->extents),
+				    enc->extents.x2 - enc->extents.x1,
+				    enc->extents.y2 - enc->extents.y1,
+				    pixman_image_get_stride(enc->image));
+		return;
+	}
+
+	first = enc->ntiles * index / enc->nslots;
+	last = enc->ntiles * (index + 1) / enc->nslots;
+
+	for (i = first; i < last; i++) {
+		tile = &enc->tiles[i];
+
+		if (enc->need_raw)
+			pixman_image_flipped_subrect(&tile->box, enc->image,
+						     enc->raw_data + tile->raw_offset);
+
+		if (enc->need_nsc) {
+			Stream_Clear(enc->nsc_streams[i]);
+			Stream_SetPosition(enc->nsc_streams[i], 0);
+
+			nsc_compose_message(enc->nsc_contexts[index],
+					    enc->nsc_streams[i],
+					    rdp_encoder_image_data(enc, &tile->box),
+					    tile->box.x2 - tile->box.x1,
+					    tile->box.y2 - tile->box.y1,
+					    pixman_image_get_stride(enc->image));
+		}
+	}
+}
+
+static void
+rdp_peer_send_rfx(struct rdp_encoder *enc, freerdp_peer *peer)
 {
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
-	pixman_box32_t *rect, subrect;
-	int nrects, i;
-	int heightIncrement, remainingHeight, top;
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
-	rect = pixman_region32_rectangles(region, &nrects);
-	if (!nrects)
-		return;
+	cmd->destLeft = enc->extents.x1;
+	cmd->destTop = enc->extents.y1;
+	cmd->destRight = enc->extents.x2;
+	cmd->destBottom = enc->extents.y2;
+	cmd->bpp = 32;
+	cmd->codecID = peer->settings->RemoteFxCodecId;
+	cmd->width = enc->extents.x2 - enc->extents.x1;
+	cmd->height = enc->extents.y2 - enc->extents.y1;
+
+	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
+	cmd->bitmapData = Stream_Buffer(context->encode_stream);
+
+	update->SurfaceBits(update->context, cmd);
+}
+
+static void
+rdp_peer_send_nsc(struct rdp_encoder *enc, freerdp_peer *peer)
+{
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
+	struct rdp_tile *tile;
+	int i;
+
+	cmd->bpp = 32;
+	cmd->codecID = peer->settings->NSCodecId;
+
+	for (i = 0; i < enc->ntiles; i++) {
+		tile = &enc->tiles[i];
+
+		cmd->destLeft = tile->box.x1;
+		cmd->destTop = tile->box.y1;
+		cmd->destRight = tile->box.x2;
+		cmd->destBottom = tile->box.y2;
+		cmd->width = tile->box.x2 - tile->box.x1;
+		cmd->height = tile->box.y2 - tile->box.y1;
+
+		cmd->bitmapDataLength = Stream_GetPosition(enc->nsc_streams[i]);
+		cmd->bitmapData = Stream_Buffer(enc->nsc_streams[i]);
+
+		update->SurfaceBits(update->context, cmd);
+	}
+}
 
-	marker->frameId++;
-	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
-	update->SurfaceFrameMarker(peer->context, marker);
+static void
+rdp_peer_send_raw(struct rdp_encoder *enc, freerdp_peer *peer)
+{
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
+	struct rdp_tile *tile;
+	int i, heightIncrement, remainingHeight, top;
+	BYTE *bottom_up;
 
 	cmd->bpp = 32;
 	cmd->codecID = 0;
 
-	for (i = 0; i < nrects; i++, rect++) {
-		/*weston_log("rect(%d,%d, %d,%d)\n", rect->x1, rect->y1, rect->x2, rect->y2);*/
-		cmd->destLeft = rect->x1;
-		cmd->destRight = rect->x2;
-		cmd->width = rect->x2 - rect->x1;
+	for (i = 0; i < enc->ntiles; i++) {
+		tile = &enc->tiles[i];
+		bottom_up = enc->raw_data + tile->raw_offset;
 
-		heightIncrement = peer->settings->MultifragMaxRequestSize / (16 + cmd->width * 4);
-		remainingHeight = rect->y2 - rect->y1;
-		top = rect->y1;
+		cmd->destLeft = tile->box.x1;
+		cmd->destRight = tile->box.x2;
+		cmd->width = tile->box.x2 - tile->box.x1;
 
-		subrect.x1 = rect->x1;
-		subrect.x2 = rect->x2;
+		heightIncrement = peer->settings->MultifragMaxRequestSize / (16 + cmd->width * 4);
+		if (heightIncrement < 1)
+			heightIncrement = 1;
+		remainingHeight = tile->box.y2 - tile->box.y1;
+		top = tile->box.y1;
 
+		/* The rows of a chunk are contiguous in the bottom-up copy */
 		while (remainingHeight) {
-			   cmd->height = (remainingHeight > heightIncrement) ? heightIncrement : remainingHeight;
-			   cmd->destTop = top;
-			   cmd->destBottom = top + cmd->height;
-			   cmd->bitmapDataLength = cmd->width * cmd->height * 4;
-			   cmd->bitmapData = (BYTE *)realloc(cmd->bitmapData, cmd->bitmapDataLength);
+			cmd->height = (remainingHeight > heightIncrement) ? heightIncrement : remainingHeight;
+			cmd->destTop = top;
+			cmd->destBottom = top + cmd->height;
+			cmd->bitmapDataLength = cmd->width * cmd->height * 4;
+			cmd->bitmapData = bottom_up +
+				(tile->box.y2 - top - cmd->height) * cmd->width * 4;
+
+			update->SurfaceBits(peer->context, cmd);
+
+			remainingHeight -= cmd->height;
+			top += cmd->height;
+		}
+	}
+
+	cmd->bitmapData = NULL;
+}
+
+/* Frame markers let the peer acknowledge frames. Raw updates always
+ * had them. */
+static void
+rdp_peer_send_frame(struct rdp_encoder *enc, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	rdpUpdate *update = peer->update;
+	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
+	int raw, markers;
+
+	raw = !peer->settings->RemoteFxCodec && !peer->settings->NSCodec;
+	markers = raw || peer->settings->SurfaceFrameMarkerEnabled;
+
+	if (markers) {
+		marker->frameId = ++context->item.frame_id;
+		marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
+		update->SurfaceFrameMarker(peer->context, marker);
+	}
 
-			   subrect.y1 = top;
-			   subrect.y2 = top + cmd->height;
-			   pixman_image_flipped_subrect(&subrect, image, cmd->bitmapData);
+	if (peer->settings->RemoteFxCodec)
+		rdp_peer_send_rfx(enc, peer);
+	else if (peer->settings->NSCodec)
+		rdp_peer_send_nsc(enc, peer);
+	else
+		rdp_peer_send_raw(enc, peer);
+
+	if (markers) {
+		marker->frameAction = SURFACECMD_FRAMEACTION_END;
+		update->SurfaceFrameMarker(peer->context, marker);
+		context->item.flags |= RDP_PEER_FRAME_SENT;
+	}
+}
+
+/* Sends the damage to 'only', or to every active peer when NULL. Every
+ * active peer has seen everything sent so far, so damaged tiles whose
+ * contents did not change are skipped for them. */
+static void
+rdp_output_refresh(struct rdp_output *output, pixman_region32_t *damage,
+		   freerdp_peer *only)
+{
+	struct rdp_encoder *enc = &output->encoder;
+	struct rdp_peers_item *item;
+	int i;
 
-			   /*weston_log("*  sending (%d,%d, %d,%d)\n", subrect.x1, subrect.y1, subrect.x2, subrect.y2); */
-			   update->SurfaceBits(peer->context, cmd);
+	enc->npeers = 0;
+	enc->nrfx_peers = 0;
+	enc->need_raw = 0;
+	enc->need_nsc = 0;
 
-			   remainingHeight -= cmd->height;
-			   top += cmd->height;
+	if (only) {
+		if (rdp_encoder_add_peer(enc, only) < 0)
+			goto err;
+	} else {
+		wl_list_for_each(item, &output->peers, link) {
+			if (!(item->flags & RDP_PEER_ACTIVATED) ||
+			    !(item->flags & RDP_PEER_OUTPUT_ENABLED) ||
+			    (item->flags & RDP_PEER_BEHIND))
+				continue;
+			if (rdp_encoder_add_peer(enc, item->peer) < 0)
+				goto err;
 		}
 	}
 
-	marker->frameAction = SURFACECMD_FRAMEACTION_END;
-	update->SurfaceFrameMarker(peer->context, marker);
+	if (enc->npeers == 0) {
+		/* Nobody will see these changes, forget what we know */
+		memset(enc->hashes, 0,
+		       enc->tiles_x * enc->tiles_y * sizeof *enc->hashes);
+		return;
+	}
+
+	if (rdp_encoder_collect_tiles(enc, damage) < 0)
+		goto err;
+
+	if (!only)
+		rdp_encoder_skip_unchanged(enc);
+
+	if (enc->ntiles == 0)
+		return;
+
+	if (rdp_encoder_prepare(enc) < 0)
+		goto err;
+
+	worker_pool_run(enc->pool, enc->nslots + enc->nrfx_peers,
+			rdp_encoder_encode, enc);
+
+	for (i = 0; i < enc->npeers; i++)
+		rdp_peer_send_frame(enc, enc->peers[i]);
+
+	return;
+
+err:
+	weston_log("RDP encoder out of memory, dropping an update\n");
+	memset(enc->hashes, 0,
+	       enc->tiles_x * enc->tiles_y * sizeof *enc->hashes);
 }
 
 static void
 rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 {
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
-	struct rdp_output *output = context->rdpCompositor->output;
-	rdpSettings *settings = peer->settings;
 
-	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
-	else
-		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+	rdp_output_refresh(context->rdpCompositor->output, region, peer);
 }
 
 static void
@@ -311,30 +807,135 @@ rdp_output_start_repaint_loop(struct weston_output *output)
 	weston_output_finish_frame(output, &ts);
 }
 
+static int
+rdp_peer_frames_behind(struct rdp_peers_item *item)
+{
+	return (item->flags & RDP_PEER_FRAME_ACKS) &&
+		item->frame_id - item->acked_frame_id >= RDP_MAX_FRAMES_IN_FLIGHT;
+}
+
+/* Too much data waiting in the socket, or in the buffer FreeRDP keeps
+ * for what the socket would not take.  FreeRDP 1.1 blocks on writes
+ * instead, so there only the socket counts. */
+static int
+rdp_peer_output_full(struct rdp_peers_item *item)
+{
+	int queued;
+
+#if !(FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1)
+	if (item->peer->IsWriteBlocked &&
+	    item->peer->IsWriteBlocked(item->peer))
+		return 1;
+#endif
+
+	return ioctl(item->peer->sockfd, TIOCOUTQ, &queued) == 0 &&
+		queued > item->max_queued;
+}
+
+/* A peer is congested when it has too many frames left to acknowledge
+ * or when too much data is waiting to be sent to it. */
+static int
+rdp_peer_congested(struct rdp_peers_item *item)
+{
+	return rdp_peer_frames_behind(item) || rdp_peer_output_full(item);
+}
+
+/* Peers that are behind get a repaint once they can take more: on a
+ * frame acknowledgement, see xf_peer_frame_acknowledge(), or, when
+ * their output was full, once it drained, which this timer watches
+ * without repainting in the meantime. */
+static int
+rdp_peer_drain_handler(void *data)
+{
+	struct rdp_peers_item *item = data;
+	RdpPeerContext *context = (RdpPeerContext *)item->peer->context;
+
+	if (!(item->flags & RDP_PEER_BEHIND))
+		return 1;
+
+#if !(FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1)
+	if (item->peer->IsWriteBlocked &&
+	    item->peer->IsWriteBlocked(item->peer))
+		item->peer->DrainOutputBuffer(item->peer);
+#endif
+
+	if (rdp_peer_output_full(item))
+		wl_event_source_timer_update(item->drain_timer,
+					     RDP_FRAME_INTERVAL);
+	else if (!rdp_peer_frames_behind(item))
+		weston_output_schedule_repaint(&context->rdpCompositor->output->base);
+
+	return 1;
+}
+
+static void
+rdp_output_send_damage(struct rdp_output *output, pixman_region32_t *damage)
+{
+	struct rdp_peers_item *item;
+
+	/* Congested peers collect the damage instead */
+	wl_list_for_each(item, &output->peers, link) {
+		if (!(item->flags & RDP_PEER_ACTIVATED) ||
+		    !(item->flags & RDP_PEER_OUTPUT_ENABLED))
+			continue;
+
+		if ((item->flags & RDP_PEER_BEHIND) || rdp_peer_congested(item)) {
+			pixman_region32_union(&item->pending_damage,
+					      &item->pending_damage, damage);
+			item->flags |= RDP_PEER_BEHIND;
+			if (rdp_peer_output_full(item))
+				wl_event_source_timer_update(item->drain_timer,
+							     RDP_FRAME_INTERVAL);
+		}
+	}
+
+	if (pixman_region32_not_empty(damage))
+		rdp_output_refresh(output, damage, NULL);
+
+	/* Peers that caught up get all they missed in one update */
+	wl_list_for_each(item, &output->peers, link) {
+		if (!(item->flags & RDP_PEER_BEHIND) ||
+		    !(item->flags & RDP_PEER_ACTIVATED) ||
+		    !(item->flags & RDP_PEER_OUTPUT_ENABLED) ||
+		    rdp_peer_congested(item))
+			continue;
+
+		rdp_output_refresh(output, &item->pending_damage, item->peer);
+		pixman_region32_clear(&item->pending_damage);
+		item->flags &= ~RDP_PEER_BEHIND;
+	}
+}
+
 static int
 rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage)
 {
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
-	struct rdp_peers_item *outputPeer;
+	struct rdp_peers_item *item;
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
-	if (pixman_region32_not_empty(damage)) {
-		wl_list_for_each(outputPeer, &output->peers, link) {
-			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
-			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
-			}
-		}
-	}
+	wl_list_for_each(item, &output->peers, link)
+		item->flags &= ~RDP_PEER_FRAME_SENT;
+
+	rdp_output_send_damage(output, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	/* The frame is done when the first peer acknowledges it, so the
+	 * repaint rate follows the fastest peer. Peers that do not
+	 * acknowledge frames get the fixed rate. */
+	output->waiting_for_ack = 0;
+	wl_list_for_each(item, &output->peers, link)
+		if ((item->flags & RDP_PEER_FRAME_ACKS) &&
+		    (item->flags & RDP_PEER_FRAME_SENT))
+			output->waiting_for_ack = 1;
+
+	wl_event_source_timer_update(output->finish_frame_timer,
+				     output->waiting_for_ack ?
+				     RDP_FRAME_ACK_TIMEOUT : RDP_FRAME_INTERVAL);
 	return 0;
 }
 
@@ -344,13 +945,21 @@ rdp_output_destroy(struct weston_output *output_base)
 	struct rdp_output *output = (struct rdp_output *)output_base;
 
 	wl_event_source_remove(output->finish_frame_timer);
+	rdp_encoder_release(&output->encoder);
 	free(output);
 }
 
+static void
+rdp_output_finish_frame(struct rdp_output *output)
+{
+	output->waiting_for_ack = 0;
+	rdp_output_start_repaint_loop(&output->base);
+}
+
 static int
 finish_frame_handler(void *data)
 {
-	rdp_output_start_repaint_loop(data);
+	rdp_output_finish_frame(data);
 
 	return 1;
 }
@@ -397,16 +1006,26 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode) {
 	if (local_mode == output->current_mode)
 		return 0;
 
+	/* Everything that can fail comes before the output changes */
+	new_shadow_buffer = pixman_image_create_bits(PIXMAN_x8r8g8b8, target_mode->width,
+			target_mode->height, 0, target_mode->width * 4);
+	if (!new_shadow_buffer)
+		return -ENOMEM;
+
+	if (rdp_encoder_set_image(&rdpOutput->encoder, new_shadow_buffer) < 0) {
+		weston_log("failed to allocate the RDP tile grid\n");
+		pixman_image_unref(new_shadow_buffer);
+		return -ENOMEM;
+	}
+
 	output->current_mode->flags &= ~WL_OUTPUT_MODE_CURRENT;
 
 	output->current_mode = local_mode;
 	output->current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
 
 	pixman_renderer_output_destroy(output);
-	pixman_renderer_output_create(output);
+	pixman_renderer_output_create(output, 0);
 
-	new_shadow_buffer = pixman_image_create_bits(PIXMAN_x8r8g8b8, target_mode->width,
-			target_mode->height, 0, target_mode->width * 4);
 	pixman_image_composite32(PIXMAN_OP_SRC, rdpOutput->shadow_surface, 0, new_shadow_buffer,
 			0, 0, 0, 0, 0, 0, target_mode->width, target_mode->height);
 	pixman_image_unref(rdpOutput->shadow_surface);
@@ -469,8 +1088,14 @@ rdp_compositor_create_output(struct rdp_compositor *c, int width, int height)
 		goto out_output;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
-		goto out_shadow_surface;
+	if (rdp_encoder_init(&output->encoder, c->encoder_threads) < 0 ||
+	    rdp_encoder_set_image(&output->encoder, output->shadow_surface) < 0) {
+		weston_log("Failed to create the RDP encoder.\n");
+		goto out_encoder;
+	}
+
+	if (pixman_renderer_output_create(&output->base, 0) < 0)
+		goto out_encoder;
 
 	loop = wl_display_get_event_loop(c->base.wl_display);
 	output->finish_frame_timer = wl_event_loop_add_timer(loop, finish_frame_handler, output);
@@ -487,7 +1112,8 @@ rdp_compositor_create_output(struct rdp_compositor *c, int width, int height)
 	wl_list_insert(c->base.output_list.prev, &output->base.link);
 	return 0;
 
-out_shadow_surface:
+out_encoder:
+	rdp_encoder_release(&output->encoder);
 	pixman_image_unref(output->shadow_surface);
 out_output:
 	weston_output_destroy(&output->base);
@@ -553,6 +1179,7 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 {
 	context->item.peer = client;
 	context->item.flags = RDP_PEER_OUTPUT_ENABLED;
+	pixman_region32_init(&context->item.pending_damage);
 
 #if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
 	context->rfx_context = rfx_context_new();
@@ -564,9 +1191,6 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	context->rfx_context->height = client->settings->DesktopHeight;
 	rfx_context_set_pixel_format(context->rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
 
-	context->nsc_context = nsc_context_new();
-	nsc_context_set_pixel_format(context->nsc_context, RDP_PIXEL_FORMAT_B8G8R8A8);
-
 	context->encode_stream = Stream_New(NULL, 65536);
 }
 
@@ -582,6 +1206,8 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		if (context->events[i])
 			wl_event_source_remove(context->events[i]);
 	}
+	if (context->item.drain_timer)
+		wl_event_source_remove(context->item.drain_timer);
 
 	if (context->item.flags & RDP_PEER_ACTIVATED) {
 		weston_seat_release_keyboard(&context->item.seat);
@@ -589,9 +1215,8 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		weston_seat_release(&context->item.seat);
 	}
 	Stream_Free(context->encode_stream, TRUE);
-	nsc_context_free(context->nsc_context);
 	rfx_context_free(context->rfx_context);
-	free(context->rfx_rects);
+	pixman_region32_fini(&context->item.pending_damage);
 }
 
 
@@ -994,6 +1619,27 @@ xf_input_unicode_keyboard_event(rdpInput *input, UINT16 flags, UINT16 code)
 }
 
 
+static void
+xf_peer_frame_acknowledge(rdpContext *context, UINT32 frameId)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+	struct rdp_peers_item *item = &peerContext->item;
+	struct rdp_output *output = peerContext->rdpCompositor->output;
+
+	item->flags |= RDP_PEER_FRAME_ACKS;
+	item->acked_frame_id = frameId;
+
+	if (output->waiting_for_ack && frameId == item->frame_id &&
+	    (item->flags & RDP_PEER_FRAME_SENT)) {
+		wl_event_source_timer_update(output->finish_frame_timer, 0);
+		rdp_output_finish_frame(output);
+	}
+
+	/* While its output is full, the drain timer takes care of it */
+	if ((item->flags & RDP_PEER_BEHIND) && !rdp_peer_congested(item))
+		weston_output_schedule_repaint(&output->base);
+}
+
 static void
 xf_suppress_output(rdpContext *context, BYTE allow, RECTANGLE_16 *area) {
 	RdpPeerContext *peerContext = (RdpPeerContext *)context;
@@ -1014,6 +1660,8 @@ rdp_peer_init(freerdp_peer *client, struct rdp_compositor *c)
 	rdpInput *input;
 	RdpPeerContext *peerCtx;
 	char seat_name[32];
+	int sndbuf;
+	socklen_t len;
 
 	client->ContextSize = sizeof(RdpPeerContext);
 	client->ContextNew = (psPeerContextNew)rdp_peer_context_new;
@@ -1033,12 +1681,21 @@ rdp_peer_init(freerdp_peer *client, struct rdp_compositor *c)
 	}
 
 	settings->NlaSecurity = FALSE;
+	settings->FrameAcknowledge = RDP_MAX_FRAMES_IN_FLIGHT;
+
+	/* Stop sending before writes to the peer would block */
+	len = sizeof sndbuf;
+	if (getsockopt(client->sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == 0)
+		peerCtx->item.max_queued = sndbuf / 2;
+	else
+		peerCtx->item.max_queued = RDP_DEFAULT_MAX_QUEUED;
 
 	client->Capabilities = xf_peer_capabilities;
 	client->PostConnect = xf_peer_post_connect;
 	client->Activate = xf_peer_activate;
 
 	client->update->SuppressOutput = xf_suppress_output;
+	client->update->SurfaceFrameAcknowledge = xf_peer_frame_acknowledge;
 
 	input = client->input;
 	input->SynchronizeEvent = xf_input_synchronize_event;
@@ -1069,6 +1726,14 @@ rdp_peer_init(freerdp_peer *client, struct rdp_compositor *c)
 	for ( ; i < MAX_FREERDP_FDS; i++)
 		peerCtx->events[i] = 0;
 
+	peerCtx->item.drain_timer =
+		wl_event_loop_add_timer(loop, rdp_peer_drain_handler,
+					&peerCtx->item);
+	if (!peerCtx->item.drain_timer) {
+		weston_log("unable to create the peer drain timer\n");
+		return -1;
+	}
+
 	wl_list_insert(&c->output->peers, &peerCtx->item.link);
 	return 0;
 }
@@ -1102,6 +1767,7 @@ rdp_compositor_create(struct wl_display *display,
 	c->base.restore = rdp_restore;
 	c->rdp_key = config->rdp_key ? strdup(config->rdp_key) : NULL;
 	c->no_clients_resize = config->no_clients_resize;
+	c->encoder_threads = config->encoder_threads;
 
 	/* activate TLS only if certificate/key are available */
 	if (config->server_cert && config->server_key) {
@@ -1186,6 +1852,7 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 		{ WESTON_OPTION_STRING,  "address", 0, &config.bind_address },
 		{ WESTON_OPTION_INTEGER, "port", 0, &config.port },
 		{ WESTON_OPTION_BOOLEAN, "no-clients-resize", 0, &config.no_clients_resize },
+		{ WESTON_OPTION_INTEGER, "encoder-threads", 0, &config.encoder_threads },
 		{ WESTON_OPTION_STRING,  "rdp4-key", 0, &config.rdp_key },
 		{ WESTON_OPTION_STRING,  "rdp-tls-cert", 0, &config.server_cert },
 		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key }
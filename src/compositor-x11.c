@@ -885,7 +885,7 @@ x11_compositor_create_output(struct x11_compositor *c, int x, int y,
 					output->mode.width,
 					output->mode.height) < 0)
 			return NULL;
-		if (pixman_renderer_output_create(&output->base) < 0) {
+		if (pixman_renderer_output_create(&output->base, 0) < 0) {
 			x11_output_deinit_shm(c, output);
 			return NULL;
 		}
@@ -178,6 +178,7 @@ weston_output_switch_mode(struct weston_output *output, struct weston_mode *mode
 	pixman_region32_init(&output->previous_damage);
 	pixman_region32_init_rect(&output->region, output->x, output->y,
 				  output->width, output->height);
+	output->compositor->pick_grid.dirty = 1;
 
 	weston_output_update_matrix(output);
 
@@ -392,6 +393,12 @@ region_init_infinite(pixman_region32_t *region)
 static struct weston_subsurface *
 weston_surface_to_subsurface(struct weston_surface *surface);
 
+static void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor)
+{
+	compositor->view_list_dirty = 1;
+}
+
 WL_EXPORT struct weston_view *
 weston_view_create(struct weston_surface *surface)
 {
@@ -1147,6 +1154,244 @@ weston_view_update_transform_enable(struct weston_view *view)
 	return 0;
 }
 
+#define PICK_GRID_CELL_SHIFT	7
+#define PICK_GRID_MAX_CELLS	16384
+
+static void
+pick_grid_view_range(struct weston_pick_grid *grid, struct weston_view *view,
+		     int32_t *x1, int32_t *y1, int32_t *x2, int32_t *y2)
+{
+	pixman_box32_t *box;
+	int64_t bx1, by1, bx2, by2;
+	int64_t gx2, gy2;
+
+	box = pixman_region32_extents(&view->transform.masked_boundingbox);
+	gx2 = (int64_t) grid->x + ((int64_t) grid->width << grid->cell_shift);
+	gy2 = (int64_t) grid->y + ((int64_t) grid->height << grid->cell_shift);
+
+	bx1 = MAX(box->x1, grid->x);
+	by1 = MAX(box->y1, grid->y);
+	bx2 = MIN(box->x2, gx2);
+	by2 = MIN(box->y2, gy2);
+
+	if (bx1 >= bx2 || by1 >= by2) {
+		*x1 = *y1 = *x2 = *y2 = 0;
+		return;
+	}
+
+	*x1 = (bx1 - grid->x) >> grid->cell_shift;
+	*y1 = (by1 - grid->y) >> grid->cell_shift;
+	*x2 = ((bx2 - 1 - grid->x) >> grid->cell_shift) + 1;
+	*y2 = ((by2 - 1 - grid->y) >> grid->cell_shift) + 1;
+}
+
+static int
+pick_grid_cell_insert(struct wl_array *cell, struct weston_view *view)
+{
+	struct weston_view **views = cell->data;
+	size_t n = cell->size / sizeof *views;
+	size_t lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (views[mid]->pick.order < view->pick.order)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!wl_array_add(cell, sizeof *views))
+		return -1;
+
+	views = cell->data;
+	memmove(&views[lo + 1], &views[lo], (n - lo) * sizeof *views);
+	views[lo] = view;
+
+	return 0;
+}
+
+static void
+pick_grid_cell_remove(struct wl_array *cell, struct weston_view *view)
+{
+	struct weston_view **views = cell->data;
+	size_t n = cell->size / sizeof *views;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (views[i] == view) {
+			memmove(&views[i], &views[i + 1],
+				(n - i - 1) * sizeof *views);
+			cell->size -= sizeof *views;
+			return;
+		}
+	}
+}
+
+static void
+pick_grid_unlink_view(struct weston_pick_grid *grid, struct weston_view *view)
+{
+	int32_t cx, cy;
+
+	for (cy = view->pick.y1; cy < view->pick.y2; cy++)
+		for (cx = view->pick.x1; cx < view->pick.x2; cx++)
+			pick_grid_cell_remove(&grid->cells[cy * grid->width + cx],
+					      view);
+}
+
+static void
+pick_grid_link_view(struct weston_pick_grid *grid, struct weston_view *view)
+{
+	int32_t cx, cy;
+
+	pick_grid_view_range(grid, view, &view->pick.x1, &view->pick.y1,
+			     &view->pick.x2, &view->pick.y2);
+
+	for (cy = view->pick.y1; cy < view->pick.y2; cy++)
+		for (cx = view->pick.x1; cx < view->pick.x2; cx++)
+			if (pick_grid_cell_insert(&grid->cells[cy * grid->width + cx],
+						  view) < 0)
+				grid->dirty = 1;
+}
+
+static void
+pick_grid_release(struct weston_pick_grid *grid)
+{
+	int32_t i;
+
+	for (i = 0; i < grid->width * grid->height; i++)
+		wl_array_release(&grid->cells[i]);
+	free(grid->cells);
+
+	grid->cells = NULL;
+	grid->width = 0;
+	grid->height = 0;
+}
+
+static void
+pick_grid_rebuild(struct weston_compositor *compositor)
+{
+	struct weston_pick_grid *grid = &compositor->pick_grid;
+	struct weston_output *output;
+	struct weston_view *view;
+	pixman_region32_t layout;
+	pixman_box32_t *box;
+	int32_t width, height, i;
+	int shift = PICK_GRID_CELL_SHIFT;
+	uint32_t order = 0;
+
+	pixman_region32_init(&layout);
+	wl_list_for_each(output, &compositor->output_list, link)
+		pixman_region32_union(&layout, &layout, &output->region);
+	box = pixman_region32_extents(&layout);
+
+	for (;;) {
+		width = ((box->x2 - box->x1) + (1 << shift) - 1) >> shift;
+		height = ((box->y2 - box->y1) + (1 << shift) - 1) >> shift;
+		if (width * height <= PICK_GRID_MAX_CELLS)
+			break;
+		shift++;
+	}
+
+	if (width != grid->width || height != grid->height) {
+		pick_grid_release(grid);
+		if (width * height > 0) {
+			grid->cells = calloc(width * height,
+					     sizeof *grid->cells);
+			if (grid->cells) {
+				grid->width = width;
+				grid->height = height;
+			}
+		}
+	} else {
+		for (i = 0; i < width * height; i++)
+			grid->cells[i].size = 0;
+	}
+
+	grid->x = box->x1;
+	grid->y = box->y1;
+	grid->cell_shift = shift;
+	pixman_region32_fini(&layout);
+
+	/* 0 is reserved for views not in the grid */
+	if (++grid->generation == 0)
+		grid->generation = 1;
+
+	grid->dirty = 0;
+	wl_list_for_each(view, &compositor->view_list, link) {
+		view->pick.generation = grid->generation;
+		view->pick.order = order++;
+		pick_grid_link_view(grid, view);
+	}
+	grid->count = order;
+
+	compositor->pick_serial++;
+}
+
+/* Called after the view list has been rebuilt. The grid is kept as long
+ * as the stacking order is unchanged, otherwise it is rebuilt from
+ * scratch.
+ */
+static void
+pick_grid_sync_order(struct weston_compositor *compositor)
+{
+	struct weston_pick_grid *grid = &compositor->pick_grid;
+	struct weston_view *view;
+	uint32_t order = 0;
+
+	if (!grid->dirty) {
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (view->pick.generation != grid->generation ||
+			    view->pick.order != order) {
+				grid->dirty = 1;
+				break;
+			}
+			order++;
+		}
+	}
+
+	if (grid->dirty || order != grid->count)
+		pick_grid_rebuild(compositor);
+}
+
+/* Called whenever the transform of a view has been recomputed. */
+static void
+pick_grid_update_view(struct weston_compositor *compositor,
+		      struct weston_view *view)
+{
+	struct weston_pick_grid *grid = &compositor->pick_grid;
+	int32_t x1, y1, x2, y2;
+
+	if (pixman_region32_not_empty(&view->surface->input))
+		compositor->pick_serial++;
+
+	if (grid->dirty || view->pick.generation != grid->generation)
+		return;
+
+	pick_grid_view_range(grid, view, &x1, &y1, &x2, &y2);
+	if (x1 == view->pick.x1 && y1 == view->pick.y1 &&
+	    x2 == view->pick.x2 && y2 == view->pick.y2)
+		return;
+
+	pick_grid_unlink_view(grid, view);
+	pick_grid_link_view(grid, view);
+}
+
+static void
+pick_grid_remove_view(struct weston_compositor *compositor,
+		      struct weston_view *view)
+{
+	struct weston_pick_grid *grid = &compositor->pick_grid;
+
+	if (view->pick.generation != grid->generation)
+		return;
+
+	pick_grid_unlink_view(grid, view);
+	view->pick.generation = 0;
+	grid->count--;
+
+	compositor->pick_serial++;
+}
+
 static struct weston_layer *
 get_view_layer(struct weston_view *view)
 {
@@ -1198,6 +1443,8 @@ weston_view_update_transform(struct weston_view *view)
 		pixman_region32_fini(&mask);
 	}
 
+	pick_grid_update_view(view->surface->compositor, view);
+
 	weston_view_damage_below(view);
 
 	weston_view_assign_output(view);
@@ -1357,6 +1604,7 @@ weston_view_set_transform_parent(struct weston_view *view,
 	}
 
 	view->geometry.parent = parent;
+	weston_compositor_view_list_dirty(view->surface->compositor);
 
 	view->geometry.parent_destroy_listener.notify =
 		transform_parent_handle_parent_destroy;
@@ -1483,25 +1731,55 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+static int
+view_contains_point(struct weston_view *view, wl_fixed_t x, wl_fixed_t y,
+		    wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	if (!pixman_region32_contains_point(&view->transform.masked_boundingbox,
+					    wl_fixed_to_int(x),
+					    wl_fixed_to_int(y), NULL))
+		return 0;
+
+	weston_view_from_global_fixed(view, x, y, vx, vy);
+
+	return pixman_region32_contains_point(&view->surface->input,
+					      wl_fixed_to_int(*vx),
+					      wl_fixed_to_int(*vy),
+					      NULL);
+}
+
 WL_EXPORT struct weston_view *
 weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t x, wl_fixed_t y,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
-	struct weston_view *view;
-        int ix = wl_fixed_to_int(x);
-        int iy = wl_fixed_to_int(y);
+	struct weston_pick_grid *grid = &compositor->pick_grid;
+	struct weston_view *view, **v;
+	struct wl_array *cell;
+	int ix = wl_fixed_to_int(x);
+	int iy = wl_fixed_to_int(y);
+	int64_t cx, cy;
+
+	cx = ((int64_t) ix - grid->x) >> grid->cell_shift;
+	cy = ((int64_t) iy - grid->y) >> grid->cell_shift;
+
+	/* Outside of the output layout, or while the grid is stale, fall
+	 * back to walking the whole view list. */
+	if (grid->dirty ||
+	    ix < grid->x || cx >= grid->width ||
+	    iy < grid->y || cy >= grid->height) {
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (view_contains_point(view, x, y, vx, vy))
+				return view;
+		}
 
-	wl_list_for_each(view, &compositor->view_list, link) {
-		weston_view_from_global_fixed(view, x, y, vx, vy);
-		if (pixman_region32_contains_point(
-			&view->transform.masked_boundingbox,
-						   ix, iy, NULL) &&
-		    pixman_region32_contains_point(&view->surface->input,
-						   wl_fixed_to_int(*vx),
-						   wl_fixed_to_int(*vy),
-						   NULL))
-			return view;
+		return NULL;
+	}
+
+	cell = &grid->cells[cy * grid->width + cx];
+	wl_array_for_each(v, cell) {
+		if (view_contains_point(*v, x, y, vx, vy))
+			return *v;
 	}
 
 	return NULL;
@@ -1515,6 +1793,11 @@ weston_compositor_repick(struct weston_compositor *compositor)
 	if (!compositor->session_active)
 		return;
 
+	/* Nothing that affects picking changed since the last repick. */
+	if (compositor->repick_serial == compositor->pick_serial)
+		return;
+	compositor->repick_serial = compositor->pick_serial;
+
 	wl_list_for_each(seat, &compositor->seat_list, link)
 		weston_seat_repick(seat);
 }
@@ -1528,6 +1811,8 @@ weston_view_unmap(struct weston_view *view)
 		return;
 
 	weston_view_damage_below(view);
+	weston_compositor_view_list_dirty(view->surface->compositor);
+	pick_grid_remove_view(view->surface->compositor, view);
 	view->output = NULL;
 	view->plane = NULL;
 	weston_layer_entry_remove(&view->layer_link);
@@ -1560,6 +1845,7 @@ weston_surface_unmap(struct weston_surface *surface)
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
 	surface->output = NULL;
+	weston_compositor_view_list_dirty(surface->compositor);
 }
 
 static void
@@ -1584,6 +1870,9 @@ weston_view_destroy(struct weston_view *view)
 		weston_compositor_build_view_list(view->surface->compositor);
 	}
 
+	pick_grid_remove_view(view->surface->compositor, view);
+	if (!wl_list_empty(&view->link))
+		weston_compositor_view_list_dirty(view->surface->compositor);
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
 
@@ -1763,11 +2052,37 @@ surface_flush_damage(struct weston_surface *surface)
 	pixman_region32_clear(&surface->damage);
 }
 
+/* Views are visited front to back, 'opaque' holding what the views
+ * above on the same plane cover.  Rather than a copy of all of it, the
+ * clip of a view only keeps the part within its bounding box, which is
+ * all the renderers subtract it from. */
 static void
 view_accumulate_damage(struct weston_view *view,
 		       pixman_region32_t *opaque)
 {
 	pixman_region32_t damage;
+	pixman_box32_t *bbox;
+
+	bbox = pixman_region32_extents(&view->transform.masked_boundingbox);
+
+	switch (pixman_region32_contains_rectangle(opaque, bbox)) {
+	case PIXMAN_REGION_IN:
+		/* Its damage is hidden as well, and it adds nothing to
+		 * the opaque region. */
+		view->culled = 1;
+		pixman_region32_reset(&view->clip, bbox);
+		return;
+	case PIXMAN_REGION_OUT:
+		pixman_region32_clear(&view->clip);
+		break;
+	default:
+		pixman_region32_intersect_rect(&view->clip, opaque,
+					       bbox->x1, bbox->y1,
+					       bbox->x2 - bbox->x1,
+					       bbox->y2 - bbox->y1);
+		break;
+	}
+	view->culled = 0;
 
 	pixman_region32_init(&damage);
 	if (view->transform.enabled) {
@@ -1788,20 +2103,25 @@ view_accumulate_damage(struct weston_view *view,
 					  view->geometry.y - view->plane->y);
 	}
 
-	pixman_region32_subtract(&damage, &damage, opaque);
+	if (pixman_region32_not_empty(&view->clip))
+		pixman_region32_subtract(&damage, &damage, &view->clip);
 	pixman_region32_union(&view->plane->damage,
 			      &view->plane->damage, &damage);
 	pixman_region32_fini(&damage);
-	pixman_region32_copy(&view->clip, opaque);
-	pixman_region32_union(opaque, opaque, &view->transform.masked_opaque);
+
+	if (pixman_region32_not_empty(&view->transform.masked_opaque))
+		pixman_region32_union(opaque, opaque,
+				      &view->transform.masked_opaque);
 }
 
 static void
-compositor_accumulate_damage(struct weston_compositor *ec)
+compositor_accumulate_damage(struct weston_compositor *ec,
+			     struct weston_output *output)
 {
 	struct weston_plane *plane;
 	struct weston_view *ev;
 	pixman_region32_t opaque, clip;
+	uint32_t views = 0, culled = 0, clip_rects = 0;
 
 	pixman_region32_init(&clip);
 
@@ -1815,6 +2135,15 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 				continue;
 
 			view_accumulate_damage(ev, &opaque);
+
+			if (!(ev->output_mask & (1 << output->id)))
+				continue;
+			views++;
+			if (ev->culled)
+				culled++;
+			else
+				clip_rects +=
+					pixman_region32_n_rects(&ev->clip);
 		}
 
 		pixman_region32_union(&clip, &clip, &opaque);
@@ -1823,6 +2152,8 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 
 	pixman_region32_fini(&clip);
 
+	weston_output_frame_stats_views(output, views, culled, clip_rects);
+
 	wl_list_for_each(ev, &ec->view_list, link)
 		ev->surface->touched = 0;
 
@@ -1948,12 +2279,64 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+/* Layers are stacked by linking them directly into
+ * weston_compositor::layer_list, so compare the stack against the one
+ * the view list was last built from.
+ */
+static int
+weston_compositor_layer_stack_changed(struct weston_compositor *compositor)
+{
+	struct weston_layer *layer, **stack;
+	size_t count, i = 0;
+
+	stack = compositor->layer_stack.data;
+	count = compositor->layer_stack.size / sizeof *stack;
+
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		if (i >= count || stack[i] != layer)
+			return 1;
+		i++;
+	}
+
+	return i != count;
+}
+
+static void
+weston_compositor_save_layer_stack(struct weston_compositor *compositor)
+{
+	struct weston_layer *layer, **l;
+
+	compositor->layer_stack.size = 0;
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		l = wl_array_add(&compositor->layer_stack, sizeof *l);
+		if (!l) {
+			/* Forces a rebuild next time around. */
+			compositor->view_list_dirty = 1;
+			return;
+		}
+		*l = layer;
+	}
+}
+
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
 	struct weston_view *view;
 	struct weston_layer *layer;
 
+	if (!compositor->view_list_dirty &&
+	    !weston_compositor_layer_stack_changed(compositor)) {
+		wl_list_for_each(view, &compositor->view_list, link)
+			weston_view_update_transform(view);
+
+		if (compositor->pick_grid.dirty)
+			pick_grid_rebuild(compositor);
+
+		return;
+	}
+
+	compositor->view_list_rebuilds++;
+
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_stash_subsurface_views(view->surface);
@@ -1968,6 +2351,13 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	/* Creating and destroying subsurface views above marks the list
+	 * dirty again, so only clear the flag once we are done. */
+	compositor->view_list_dirty = 0;
+	weston_compositor_save_layer_stack(compositor);
+
+	pick_grid_sync_order(compositor);
 }
 
 static int
@@ -1979,20 +2369,34 @@ weston_output_repaint(struct weston_output *output)
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
 	pixman_region32_t output_damage;
+	/* end of each stage, stamps[0] being the start of the repaint */
+	struct timespec stamps[WESTON_FRAME_STAGE_RENDER + 1];
+	uint32_t rebuilds;
 	int r;
 
 	if (output->destroying)
 		return 0;
 
+	clock_gettime(ec->presentation_clock, &stamps[0]);
+
+	weston_compositor_flush_motion(ec);
+
 	/* Rebuild the surface list and update surface transforms up front. */
+	rebuilds = ec->view_list_rebuilds;
 	weston_compositor_build_view_list(ec);
 
+	clock_gettime(ec->presentation_clock,
+		      &stamps[WESTON_FRAME_STAGE_VIEW_LIST]);
+
 	if (output->assign_planes && !output->disable_planes)
 		output->assign_planes(output);
 	else
 		wl_list_for_each(ev, &ec->view_list, link)
 			weston_view_move_to_plane(ev, &ec->primary_plane);
 
+	clock_gettime(ec->presentation_clock,
+		      &stamps[WESTON_FRAME_STAGE_ASSIGN_PLANES]);
+
 	wl_list_init(&frame_callback_list);
 	wl_list_for_each(ev, &ec->view_list, link) {
 		/* Note: This operation is safe to do multiple times on the
@@ -2009,7 +2413,7 @@ weston_output_repaint(struct weston_output *output)
 		}
 	}
 
-	compositor_accumulate_damage(ec);
+	compositor_accumulate_damage(ec, output);
 
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
@@ -2020,10 +2424,21 @@ weston_output_repaint(struct weston_output *output)
 	if (output->dirty)
 		weston_output_update_matrix(output);
 
+	clock_gettime(ec->presentation_clock,
+		      &stamps[WESTON_FRAME_STAGE_DAMAGE]);
+
 	r = output->repaint(output, &output_damage);
 
+	clock_gettime(ec->presentation_clock,
+		      &stamps[WESTON_FRAME_STAGE_RENDER]);
+
 	pixman_region32_fini(&output_damage);
 
+	if (r == 0)
+		weston_output_frame_stats_repaint(output, stamps,
+						  ec->view_list_rebuilds !=
+						  rebuilds);
+
 	output->repaint_needed = 0;
 
 	weston_compositor_repick(ec);
@@ -2062,6 +2477,8 @@ weston_output_finish_frame(struct weston_output *output,
 	int fd, r;
 	uint32_t refresh_nsec;
 
+	weston_output_frame_stats_present(output, stamp);
+
 	refresh_nsec = 1000000000000UL / output->current_mode->refresh;
 	weston_presentation_feedback_present_list(&output->feedback_list,
 						  output, refresh_nsec, stamp,
@@ -2099,13 +2516,22 @@ WL_EXPORT void
 weston_layer_entry_insert(struct weston_layer_entry *list,
 			  struct weston_layer_entry *entry)
 {
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	weston_compositor_view_list_dirty(view->surface->compositor);
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
+	if (entry->layer)
+		weston_compositor_view_list_dirty(view->surface->compositor);
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -2155,6 +2581,7 @@ weston_output_schedule_repaint(struct weston_output *output)
 		return;
 
 	loop = wl_display_get_event_loop(compositor->wl_display);
+	weston_output_frame_stats_request(output);
 	output->repaint_needed = 1;
 	if (output->repaint_scheduled)
 		return;
@@ -2291,16 +2718,42 @@ surface_set_input_region(struct wl_client *client,
 	}
 }
 
+static int
+weston_surface_subsurface_order_changed(struct weston_surface *surface)
+{
+	struct wl_list *cur = surface->subsurface_list.next;
+	struct wl_list *pending = surface->subsurface_list_pending.next;
+
+	while (cur != &surface->subsurface_list &&
+	       pending != &surface->subsurface_list_pending) {
+		if (container_of(cur, struct weston_subsurface, parent_link) !=
+		    container_of(pending, struct weston_subsurface,
+				 parent_link_pending))
+			return 1;
+
+		cur = cur->next;
+		pending = pending->next;
+	}
+
+	return cur != &surface->subsurface_list ||
+	       pending != &surface->subsurface_list_pending;
+}
+
 static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
 
+	if (!weston_surface_subsurface_order_changed(surface))
+		return;
+
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 	}
+
+	weston_compositor_view_list_dirty(surface->compositor);
 }
 
 static void
@@ -2309,6 +2762,7 @@ weston_surface_commit_state(struct weston_surface *surface,
 {
 	struct weston_view *view;
 	pixman_region32_t opaque;
+	pixman_region32_t input;
 
 	/* wl_surface.set_buffer_transform */
 	/* wl_surface.set_buffer_scale */
@@ -2352,9 +2806,17 @@ weston_surface_commit_state(struct weston_surface *surface,
 	pixman_region32_fini(&opaque);
 
 	/* wl_surface.set_input_region */
-	pixman_region32_intersect_rect(&surface->input, &state->input,
+	pixman_region32_init(&input);
+	pixman_region32_intersect_rect(&input, &state->input,
 				       0, 0, surface->width, surface->height);
 
+	if (!pixman_region32_equal(&input, &surface->input)) {
+		pixman_region32_copy(&surface->input, &input);
+		surface->compositor->pick_serial++;
+	}
+
+	pixman_region32_fini(&input);
+
 	/* wl_surface.frame */
 	wl_list_insert_list(&surface->frame_callback_list,
 			    &state->frame_callback_list);
@@ -2741,6 +3203,7 @@ subsurface_configure(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 		surface->output = output;
 		weston_surface_update_output_mask(surface, 1 << output->id);
+		weston_compositor_view_list_dirty(compositor);
 	}
 }
 
@@ -2917,6 +3380,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	weston_compositor_view_list_dirty(sub->surface->compositor);
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -2983,6 +3447,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	weston_compositor_view_list_dirty(parent->compositor);
 }
 
 static void
@@ -3380,6 +3845,7 @@ weston_output_destroy(struct weston_output *output)
 
 	weston_compositor_remove_output(output->compositor, output);
 	wl_list_remove(&output->link);
+	output->compositor->pick_grid.dirty = 1;
 
 	wl_signal_emit(&output->compositor->output_destroyed_signal, output);
 	wl_signal_emit(&output->destroy_signal, output);
@@ -3387,6 +3853,7 @@ weston_output_destroy(struct weston_output *output)
 	free(output->name);
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
+	weston_output_frame_stats_destroy(output);
 	output->compositor->output_id_pool &= ~(1 << output->id);
 
 	wl_resource_for_each(resource, &output->resource_list) {
@@ -3522,6 +3989,8 @@ weston_output_init_geometry(struct weston_output *output, int x, int y)
 	pixman_region32_init_rect(&output->region, x, y,
 				  output->width,
 				  output->height);
+
+	output->compositor->pick_grid.dirty = 1;
 }
 
 WL_EXPORT void
@@ -3578,6 +4047,7 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 
 	weston_output_transform_scale_init(output, transform, scale);
 	weston_output_init_zoom(output);
+	weston_output_frame_stats_init(output);
 
 	weston_output_init_geometry(output, x, y);
 	weston_output_damage(output);
@@ -4038,6 +4508,8 @@ weston_compositor_init(struct weston_compositor *ec,
 		return -1;
 
 	wl_list_init(&ec->view_list);
+	ec->view_list_dirty = 1;
+	wl_array_init(&ec->layer_stack);
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -4072,8 +4544,14 @@ weston_compositor_init(struct weston_compositor *ec,
 	weston_config_section_get_int(s, "repeat-delay",
 				      &ec->kb_repeat_delay, 400);
 
+	s = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_bool(s, "coalesce-motion",
+				       &ec->coalesce_motion, 0);
+
 	text_backend_init(ec);
 
+	weston_compositor_frame_stats_init(ec);
+
 	wl_data_device_manager_init(ec->wl_display);
 
 	wl_display_init_shm(display);
@@ -4101,6 +4579,8 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 	if (ec->input_loop_source)
 		wl_event_source_remove(ec->input_loop_source);
 
+	weston_compositor_frame_stats_fini(ec);
+
 	/* Destroy all outputs associated with this compositor */
 	wl_list_for_each_safe(output, next, &ec->output_list, link)
 		output->destroy(output);
@@ -4116,6 +4596,9 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 
 	weston_plane_release(&ec->primary_plane);
 
+	pick_grid_release(&ec->pick_grid);
+	wl_array_release(&ec->layer_stack);
+
 	wl_event_loop_destroy(ec->input_loop);
 
 	weston_config_destroy(ec->config);
@@ -4504,6 +4987,17 @@ usage(int error_code)
 		"  --sprawl\t\tCreate one fullscreen output for every parent output\n"
 		"  --display=DISPLAY\tWayland display to connect to\n\n");
 
+	fprintf(stderr,
+		"Options for headless-backend.so:\n\n"
+		"  --width=WIDTH\t\tWidth of memory surface\n"
+		"  --height=HEIGHT\tHeight of memory surface\n"
+		"  --refresh=RATE\tRefresh rate in mHz, defaults to 60000\n"
+		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
+		"  --uncapped\t\tRepaint as fast as possible\n"
+		"  --virtual-clock\tRepaint as fast as possible, advancing the\n"
+		"\t\t\t\tclock by one refresh period per frame\n"
+		"  --benchmark-frames=N\tExit after repainting N frames\n\n");
+
 #if defined(BUILD_RPI_COMPOSITOR) && defined(HAVE_BCM_HOST)
 	fprintf(stderr,
 		"Options for rpi-backend.so:\n\n"
@@ -4525,6 +5019,7 @@ usage(int error_code)
        "  --address=ADDR\tThe address to bind\n"
        "  --port=PORT\tThe port to listen on\n"
        "  --no-clients-resize\tThe RDP peers will be forced to the size of the desktop\n"
+       "  --encoder-threads=N\tNumber of threads encoding updates, one per CPU by default\n"
        "  --rdp4-key=FILE\tThe file containing the key for RDP4 encryption\n"
        "  --rdp-tls-cert=FILE\tThe file containing the certificate for TLS encryption\n"
        "  --rdp-tls-key=FILE\tThe file containing the private key for TLS encryption\n"
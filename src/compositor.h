@@ -44,6 +44,10 @@ extern "C" {
 #define MIN(x,y) (((x) < (y)) ? (x) : (y))
 #endif
 
+#ifndef MAX
+#define MAX(x,y) (((x) > (y)) ? (x) : (y))
+#endif
+
 #define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
 
 #define container_of(ptr, type, member) ({				\
@@ -165,6 +169,20 @@ struct weston_output_zoom {
 	struct wl_listener motion_listener;
 };
 
+/* Stages of the repaint loop timed by the frame statistics */
+enum weston_frame_stage {
+	WESTON_FRAME_STAGE_SCHEDULE,	/* repaint requested to started */
+	WESTON_FRAME_STAGE_VIEW_LIST,
+	WESTON_FRAME_STAGE_ASSIGN_PLANES,
+	WESTON_FRAME_STAGE_DAMAGE,	/* frame callbacks and damage */
+	WESTON_FRAME_STAGE_RENDER,	/* weston_output::repaint */
+	WESTON_FRAME_STAGE_REPAINT,	/* all of the above but scheduling */
+	WESTON_FRAME_STAGE_PRESENT,	/* rendered to presented */
+	WESTON_FRAME_STAGE_COUNT
+};
+
+struct weston_frame_stats;
+
 /* bit compatible with drm definitions. */
 enum dpms_enum {
 	WESTON_DPMS_ON,
@@ -207,6 +225,7 @@ struct weston_output {
 	int disable_planes;
 	int destroying;
 	struct wl_list feedback_list;
+	struct weston_frame_stats *frame_stats;
 
 	char *make, *model, *serial_number;
 	uint32_t subpixel;
@@ -339,6 +358,7 @@ struct weston_pointer {
 	wl_fixed_t x, y;
 	wl_fixed_t sx, sy;
 	uint32_t button_count;
+	int motion_pending;	/* cursor and focus lag behind x, y */
 
 	struct wl_listener output_destroy_listener;
 };
@@ -385,6 +405,8 @@ void
 weston_pointer_move(struct weston_pointer *pointer,
 		    wl_fixed_t x, wl_fixed_t y);
 void
+weston_compositor_flush_motion(struct weston_compositor *compositor);
+void
 weston_pointer_set_default_grab(struct weston_pointer *pointer,
 		const struct weston_pointer_grab_interface *interface);
 
@@ -559,6 +581,20 @@ struct weston_plane {
 	struct wl_list link;
 };
 
+/* Uniform grid over the output layout, used to speed up
+ * weston_compositor_pick_view(). Every cell holds the views whose
+ * masked bounding box touches it, sorted topmost first.
+ */
+struct weston_pick_grid {
+	int dirty;
+	uint32_t generation;
+	uint32_t count;			/* number of indexed views */
+	int32_t x, y;			/* origin in global coordinates */
+	int32_t width, height;		/* in cells */
+	int cell_shift;
+	struct wl_array *cells;		/* struct weston_view * */
+};
+
 struct weston_renderer {
 	int (*read_pixels)(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
@@ -626,6 +662,12 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;
 	struct wl_list view_list;
+	int view_list_dirty;		/* view_list must be rebuilt */
+	struct wl_array layer_stack;	/* layer_list when view_list was built */
+	uint32_t view_list_rebuilds;	/* number of full view_list builds */
+	struct weston_pick_grid pick_grid;
+	uint32_t pick_serial;		/* bumped when picking may change */
+	uint32_t repick_serial;		/* pick_serial at the last repick */
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -667,7 +709,11 @@ struct weston_compositor {
 	int32_t kb_repeat_rate;
 	int32_t kb_repeat_delay;
 
+	int coalesce_motion;
+
 	clockid_t presentation_clock;
+
+	char *frame_stats_file;
 };
 
 struct weston_buffer {
@@ -760,7 +806,10 @@ struct weston_view {
 	struct weston_plane *plane;
 	struct weston_view *parent_view;
 
+	/* Opaque views above on the same plane, within the bounding box.
+	 * A view they hide entirely is culled and not drawn at all. */
 	pixman_region32_t clip;
+	int culled;
 	float alpha;                     /* part of geometry, see below */
 
 	void *renderer_state;
@@ -815,6 +864,15 @@ struct weston_view {
 	 * displayed on.
 	 */
 	uint32_t output_mask;
+
+	/* Pick grid bookkeeping, see struct weston_pick_grid. The view
+	 * is in the grid only if generation matches the grid's.
+	 */
+	struct {
+		uint32_t generation;
+		uint32_t order;		/* position in compositor view_list */
+		int32_t x1, y1, x2, y2;	/* covered cells, end exclusive */
+	} pick;
 };
 
 struct weston_surface_state {
@@ -1371,6 +1429,32 @@ clipboard_create(struct weston_seat *seat);
 int
 text_backend_init(struct weston_compositor *ec);
 
+void
+weston_compositor_frame_stats_init(struct weston_compositor *compositor);
+void
+weston_compositor_frame_stats_fini(struct weston_compositor *compositor);
+void
+weston_compositor_dump_frame_stats(struct weston_compositor *compositor);
+void
+weston_output_frame_stats_init(struct weston_output *output);
+void
+weston_output_frame_stats_destroy(struct weston_output *output);
+void
+weston_output_frame_stats_request(struct weston_output *output);
+void
+weston_output_frame_stats_repaint(struct weston_output *output,
+				  const struct timespec *stamps,
+				  int view_list_rebuilt);
+void
+weston_output_frame_stats_present(struct weston_output *output,
+				  const struct timespec *stamp);
+void
+weston_output_frame_stats_virtual_clock(struct weston_output *output);
+void
+weston_output_frame_stats_views(struct weston_output *output,
+				uint32_t views, uint32_t culled,
+				uint32_t clip_rects);
+
 struct weston_process;
 typedef void (*weston_process_cleanup_func_t)(struct weston_process *process,
 					    int status);
@@ -0,0 +1,337 @@
+/*
+ * Copyright © 2010 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "compositor.h"
+#include "evdev.h"
+#include "worker-pool.h"
+
+/* Devices are read and their events cooked on a thread of their own,
+ * so a busy compositor does not delay reading the kernel queues.  The
+ * resulting events are handed to the main loop through a single
+ * producer, single consumer ring; the input thread only ever writes
+ * head and the main thread only ever writes tail.  Should the main
+ * loop fall behind so much that the ring fills up, events wait in an
+ * overflow array private to the input thread, which keeps them in
+ * order. */
+
+#define EVDEV_RING_SIZE 1024	/* must be a power of two */
+
+struct evdev_input_thread {
+	struct weston_compositor *compositor;
+	struct wl_event_loop *loop;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+
+	int quit_fd;
+	int wakeup_fd;
+	struct wl_event_source *wakeup_source;
+	int wakeup_pending;
+
+	/* Errors on the input thread, logged from the main loop */
+	uint32_t dropped;
+	int wakeup_errno;
+
+	struct evdev_notify ring[EVDEV_RING_SIZE];
+	uint32_t head;
+	uint32_t tail;
+
+	/* Only touched with the mutex held */
+	struct wl_array overflow;
+	int produced;
+};
+
+static int
+ring_put(struct evdev_input_thread *thread, const struct evdev_notify *notify)
+{
+	uint32_t head = thread->head;
+	uint32_t tail = __atomic_load_n(&thread->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail >= EVDEV_RING_SIZE)
+		return -1;
+
+	thread->ring[head & (EVDEV_RING_SIZE - 1)] = *notify;
+	__atomic_store_n(&thread->head, head + 1, __ATOMIC_RELEASE);
+	thread->produced = 1;
+
+	return 0;
+}
+
+static void
+flush_overflow(struct evdev_input_thread *thread)
+{
+	struct evdev_notify *notify = thread->overflow.data;
+	size_t count, i;
+
+	count = thread->overflow.size / sizeof *notify;
+	for (i = 0; i < count; i++)
+		if (ring_put(thread, &notify[i]) < 0)
+			break;
+
+	if (i == 0)
+		return;
+
+	memmove(notify, notify + i, (count - i) * sizeof *notify);
+	thread->overflow.size = (count - i) * sizeof *notify;
+}
+
+/* Called on the input thread, from the device handlers */
+void
+evdev_input_thread_push(struct evdev_input_thread *thread,
+			const struct evdev_notify *notify)
+{
+	struct evdev_notify *p;
+
+	if (thread->overflow.size == 0 && ring_put(thread, notify) == 0)
+		return;
+
+	p = wl_array_add(&thread->overflow, sizeof *p);
+	if (p)
+		*p = *notify;
+	else
+		__atomic_add_fetch(&thread->dropped, 1, __ATOMIC_RELAXED);
+}
+
+static void
+wakeup_main_loop(struct evdev_input_thread *thread)
+{
+	uint64_t one = 1;
+
+	if (__atomic_exchange_n(&thread->wakeup_pending, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	if (write(thread->wakeup_fd, &one, sizeof one) < 0) {
+		/* Try again with the next event */
+		__atomic_store_n(&thread->wakeup_errno, errno,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->wakeup_pending, 0,
+				 __ATOMIC_SEQ_CST);
+	}
+}
+
+static void *
+input_thread(void *data)
+{
+	struct evdev_input_thread *thread = data;
+	struct pollfd pfd[2];
+
+	pfd[0].fd = wl_event_loop_get_fd(thread->loop);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = thread->quit_fd;
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		/* Retry soon if the ring was full */
+		if (poll(pfd, 2, thread->overflow.size ? 1 : -1) < 0 &&
+		    errno != EINTR)
+			break;
+
+		if (pfd[1].revents)
+			break;
+
+		pthread_mutex_lock(&thread->mutex);
+		wl_event_loop_dispatch(thread->loop, 0);
+		flush_overflow(thread);
+		pthread_mutex_unlock(&thread->mutex);
+
+		if (thread->produced) {
+			thread->produced = 0;
+			wakeup_main_loop(thread);
+		}
+	}
+
+	return NULL;
+}
+
+static int
+wakeup_handler(int fd, uint32_t mask, void *data)
+{
+	struct evdev_input_thread *thread = data;
+	struct evdev_notify notify;
+	uint32_t head, tail, dropped;
+	uint64_t count;
+	int err;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		weston_log("input thread: failed to read wakeup: %m\n");
+
+	err = __atomic_exchange_n(&thread->wakeup_errno, 0, __ATOMIC_RELAXED);
+	if (err)
+		weston_log("input thread: failed to wake up main loop: %s\n",
+			   strerror(err));
+
+	dropped = __atomic_exchange_n(&thread->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		weston_log("input thread: dropped %u events, out of memory\n",
+			   dropped);
+
+	/* Clear the flag before draining, so events pushed from now on
+	 * wake us up again; this must not be reordered with reading
+	 * head, hence sequential consistency. */
+	__atomic_store_n(&thread->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+
+	tail = thread->tail;
+	head = __atomic_load_n(&thread->head, __ATOMIC_SEQ_CST);
+	while (tail != head) {
+		/* Hand the slot back before delivering, delivery may
+		 * take a while */
+		notify = thread->ring[tail & (EVDEV_RING_SIZE - 1)];
+		__atomic_store_n(&thread->tail, ++tail, __ATOMIC_RELEASE);
+
+		if (notify.device)
+			evdev_deliver(&notify);
+
+		if (tail == head)
+			head = __atomic_load_n(&thread->head,
+					       __ATOMIC_ACQUIRE);
+	}
+
+	return 1;
+}
+
+struct evdev_input_thread *
+evdev_input_thread_create(struct weston_compositor *compositor)
+{
+	struct evdev_input_thread *thread;
+	struct wl_event_loop *loop;
+	int ret;
+
+	thread = zalloc(sizeof *thread);
+	if (thread == NULL)
+		return NULL;
+
+	thread->compositor = compositor;
+	wl_array_init(&thread->overflow);
+	pthread_mutex_init(&thread->mutex, NULL);
+
+	thread->loop = wl_event_loop_create();
+	if (thread->loop == NULL)
+		goto err_free;
+
+	thread->quit_fd = eventfd(0, EFD_CLOEXEC);
+	if (thread->quit_fd < 0)
+		goto err_loop;
+
+	thread->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (thread->wakeup_fd < 0)
+		goto err_quit;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	thread->wakeup_source =
+		wl_event_loop_add_fd(loop, thread->wakeup_fd,
+				     WL_EVENT_READABLE,
+				     wakeup_handler, thread);
+	if (thread->wakeup_source == NULL)
+		goto err_wakeup;
+
+	ret = worker_thread_create(&thread->thread, input_thread, thread);
+	if (ret != 0)
+		goto err_source;
+
+	return thread;
+
+err_source:
+	wl_event_source_remove(thread->wakeup_source);
+err_wakeup:
+	close(thread->wakeup_fd);
+err_quit:
+	close(thread->quit_fd);
+err_loop:
+	wl_event_loop_destroy(thread->loop);
+err_free:
+	pthread_mutex_destroy(&thread->mutex);
+	free(thread);
+	return NULL;
+}
+
+/* All devices must have been destroyed before */
+void
+evdev_input_thread_destroy(struct evdev_input_thread *thread)
+{
+	uint64_t one = 1;
+
+	if (thread == NULL)
+		return;
+
+	if (write(thread->quit_fd, &one, sizeof one) < 0)
+		weston_log("input thread: failed to stop: %m\n");
+	pthread_join(thread->thread, NULL);
+
+	wl_event_source_remove(thread->wakeup_source);
+	close(thread->wakeup_fd);
+	close(thread->quit_fd);
+	wl_event_loop_destroy(thread->loop);
+	wl_array_release(&thread->overflow);
+	pthread_mutex_destroy(&thread->mutex);
+	free(thread);
+}
+
+struct wl_event_loop *
+evdev_input_thread_get_loop(struct evdev_input_thread *thread)
+{
+	return thread->loop;
+}
+
+/* Keeps the input thread from dispatching, so sources can be added to
+ * or removed from its loop */
+void
+evdev_input_thread_lock(struct evdev_input_thread *thread)
+{
+	pthread_mutex_lock(&thread->mutex);
+}
+
+void
+evdev_input_thread_unlock(struct evdev_input_thread *thread)
+{
+	pthread_mutex_unlock(&thread->mutex);
+}
+
+/* Drops the queued events of a device that is going away; called with
+ * the thread locked. */
+void
+evdev_input_thread_forget_device(struct evdev_input_thread *thread,
+				 struct evdev_device *device)
+{
+	struct evdev_notify *notify;
+	uint32_t i, head;
+
+	head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+	for (i = thread->tail; i != head; i++) {
+		notify = &thread->ring[i & (EVDEV_RING_SIZE - 1)];
+		if (notify->device == device)
+			notify->device = NULL;
+	}
+
+	wl_array_for_each(notify, &thread->overflow)
+		if (notify->device == device)
+			notify->device = NULL;
+}
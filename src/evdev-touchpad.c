@@ -279,17 +279,17 @@ filter_motion(struct touchpad_dispatch *touchpad,
 static void
 notify_button_pressed(struct touchpad_dispatch *touchpad, uint32_t time)
 {
-	notify_button(touchpad->device->seat, time,
-		      DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON,
-		      WL_POINTER_BUTTON_STATE_PRESSED);
+	evdev_notify_button(touchpad->device, time,
+			    DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON,
+			    WL_POINTER_BUTTON_STATE_PRESSED);
 }
 
 static void
 notify_button_released(struct touchpad_dispatch *touchpad, uint32_t time)
 {
-	notify_button(touchpad->device->seat, time,
-		      DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON,
-		      WL_POINTER_BUTTON_STATE_RELEASED);
+	evdev_notify_button(touchpad->device, time,
+			    DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON,
+			    WL_POINTER_BUTTON_STATE_RELEASED);
 }
 
 static void
@@ -490,20 +490,20 @@ touchpad_update_state(struct touchpad_dispatch *touchpad, uint32_t time)
 		filter_motion(touchpad, &dx, &dy, time);
 
 		if (touchpad->finger_state == TOUCHPAD_FINGERS_ONE) {
-			notify_motion(touchpad->device->seat, time,
-				      wl_fixed_from_double(dx),
-				      wl_fixed_from_double(dy));
+			evdev_notify_motion(touchpad->device, time,
+					    wl_fixed_from_double(dx),
+					    wl_fixed_from_double(dy));
 		} else if (touchpad->finger_state == TOUCHPAD_FINGERS_TWO) {
 			if (dx != 0.0)
-				notify_axis(touchpad->device->seat,
-					    time,
-					    WL_POINTER_AXIS_HORIZONTAL_SCROLL,
-					    wl_fixed_from_double(dx));
+				evdev_notify_axis(touchpad->device,
+						  time,
+						  WL_POINTER_AXIS_HORIZONTAL_SCROLL,
+						  wl_fixed_from_double(dx));
 			if (dy != 0.0)
-				notify_axis(touchpad->device->seat,
-					    time,
-					    WL_POINTER_AXIS_VERTICAL_SCROLL,
-					    wl_fixed_from_double(dy));
+				evdev_notify_axis(touchpad->device,
+						  time,
+						  WL_POINTER_AXIS_VERTICAL_SCROLL,
+						  wl_fixed_from_double(dy));
 		}
 	}
 
@@ -596,9 +596,9 @@ process_key(struct touchpad_dispatch *touchpad,
 			code = BTN_RIGHT;
 		else
 			code = e->code;
-		notify_button(device->seat, time, code,
-			      e->value ? WL_POINTER_BUTTON_STATE_PRESSED :
-			                 WL_POINTER_BUTTON_STATE_RELEASED);
+		evdev_notify_button(device, time, code,
+				    e->value ? WL_POINTER_BUTTON_STATE_PRESSED :
+					       WL_POINTER_BUTTON_STATE_RELEASED);
 		break;
 	case BTN_TOOL_PEN:
 	case BTN_TOOL_RUBBER:
@@ -768,7 +768,15 @@ touchpad_init(struct touchpad_dispatch *touchpad,
 	wl_array_init(&touchpad->fsm.events);
 	touchpad->fsm.state = FSM_IDLE;
 
-	loop = wl_display_get_event_loop(device->seat->compositor->wl_display);
+	/* The timer must fire on the loop the input thread reads the
+	 * device from.  Without the thread, keep it on the display loop:
+	 * the input loop is not dispatched while repainting, which would
+	 * hold up taps. */
+	if (device->thread)
+		loop = device->loop;
+	else
+		loop = wl_display_get_event_loop(
+				device->seat->compositor->wl_display);
 	touchpad->fsm.timer_source =
 		wl_event_loop_add_timer(loop, fsm_timout_handler, touchpad);
 	if (touchpad->fsm.timer_source == NULL) {
@@ -66,48 +66,139 @@ evdev_led_update(struct evdev_device *device, enum weston_led leds)
 	(void)i; /* no, we really don't care about the return value */
 }
 
+/* Events either go straight to the compositor or, when the device is
+ * read on the input thread, through its queue to evdev_deliver(). */
 static void
-transform_absolute(struct evdev_device *device, int32_t *x, int32_t *y)
+evdev_notify(struct evdev_device *device, struct evdev_notify *notify)
 {
-       if (!device->abs.apply_calibration) {
-               *x = device->abs.x;
-               *y = device->abs.y;
-               return;
-       } else {
-               *x = device->abs.x * device->abs.calibration[0] +
-                       device->abs.y * device->abs.calibration[1] +
-                       device->abs.calibration[2];
-
-               *y = device->abs.x * device->abs.calibration[3] +
-                       device->abs.y * device->abs.calibration[4] +
-                       device->abs.calibration[5];
-       }
+	if (device->thread)
+		evdev_input_thread_push(device->thread, notify);
+	else
+		evdev_deliver(notify);
+}
+
+void
+evdev_notify_motion(struct evdev_device *device, uint32_t time,
+		    wl_fixed_t dx, wl_fixed_t dy)
+{
+	struct evdev_notify notify;
+
+	notify.type = EVDEV_NOTIFY_MOTION;
+	notify.device = device;
+	notify.time = time;
+	notify.u.motion.dx = dx;
+	notify.u.motion.dy = dy;
+	evdev_notify(device, &notify);
+}
+
+void
+evdev_notify_button(struct evdev_device *device, uint32_t time,
+		    int32_t button, enum wl_pointer_button_state state)
+{
+	struct evdev_notify notify;
+
+	notify.type = EVDEV_NOTIFY_BUTTON;
+	notify.device = device;
+	notify.time = time;
+	notify.u.button.button = button;
+	notify.u.button.state = state;
+	evdev_notify(device, &notify);
+}
+
+void
+evdev_notify_axis(struct evdev_device *device, uint32_t time,
+		  uint32_t axis, wl_fixed_t value)
+{
+	struct evdev_notify notify;
+
+	notify.type = EVDEV_NOTIFY_AXIS;
+	notify.device = device;
+	notify.time = time;
+	notify.u.axis.axis = axis;
+	notify.u.axis.value = value;
+	evdev_notify(device, &notify);
 }
 
 static void
-evdev_flush_pending_event(struct evdev_device *device, uint32_t time)
+evdev_notify_key(struct evdev_device *device, uint32_t time,
+		 uint32_t key, enum wl_keyboard_key_state state)
+{
+	struct evdev_notify notify;
+
+	notify.type = EVDEV_NOTIFY_KEY;
+	notify.device = device;
+	notify.time = time;
+	notify.u.key.key = key;
+	notify.u.key.state = state;
+	evdev_notify(device, &notify);
+}
+
+static void
+evdev_notify_absolute(struct evdev_device *device, uint32_t time,
+		      enum evdev_event_type event, int slot,
+		      int32_t x, int32_t y)
+{
+	struct evdev_notify notify;
+
+	notify.type = EVDEV_NOTIFY_ABSOLUTE;
+	notify.device = device;
+	notify.time = time;
+	notify.u.absolute.event = event;
+	notify.u.absolute.slot = slot;
+	notify.u.absolute.x = x;
+	notify.u.absolute.y = y;
+	evdev_notify(device, &notify);
+}
+
+/* Maps a position in device units to the output of the device.  The
+ * calibration matrix only applies to single touch and absolute pointer
+ * events, multitouch slots are not calibrated. */
+static void
+transform_absolute(struct evdev_device *device, int32_t x, int32_t y,
+		   int calibrate, wl_fixed_t *fx, wl_fixed_t *fy)
+{
+	int32_t cx, cy;
+
+	x = x * device->output->current_mode->width /
+		(device->abs.max_x - device->abs.min_x);
+	y = y * device->output->current_mode->height /
+		(device->abs.max_y - device->abs.min_y);
+
+	if (!calibrate || !device->abs.apply_calibration) {
+		cx = x;
+		cy = y;
+	} else {
+		cx = x * device->abs.calibration[0] +
+			y * device->abs.calibration[1] +
+			device->abs.calibration[2];
+
+		cy = x * device->abs.calibration[3] +
+			y * device->abs.calibration[4] +
+			device->abs.calibration[5];
+	}
+
+	weston_output_transform_coordinate(device->output,
+					   wl_fixed_from_int(cx),
+					   wl_fixed_from_int(cy),
+					   fx, fy);
+}
+
+/* The part of an absolute event that depends on compositor state:
+ * outputs and the touch points of the seat */
+static void
+evdev_deliver_absolute(struct evdev_device *device, uint32_t time,
+		       enum evdev_event_type event, int slot,
+		       int32_t ax, int32_t ay)
 {
 	struct weston_seat *master = device->seat;
 	wl_fixed_t x, y;
-	int32_t cx, cy;
-	int slot, seat_slot;
+	int seat_slot;
 
-	slot = device->mt.slot;
-	switch (device->pending_event) {
-	case EVDEV_NONE:
-		return;
-	case EVDEV_RELATIVE_MOTION:
-		notify_motion(master, time, device->rel.dx, device->rel.dy);
-		device->rel.dx = 0;
-		device->rel.dy = 0;
-		break;
+	switch (event) {
 	case EVDEV_ABSOLUTE_MT_DOWN:
 		if (device->output == NULL)
 			break;
-		weston_output_transform_coordinate(device->output,
-						   wl_fixed_from_int(device->mt.slots[slot].x),
-						   wl_fixed_from_int(device->mt.slots[slot].y),
-						   &x, &y);
+		transform_absolute(device, ax, ay, 0, &x, &y);
 		seat_slot = ffs(~master->slot_map) - 1;
 		device->mt.slots[slot].seat_slot = seat_slot;
 		master->slot_map |= 1 << seat_slot;
@@ -115,28 +206,25 @@ evdev_flush_pending_event(struct evdev_device *device, uint32_t time)
 		notify_touch(master, time, seat_slot, x, y, WL_TOUCH_DOWN);
 		break;
 	case EVDEV_ABSOLUTE_MT_MOTION:
-		if (device->output == NULL)
-			break;
-		weston_output_transform_coordinate(device->output,
-						   wl_fixed_from_int(device->mt.slots[slot].x),
-						   wl_fixed_from_int(device->mt.slots[slot].y),
-						   &x, &y);
 		seat_slot = device->mt.slots[slot].seat_slot;
+		if (device->output == NULL || seat_slot < 0)
+			break;
+		transform_absolute(device, ax, ay, 0, &x, &y);
 		notify_touch(master, time, seat_slot, x, y, WL_TOUCH_MOTION);
 		break;
 	case EVDEV_ABSOLUTE_MT_UP:
+		/* The down may have been dropped for want of an output */
 		seat_slot = device->mt.slots[slot].seat_slot;
+		if (seat_slot < 0)
+			break;
+		device->mt.slots[slot].seat_slot = -1;
 		master->slot_map &= ~(1 << seat_slot);
 		notify_touch(master, time, seat_slot, 0, 0, WL_TOUCH_UP);
 		break;
 	case EVDEV_ABSOLUTE_TOUCH_DOWN:
 		if (device->output == NULL)
 			break;
-		transform_absolute(device, &cx, &cy);
-		weston_output_transform_coordinate(device->output,
-						   wl_fixed_from_int(cx),
-						   wl_fixed_from_int(cy),
-						   &x, &y);
+		transform_absolute(device, ax, ay, 1, &x, &y);
 		seat_slot = ffs(~master->slot_map) - 1;
 		device->abs.seat_slot = seat_slot;
 		master->slot_map |= 1 << seat_slot;
@@ -145,26 +233,92 @@ evdev_flush_pending_event(struct evdev_device *device, uint32_t time)
 	case EVDEV_ABSOLUTE_MOTION:
 		if (device->output == NULL)
 			break;
-		transform_absolute(device, &cx, &cy);
-		weston_output_transform_coordinate(device->output,
-						   wl_fixed_from_int(cx),
-						   wl_fixed_from_int(cy),
-						   &x, &y);
-
-		if (device->seat_caps & EVDEV_SEAT_TOUCH)
-			notify_touch(master, time, device->abs.seat_slot,
-				     x, y, WL_TOUCH_MOTION);
-		else if (device->seat_caps & EVDEV_SEAT_POINTER)
+		transform_absolute(device, ax, ay, 1, &x, &y);
+
+		if (device->seat_caps & EVDEV_SEAT_TOUCH) {
+			if (device->abs.seat_slot >= 0)
+				notify_touch(master, time,
+					     device->abs.seat_slot,
+					     x, y, WL_TOUCH_MOTION);
+		} else if (device->seat_caps & EVDEV_SEAT_POINTER)
 			notify_motion_absolute(master, time, x, y);
 		break;
 	case EVDEV_ABSOLUTE_TOUCH_UP:
 		seat_slot = device->abs.seat_slot;
+		if (seat_slot < 0)
+			break;
+		device->abs.seat_slot = -1;
 		master->slot_map &= ~(1 << seat_slot);
 		notify_touch(master, time, seat_slot, 0, 0, WL_TOUCH_UP);
 		break;
 	default:
 		assert(0 && "Unknown pending event type");
 	}
+}
+
+void
+evdev_deliver(struct evdev_notify *notify)
+{
+	struct evdev_device *device = notify->device;
+
+	if (!device->seat->compositor->session_active)
+		return;
+
+	switch (notify->type) {
+	case EVDEV_NOTIFY_MOTION:
+		notify_motion(device->seat, notify->time,
+			      notify->u.motion.dx, notify->u.motion.dy);
+		break;
+	case EVDEV_NOTIFY_BUTTON:
+		notify_button(device->seat, notify->time,
+			      notify->u.button.button,
+			      notify->u.button.state);
+		break;
+	case EVDEV_NOTIFY_AXIS:
+		notify_axis(device->seat, notify->time,
+			    notify->u.axis.axis, notify->u.axis.value);
+		break;
+	case EVDEV_NOTIFY_KEY:
+		notify_key(device->seat, notify->time,
+			   notify->u.key.key, notify->u.key.state,
+			   STATE_UPDATE_AUTOMATIC);
+		break;
+	case EVDEV_NOTIFY_ABSOLUTE:
+		evdev_deliver_absolute(device, notify->time,
+				       notify->u.absolute.event,
+				       notify->u.absolute.slot,
+				       notify->u.absolute.x,
+				       notify->u.absolute.y);
+		break;
+	}
+}
+
+static void
+evdev_flush_pending_event(struct evdev_device *device, uint32_t time)
+{
+	int slot = device->mt.slot;
+
+	switch (device->pending_event) {
+	case EVDEV_NONE:
+		return;
+	case EVDEV_RELATIVE_MOTION:
+		evdev_notify_motion(device, time,
+				    device->rel.dx, device->rel.dy);
+		device->rel.dx = 0;
+		device->rel.dy = 0;
+		break;
+	case EVDEV_ABSOLUTE_MT_DOWN:
+	case EVDEV_ABSOLUTE_MT_MOTION:
+	case EVDEV_ABSOLUTE_MT_UP:
+		evdev_notify_absolute(device, time, device->pending_event, slot,
+				      device->mt.slots[slot].x,
+				      device->mt.slots[slot].y);
+		break;
+	default:
+		evdev_notify_absolute(device, time, device->pending_event, slot,
+				      device->abs.x, device->abs.y);
+		break;
+	}
 
 	device->pending_event = EVDEV_NONE;
 }
@@ -205,35 +359,28 @@ evdev_process_key(struct evdev_device *device, struct input_event *e, int time)
 	case BTN_FORWARD:
 	case BTN_BACK:
 	case BTN_TASK:
-		notify_button(device->seat,
-			      time, e->code,
-			      e->value ? WL_POINTER_BUTTON_STATE_PRESSED :
-					 WL_POINTER_BUTTON_STATE_RELEASED);
+		evdev_notify_button(device,
+				    time, e->code,
+				    e->value ? WL_POINTER_BUTTON_STATE_PRESSED :
+					       WL_POINTER_BUTTON_STATE_RELEASED);
 		break;
 
 	default:
-		notify_key(device->seat,
-			   time, e->code,
-			   e->value ? WL_KEYBOARD_KEY_STATE_PRESSED :
-				      WL_KEYBOARD_KEY_STATE_RELEASED,
-			   STATE_UPDATE_AUTOMATIC);
+		evdev_notify_key(device,
+				 time, e->code,
+				 e->value ? WL_KEYBOARD_KEY_STATE_PRESSED :
+					    WL_KEYBOARD_KEY_STATE_RELEASED);
 		break;
 	}
 }
 
+/* Positions are kept in device units here, mapping them to an output
+ * is left to evdev_deliver_absolute() */
 static void
 evdev_process_touch(struct evdev_device *device,
 		    struct input_event *e,
 		    uint32_t time)
 {
-	int screen_width, screen_height;
-
-	if (device->output == NULL)
-		return;
-
-	screen_width = device->output->current_mode->width;
-	screen_height = device->output->current_mode->height;
-
 	switch (e->code) {
 	case ABS_MT_SLOT:
 		evdev_flush_pending_event(device, time);
@@ -250,15 +397,13 @@ evdev_process_touch(struct evdev_device *device,
 		break;
 	case ABS_MT_POSITION_X:
 		device->mt.slots[device->mt.slot].x =
-			(e->value - device->abs.min_x) * screen_width /
-			(device->abs.max_x - device->abs.min_x);
+			e->value - device->abs.min_x;
 		if (device->pending_event == EVDEV_NONE)
 			device->pending_event = EVDEV_ABSOLUTE_MT_MOTION;
 		break;
 	case ABS_MT_POSITION_Y:
 		device->mt.slots[device->mt.slot].y =
-			(e->value - device->abs.min_y) * screen_height /
-			(device->abs.max_y - device->abs.min_y);
+			e->value - device->abs.min_y;
 		if (device->pending_event == EVDEV_NONE)
 			device->pending_event = EVDEV_ABSOLUTE_MT_MOTION;
 		break;
@@ -269,26 +414,14 @@ static inline void
 evdev_process_absolute_motion(struct evdev_device *device,
 			      struct input_event *e)
 {
-	int screen_width, screen_height;
-
-	if (device->output == NULL)
-		return;
-
-	screen_width = device->output->current_mode->width;
-	screen_height = device->output->current_mode->height;
-
 	switch (e->code) {
 	case ABS_X:
-		device->abs.x =
-			(e->value - device->abs.min_x) * screen_width /
-			(device->abs.max_x - device->abs.min_x);
+		device->abs.x = e->value - device->abs.min_x;
 		if (device->pending_event == EVDEV_NONE)
 			device->pending_event = EVDEV_ABSOLUTE_MOTION;
 		break;
 	case ABS_Y:
-		device->abs.y =
-			(e->value - device->abs.min_y) * screen_height /
-			(device->abs.max_y - device->abs.min_y);
+		device->abs.y = e->value - device->abs.min_y;
 		if (device->pending_event == EVDEV_NONE)
 			device->pending_event = EVDEV_ABSOLUTE_MOTION;
 		break;
@@ -319,10 +452,10 @@ evdev_process_relative(struct evdev_device *device,
 			/* Scroll down */
 		case 1:
 			/* Scroll up */
-			notify_axis(device->seat,
-				    time,
-				    WL_POINTER_AXIS_VERTICAL_SCROLL,
-				    -1 * e->value * DEFAULT_AXIS_STEP_DISTANCE);
+			evdev_notify_axis(device,
+					  time,
+					  WL_POINTER_AXIS_VERTICAL_SCROLL,
+					  -1 * e->value * DEFAULT_AXIS_STEP_DISTANCE);
 			break;
 		default:
 			break;
@@ -335,10 +468,10 @@ evdev_process_relative(struct evdev_device *device,
 			/* Scroll left */
 		case 1:
 			/* Scroll right */
-			notify_axis(device->seat,
-				    time,
-				    WL_POINTER_AXIS_HORIZONTAL_SCROLL,
-				    e->value * DEFAULT_AXIS_STEP_DISTANCE);
+			evdev_notify_axis(device,
+					  time,
+					  WL_POINTER_AXIS_HORIZONTAL_SCROLL,
+					  e->value * DEFAULT_AXIS_STEP_DISTANCE);
 			break;
 		default:
 			break;
@@ -429,8 +562,10 @@ evdev_device_data(int fd, uint32_t mask, void *data)
 	struct input_event ev[32];
 	int len;
 
+	/* The input thread must not look at compositor state; without
+	 * a session its events are dropped on delivery instead. */
 	ec = device->seat->compositor;
-	if (!ec->session_active)
+	if (!device->thread && !ec->session_active)
 		return 1;
 
 	/* If the compositor is repainting, this function is called only once
@@ -626,11 +761,13 @@ evdev_device_set_output(struct evdev_device *device,
 }
 
 struct evdev_device *
-evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
+evdev_device_create(struct weston_seat *seat, const char *path, int device_fd,
+		    struct evdev_input_thread *thread)
 {
 	struct evdev_device *device;
 	struct weston_compositor *ec;
 	char devname[256] = "unknown";
+	int ret, i;
 
 	device = zalloc(sizeof *device);
 	if (device == NULL)
@@ -638,11 +775,17 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 
 	ec = seat->compositor;
 	device->seat = seat;
+	device->thread = thread;
+	device->loop = thread ? evdev_input_thread_get_loop(thread) :
+		ec->input_loop;
 	device->seat_caps = 0;
 	device->is_mt = 0;
 	device->mtdev = NULL;
 	device->devnode = strdup(path);
 	device->mt.slot = -1;
+	for (i = 0; i < MAX_SLOTS; i++)
+		device->mt.slots[i].seat_slot = -1;
+	device->abs.seat_slot = -1;
 	device->rel.dx = 0;
 	device->rel.dy = 0;
 	device->dispatch = NULL;
@@ -654,7 +797,27 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 	devname[sizeof(devname) - 1] = '\0';
 	device->devname = strdup(devname);
 
-	if (evdev_configure_device(device) == -1)
+	/* The input thread must not dispatch its loop while we add
+	 * sources to it */
+	if (thread)
+		evdev_input_thread_lock(thread);
+
+	ret = evdev_configure_device(device);
+
+	/* If the dispatch was not set up use the fallback. */
+	if (ret == 0 && device->seat_caps != 0 && device->dispatch == NULL)
+		device->dispatch = fallback_dispatch_create();
+
+	if (ret == 0 && device->seat_caps != 0 && device->dispatch != NULL)
+		device->source = wl_event_loop_add_fd(device->loop, device->fd,
+						      WL_EVENT_READABLE,
+						      evdev_device_data,
+						      device);
+
+	if (thread)
+		evdev_input_thread_unlock(thread);
+
+	if (ret == -1)
 		goto err;
 
 	if (device->seat_caps == 0) {
@@ -662,15 +825,6 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 		return EVDEV_UNHANDLED_DEVICE;
 	}
 
-	/* If the dispatch was not set up use the fallback. */
-	if (device->dispatch == NULL)
-		device->dispatch = fallback_dispatch_create();
-	if (device->dispatch == NULL)
-		goto err;
-
-	device->source = wl_event_loop_add_fd(ec->input_loop, device->fd,
-					      WL_EVENT_READABLE,
-					      evdev_device_data, device);
 	if (device->source == NULL)
 		goto err;
 
@@ -693,12 +847,20 @@ evdev_device_destroy(struct evdev_device *device)
 	if (device->seat_caps & EVDEV_SEAT_TOUCH)
 		weston_seat_release_touch(device->seat);
 
+	if (device->thread) {
+		evdev_input_thread_lock(device->thread);
+		evdev_input_thread_forget_device(device->thread, device);
+	}
+
 	dispatch = device->dispatch;
 	if (dispatch)
 		dispatch->interface->destroy(dispatch);
 
 	if (device->source)
 		wl_event_source_remove(device->source);
+
+	if (device->thread)
+		evdev_input_thread_unlock(device->thread);
 	if (device->output)
 		wl_list_remove(&device->output_destroy_listener.link);
 	wl_list_remove(&device->link);
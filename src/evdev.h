@@ -47,9 +47,13 @@ enum evdev_device_seat_capability {
 	EVDEV_SEAT_TOUCH = (1 << 2)
 };
 
+struct evdev_input_thread;
+
 struct evdev_device {
 	struct weston_seat *seat;
 	struct wl_list link;
+	struct evdev_input_thread *thread;
+	struct wl_event_loop *loop;
 	struct wl_event_source *source;
 	struct weston_output *output;
 	struct evdev_dispatch *dispatch;
@@ -60,7 +64,7 @@ struct evdev_device {
 	int fd;
 	struct {
 		int min_x, max_x, min_y, max_y;
-		uint32_t seat_slot;
+		int32_t seat_slot;	/* -1 if no touch down was sent */
 		int32_t x, y;
 
 		int apply_calibration;
@@ -71,7 +75,7 @@ struct evdev_device {
 		int slot;
 		struct {
 			int32_t x, y;
-			uint32_t seat_slot;
+			int32_t seat_slot;
 		} slots[MAX_SLOTS];
 	} mt;
 	struct mtdev *mtdev;
@@ -115,6 +119,45 @@ struct evdev_dispatch {
 	struct evdev_dispatch_interface *interface;
 };
 
+enum evdev_notify_type {
+	EVDEV_NOTIFY_MOTION,
+	EVDEV_NOTIFY_BUTTON,
+	EVDEV_NOTIFY_AXIS,
+	EVDEV_NOTIFY_KEY,
+	EVDEV_NOTIFY_ABSOLUTE,
+};
+
+/* An event for the compositor. Absolute positions are in device units,
+ * relative to the minimum of the axis; they are mapped to the output
+ * on delivery. */
+struct evdev_notify {
+	enum evdev_notify_type type;
+	struct evdev_device *device;
+	uint32_t time;
+	union {
+		struct {
+			wl_fixed_t dx, dy;
+		} motion;
+		struct {
+			uint32_t button;
+			enum wl_pointer_button_state state;
+		} button;
+		struct {
+			uint32_t axis;
+			wl_fixed_t value;
+		} axis;
+		struct {
+			uint32_t key;
+			enum wl_keyboard_key_state state;
+		} key;
+		struct {
+			enum evdev_event_type event;
+			int slot;
+			int32_t x, y;
+		} absolute;
+	} u;
+};
+
 struct evdev_dispatch *
 evdev_touchpad_create(struct evdev_device *device);
 
@@ -122,7 +165,8 @@ void
 evdev_led_update(struct evdev_device *device, enum weston_led leds);
 
 struct evdev_device *
-evdev_device_create(struct weston_seat *seat, const char *path, int device_fd);
+evdev_device_create(struct weston_seat *seat, const char *path, int device_fd,
+		    struct evdev_input_thread *thread);
 
 void
 evdev_device_set_output(struct evdev_device *device,
@@ -134,4 +178,42 @@ void
 evdev_notify_keyboard_focus(struct weston_seat *seat,
 			    struct wl_list *evdev_devices);
 
+void
+evdev_notify_motion(struct evdev_device *device, uint32_t time,
+		    wl_fixed_t dx, wl_fixed_t dy);
+
+void
+evdev_notify_button(struct evdev_device *device, uint32_t time,
+		    int32_t button, enum wl_pointer_button_state state);
+
+void
+evdev_notify_axis(struct evdev_device *device, uint32_t time,
+		  uint32_t axis, wl_fixed_t value);
+
+void
+evdev_deliver(struct evdev_notify *notify);
+
+struct evdev_input_thread *
+evdev_input_thread_create(struct weston_compositor *compositor);
+
+void
+evdev_input_thread_destroy(struct evdev_input_thread *thread);
+
+struct wl_event_loop *
+evdev_input_thread_get_loop(struct evdev_input_thread *thread);
+
+void
+evdev_input_thread_lock(struct evdev_input_thread *thread);
+
+void
+evdev_input_thread_unlock(struct evdev_input_thread *thread);
+
+void
+evdev_input_thread_push(struct evdev_input_thread *thread,
+			const struct evdev_notify *notify);
+
+void
+evdev_input_thread_forget_device(struct evdev_input_thread *thread,
+				 struct evdev_device *device);
+
 #endif /* EVDEV_H */
@@ -0,0 +1,452 @@
+/*
+ * Copyright © 2012-2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <linux/input.h>
+
+#include "compositor.h"
+#include "os-compatibility.h"
+
+/* Durations are kept in microseconds. Below 16 us every value has its
+ * own bucket, above that each power of two is split in 8 buckets, so
+ * percentiles are accurate to 12.5%. */
+#define LINEAR_BUCKETS 16
+#define SUB_BUCKETS 8
+#define HISTOGRAM_BUCKETS (LINEAR_BUCKETS + (32 - 4) * SUB_BUCKETS)
+
+struct frame_stage_stats {
+	uint32_t count;
+	uint32_t min, max;
+	uint64_t total;
+	uint32_t histogram[HISTOGRAM_BUCKETS];
+};
+
+struct weston_frame_stats {
+	struct timespec begin;		/* when collection (re)started */
+	struct timespec request;	/* first repaint request, or zero */
+	struct timespec frame_start;	/* request or previous presentation */
+	struct timespec render_done;
+	struct timespec last_present;
+	int in_flight;
+	int virtual_clock;		/* presentation stamps are not real */
+
+	uint32_t frames;
+	uint32_t late_frames;
+	uint32_t missed_vblanks;
+	uint32_t view_list_rebuilds;	/* repaints that rebuilt view_list */
+	struct frame_stage_stats stage[WESTON_FRAME_STAGE_COUNT];
+
+	/* Occlusion culling, summed over repaints */
+	uint32_t repaints;
+	uint64_t views, culled_views, clip_rects;
+};
+
+static const char * const stage_names[] = {
+	[WESTON_FRAME_STAGE_SCHEDULE] = "schedule",
+	[WESTON_FRAME_STAGE_VIEW_LIST] = "view-list",
+	[WESTON_FRAME_STAGE_ASSIGN_PLANES] = "assign-planes",
+	[WESTON_FRAME_STAGE_DAMAGE] = "damage",
+	[WESTON_FRAME_STAGE_RENDER] = "render",
+	[WESTON_FRAME_STAGE_REPAINT] = "repaint",
+	[WESTON_FRAME_STAGE_PRESENT] = "present",
+};
+
+static int
+timespec_is_set(const struct timespec *ts)
+{
+	return ts->tv_sec != 0 || ts->tv_nsec != 0;
+}
+
+static int64_t
+timespec_sub_usec(const struct timespec *a, const struct timespec *b)
+{
+	return (int64_t) (a->tv_sec - b->tv_sec) * 1000000 +
+		(a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+static int
+histogram_bucket(uint32_t usec)
+{
+	int bit;
+
+	if (usec < LINEAR_BUCKETS)
+		return usec;
+
+	bit = 31 - __builtin_clz(usec);
+
+	return LINEAR_BUCKETS + (bit - 4) * SUB_BUCKETS +
+		((usec >> (bit - 3)) & (SUB_BUCKETS - 1));
+}
+
+/* The largest value falling into bucket b */
+static uint32_t
+histogram_bucket_max(int b)
+{
+	int bit, sub;
+
+	if (b < LINEAR_BUCKETS)
+		return b;
+
+	bit = (b - LINEAR_BUCKETS) / SUB_BUCKETS + 4;
+	sub = (b - LINEAR_BUCKETS) % SUB_BUCKETS;
+
+	return (((uint64_t) SUB_BUCKETS + sub + 1) << (bit - 3)) - 1;
+}
+
+static uint32_t
+stage_percentile(struct frame_stage_stats *s, int percent)
+{
+	uint64_t target, seen = 0;
+	int b;
+
+	target = ((uint64_t) s->count * percent + 99) / 100;
+	for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		seen += s->histogram[b];
+		if (seen >= target)
+			return MIN(histogram_bucket_max(b), s->max);
+	}
+
+	return s->max;
+}
+
+static void
+stage_record(struct weston_frame_stats *stats, enum weston_frame_stage stage,
+	     const struct timespec *begin, const struct timespec *end)
+{
+	struct frame_stage_stats *s = &stats->stage[stage];
+	int64_t delta = timespec_sub_usec(end, begin);
+	uint32_t usec;
+
+	/* The presentation clock may be adjusted under us */
+	if (delta < 0)
+		return;
+
+	usec = delta > UINT32_MAX ? UINT32_MAX : delta;
+
+	if (s->count == 0 || usec < s->min)
+		s->min = usec;
+	if (usec > s->max)
+		s->max = usec;
+	s->count++;
+	s->total += usec;
+	s->histogram[histogram_bucket(usec)]++;
+}
+
+static void
+frame_stats_reset(struct weston_output *output)
+{
+	struct weston_frame_stats *stats = output->frame_stats;
+
+	stats->frames = 0;
+	stats->late_frames = 0;
+	stats->missed_vblanks = 0;
+	stats->view_list_rebuilds = 0;
+	memset(stats->stage, 0, sizeof stats->stage);
+	stats->repaints = 0;
+	stats->views = 0;
+	stats->culled_views = 0;
+	stats->clip_rects = 0;
+	clock_gettime(output->compositor->presentation_clock, &stats->begin);
+}
+
+void
+weston_output_frame_stats_init(struct weston_output *output)
+{
+	output->frame_stats = zalloc(sizeof *output->frame_stats);
+	if (!output->frame_stats)
+		return;
+
+	frame_stats_reset(output);
+}
+
+void
+weston_output_frame_stats_destroy(struct weston_output *output)
+{
+	free(output->frame_stats);
+	output->frame_stats = NULL;
+}
+
+/* Called whenever a repaint becomes needed; only the first request
+ * of every frame starts the clock. */
+void
+weston_output_frame_stats_request(struct weston_output *output)
+{
+	struct weston_frame_stats *stats = output->frame_stats;
+
+	if (!stats || timespec_is_set(&stats->request))
+		return;
+
+	clock_gettime(output->compositor->presentation_clock, &stats->request);
+}
+
+void
+weston_output_frame_stats_repaint(struct weston_output *output,
+				  const struct timespec *stamps,
+				  int view_list_rebuilt)
+{
+	struct weston_frame_stats *stats = output->frame_stats;
+	int i;
+
+	if (!stats)
+		return;
+
+	if (timespec_is_set(&stats->request))
+		stage_record(stats, WESTON_FRAME_STAGE_SCHEDULE,
+			     &stats->request, &stamps[0]);
+
+	for (i = WESTON_FRAME_STAGE_VIEW_LIST;
+	     i <= WESTON_FRAME_STAGE_RENDER; i++)
+		stage_record(stats, i, &stamps[i - 1], &stamps[i]);
+
+	stage_record(stats, WESTON_FRAME_STAGE_REPAINT,
+		     &stamps[0], &stamps[WESTON_FRAME_STAGE_RENDER]);
+
+	if (view_list_rebuilt)
+		stats->view_list_rebuilds++;
+
+	/* The frame could not have been shown before it was asked for,
+	 * nor before the previous one was. */
+	stats->frame_start = stats->last_present;
+	if (timespec_is_set(&stats->request) &&
+	    timespec_sub_usec(&stats->request, &stats->frame_start) > 0)
+		stats->frame_start = stats->request;
+
+	stats->render_done = stamps[WESTON_FRAME_STAGE_RENDER];
+	stats->request.tv_sec = 0;
+	stats->request.tv_nsec = 0;
+	stats->in_flight = 1;
+}
+
+void
+weston_output_frame_stats_present(struct weston_output *output,
+				  const struct timespec *stamp)
+{
+	struct weston_frame_stats *stats = output->frame_stats;
+	int64_t elapsed, period;
+	uint32_t missed;
+
+	if (!stats)
+		return;
+
+	/* start_repaint_loop also ends up here without a frame */
+	if (!stats->in_flight) {
+		stats->last_present = *stamp;
+		return;
+	}
+
+	stats->in_flight = 0;
+	stats->frames++;
+
+	/* Nothing to compare a virtual stamp with */
+	if (stats->virtual_clock) {
+		stats->last_present = *stamp;
+		return;
+	}
+
+	stage_record(stats, WESTON_FRAME_STAGE_PRESENT,
+		     &stats->render_done, stamp);
+
+	/* Every full refresh period beyond the first one, give or take
+	 * half a period of jitter, is a vblank the frame missed. */
+	if (output->current_mode->refresh > 0 &&
+	    timespec_is_set(&stats->frame_start)) {
+		period = 1000000000LL / output->current_mode->refresh;
+		elapsed = timespec_sub_usec(stamp, &stats->frame_start);
+		if (elapsed > period + period / 2) {
+			missed = (elapsed - period / 2) / period;
+			stats->missed_vblanks += missed;
+			stats->late_frames++;
+		}
+	}
+
+	stats->last_present = *stamp;
+}
+
+/* For backends that report presentation on a clock of their own, like
+ * the virtual clock of the headless backend: presentation latency and
+ * missed vblanks cannot be measured against the presentation clock
+ * then, so they are left out. */
+WL_EXPORT void
+weston_output_frame_stats_virtual_clock(struct weston_output *output)
+{
+	if (output->frame_stats)
+		output->frame_stats->virtual_clock = 1;
+}
+
+/* The views on the output, how many of them were entirely occluded, and
+ * the rectangles of the clip regions the renderer gets for the others */
+void
+weston_output_frame_stats_views(struct weston_output *output,
+				uint32_t views, uint32_t culled,
+				uint32_t clip_rects)
+{
+	struct weston_frame_stats *stats = output->frame_stats;
+
+	if (!stats)
+		return;
+
+	stats->repaints++;
+	stats->views += views;
+	stats->culled_views += culled;
+	stats->clip_rects += clip_rects;
+}
+
+static void
+frame_stats_print(FILE *fp, struct weston_output *output)
+{
+	struct weston_frame_stats *stats = output->frame_stats;
+	struct frame_stage_stats *s;
+	struct timespec now;
+	double seconds;
+	int i;
+
+	clock_gettime(output->compositor->presentation_clock, &now);
+	seconds = timespec_sub_usec(&now, &stats->begin) / 1000000.0;
+
+	fprintf(fp, "output %s: %u frames in %.1f s, "
+		"%u late frames, %u missed vblanks\n",
+		output->name ? output->name : "(unnamed)",
+		stats->frames, seconds,
+		stats->late_frames, stats->missed_vblanks);
+	if (stats->virtual_clock)
+		fprintf(fp, "  virtual clock, presentation not timed\n");
+
+	for (i = 0; i < WESTON_FRAME_STAGE_COUNT; i++) {
+		s = &stats->stage[i];
+		if (s->count == 0)
+			continue;
+
+		fprintf(fp, "  %-13s n %7u  min %8.3f  avg %8.3f  "
+			"p99 %8.3f  max %8.3f ms\n",
+			stage_names[i], s->count,
+			s->min / 1000.0,
+			(double) s->total / s->count / 1000.0,
+			stage_percentile(s, 99) / 1000.0,
+			s->max / 1000.0);
+	}
+
+	s = &stats->stage[WESTON_FRAME_STAGE_VIEW_LIST];
+	if (s->count > 0)
+		fprintf(fp, "  view list rebuilt in %u of %u repaints\n",
+			stats->view_list_rebuilds, s->count);
+
+	if (stats->repaints > 0)
+		fprintf(fp, "  per repaint: %.1f views, %.1f culled, "
+			"%.1f clip rectangles\n",
+			(double) stats->views / stats->repaints,
+			(double) stats->culled_views / stats->repaints,
+			(double) stats->clip_rects / stats->repaints);
+}
+
+static void
+frame_stats_log(const char *report)
+{
+	const char *line, *end;
+
+	for (line = report; *line; line = *end ? end + 1 : end) {
+		end = strchrnul(line, '\n');
+		if (line == report)
+			weston_log("%.*s\n", (int) (end - line), line);
+		else
+			weston_log_continue(STAMP_SPACE "%.*s\n",
+					    (int) (end - line), line);
+	}
+}
+
+/* Reports the statistics of every output since the last dump to the
+ * log and, if configured, appends them to [core] frame-stats-file. */
+WL_EXPORT void
+weston_compositor_dump_frame_stats(struct weston_compositor *compositor)
+{
+	struct weston_output *output;
+	char *report = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	fp = open_memstream(&report, &size);
+	if (!fp)
+		return;
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (!output->frame_stats)
+			continue;
+
+		frame_stats_print(fp, output);
+		frame_stats_reset(output);
+	}
+
+	fclose(fp);
+
+	if (size > 0) {
+		frame_stats_log(report);
+
+		if (compositor->frame_stats_file) {
+			fp = fopen(compositor->frame_stats_file, "a");
+			if (fp) {
+				fwrite(report, 1, size, fp);
+				fclose(fp);
+			} else {
+				weston_log("failed to open %s: %m\n",
+					   compositor->frame_stats_file);
+			}
+		}
+	}
+
+	free(report);
+}
+
+static void
+frame_stats_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
+		    void *data)
+{
+	struct weston_compositor *compositor = data;
+
+	weston_compositor_dump_frame_stats(compositor);
+}
+
+void
+weston_compositor_frame_stats_init(struct weston_compositor *compositor)
+{
+	struct weston_config_section *s;
+
+	s = weston_config_get_section(compositor->config, "core", NULL, NULL);
+	weston_config_section_get_string(s, "frame-stats-file",
+					 &compositor->frame_stats_file, NULL);
+
+	weston_compositor_add_debug_binding(compositor, KEY_T,
+					    frame_stats_binding, compositor);
+}
+
+void
+weston_compositor_frame_stats_fini(struct weston_compositor *compositor)
+{
+	if (compositor->frame_stats_file)
+		weston_compositor_dump_frame_stats(compositor);
+
+	free(compositor->frame_stats_file);
+	compositor->frame_stats_file = NULL;
+}
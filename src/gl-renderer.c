@@ -50,6 +50,44 @@ struct gl_shader {
 
 #define BUFFER_DAMAGE_COUNT 2
 
+/* A texture upload costs about as much as this many more pixels, so
+ * damage rectangles are merged when that uploads fewer extra pixels. */
+#define UPLOAD_CALL_COST 4096
+
+/* Beyond this many rectangles, only neighbours are considered for
+ * merging, see merge_upload_boxes() */
+#define UPLOAD_MERGE_MAX 128
+
+#ifndef GL_PIXEL_UNPACK_BUFFER_NV
+#define GL_PIXEL_UNPACK_BUFFER_NV 0x88EC
+#endif
+
+/* Small ARGB/XRGB wl_shm surfaces share one texture, so that views of
+ * them can be drawn together.  Slots are kept in shelves of equal
+ * height, and carry a one pixel border duplicating the edge texels so
+ * that linear filtering does not pick up the neighbours. */
+#define ATLAS_SIZE 1024
+#define ATLAS_MAX_SURFACE 128
+#define ATLAS_SHELF_ALIGN 8
+
+struct gl_atlas_gap {
+	int x, width;
+};
+
+struct gl_atlas_shelf {
+	int y, height;
+	int x;		/* first free column */
+	int count;	/* slots in use */
+	struct wl_array gaps;	/* freed slots left of x, sorted by x */
+};
+
+struct gl_atlas {
+	GLuint texture;
+	int top;	/* first row below the last shelf */
+	struct wl_array shelves;
+	uint32_t *scratch;
+};
+
 enum gl_border_status {
 	BORDER_STATUS_CLEAN = 0,
 	BORDER_TOP_DIRTY = 1 << GL_RENDERER_BORDER_TOP,
@@ -107,6 +145,12 @@ struct gl_surface_state {
 	int height; /* in pixels */
 	int y_inverted;
 
+	/* Shelf of the atlas slot, or -1.  atlas_x and atlas_y are
+	 * where the buffer origin is, inside the border. */
+	int atlas_shelf;
+	int atlas_x, atlas_y;
+	int atlas_width;
+
 	struct weston_surface *surface;
 
 	struct wl_listener surface_destroy_listener;
@@ -137,6 +181,22 @@ struct gl_renderer {
 
 	int has_unpack_subimage;
 
+	/* Stream shm uploads through a pixel buffer object */
+	int use_upload_pbo;
+	GLuint upload_pbo;
+
+	struct gl_atlas atlas;
+
+	/* Consecutive atlas views drawn with the same state are
+	 * collected here and drawn as one, see batch_flush() */
+	struct {
+		struct wl_array vertices;
+		struct gl_shader *shader;
+		GLint filter;
+		int blend;
+		float alpha;
+	} batch;
+
 	PFNEGLBINDWAYLANDDISPLAYWL bind_display;
 	PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
 	PFNEGLQUERYWAYLANDBUFFERWL query_buffer;
@@ -303,7 +363,7 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	struct gl_surface_state *gs = get_surface_state(ev->surface);
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v, inv_width, inv_height;
+	GLfloat *v, inv_width, inv_height, ox, oy;
 	unsigned int *vtxcnt, nvtx = 0;
 	pixman_box32_t *rects, *surf_rects;
 	int i, j, k, nrects, nsurf;
@@ -317,8 +377,17 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	v = wl_array_add(&gr->vertices, nrects * nsurf * 8 * 4 * sizeof *v);
 	vtxcnt = wl_array_add(&gr->vtxcnt, nrects * nsurf * sizeof *vtxcnt);
 
-	inv_width = 1.0 / gs->pitch;
-        inv_height = 1.0 / gs->height;
+	if (gs->atlas_shelf >= 0) {
+		inv_width = 1.0 / ATLAS_SIZE;
+		inv_height = 1.0 / ATLAS_SIZE;
+		ox = gs->atlas_x;
+		oy = gs->atlas_y;
+	} else {
+		inv_width = 1.0 / gs->pitch;
+		inv_height = 1.0 / gs->height;
+		ox = 0;
+		oy = 0;
+	}
 
 	for (i = 0; i < nrects; i++) {
 		pixman_box32_t *rect = &rects[i];
@@ -357,11 +426,11 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 				weston_surface_to_buffer_float(ev->surface,
 							       sx, sy,
 							       &bx, &by);
-				*(v++) = bx * inv_width;
+				*(v++) = (ox + bx) * inv_width;
 				if (gs->y_inverted) {
-					*(v++) = by * inv_height;
+					*(v++) = (oy + by) * inv_height;
 				} else {
-					*(v++) = (gs->height - by) * inv_height;
+					*(v++) = (oy + gs->height - by) * inv_height;
 				}
 			}
 
@@ -521,6 +590,137 @@ shader_uniforms(struct gl_shader *shader,
 		glUniform1i(shader->tex_uniforms[i], i);
 }
 
+static GLint
+view_filter(struct weston_view *ev, struct weston_output *output)
+{
+	if (ev->transform.enabled || output->zoom.active ||
+	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
+		return GL_LINEAR;
+	else
+		return GL_NEAREST;
+}
+
+static void
+batch_flush(struct gl_renderer *gr, struct weston_output *output)
+{
+	struct gl_shader *shader = gr->batch.shader;
+	GLfloat *v = gr->batch.vertices.data;
+	int n = gr->batch.vertices.size / (4 * sizeof *v);
+
+	if (n == 0)
+		return;
+
+	use_shader(gr, shader);
+	glUniformMatrix4fv(shader->proj_uniform,
+			   1, GL_FALSE, output->matrix.d);
+	glUniform1f(shader->alpha_uniform, gr->batch.alpha);
+	glUniform1i(shader->tex_uniforms[0], 0);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, gr->atlas.texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+			gr->batch.filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+			gr->batch.filter);
+
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	if (gr->batch.blend)
+		glEnable(GL_BLEND);
+	else
+		glDisable(GL_BLEND);
+
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
+	glEnableVertexAttribArray(1);
+
+	glDrawArrays(GL_TRIANGLES, 0, n);
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	gr->batch.vertices.size = 0;
+}
+
+/* Like repaint_region(), but the triangle fans are split into
+ * triangles and appended to the batch, which is drawn first if its
+ * state does not match. */
+static void
+batch_region(struct weston_view *ev, struct weston_output *output,
+	     struct gl_shader *shader, GLint filter, int blend,
+	     pixman_region32_t *region, pixman_region32_t *surf_region)
+{
+	struct gl_renderer *gr = get_renderer(ev->surface->compositor);
+	GLfloat *v, *fan, *d;
+	unsigned int *vtxcnt;
+	int i, k, nfans, ntris;
+
+	if (gr->batch.shader != shader || gr->batch.filter != filter ||
+	    gr->batch.blend != blend || gr->batch.alpha != ev->alpha) {
+		batch_flush(gr, output);
+		gr->batch.shader = shader;
+		gr->batch.filter = filter;
+		gr->batch.blend = blend;
+		gr->batch.alpha = ev->alpha;
+	}
+
+	nfans = texture_region(ev, region, surf_region);
+
+	v = gr->vertices.data;
+	vtxcnt = gr->vtxcnt.data;
+
+	for (i = 0, fan = v; i < nfans; fan += vtxcnt[i++] * 4) {
+		ntris = vtxcnt[i] - 2;
+		d = wl_array_add(&gr->batch.vertices,
+				 ntris * 3 * 4 * sizeof *d);
+		if (!d)
+			break;
+
+		for (k = 1; k <= ntris; k++) {
+			memcpy(d, &fan[0], 4 * sizeof *d);
+			memcpy(d + 4, &fan[k * 4], 8 * sizeof *d);
+			d += 12;
+		}
+	}
+
+	gr->vertices.size = 0;
+	gr->vtxcnt.size = 0;
+}
+
+static void
+batch_view(struct weston_view *ev, struct weston_output *output,
+	   pixman_region32_t *repaint)
+{
+	struct gl_renderer *gr = get_renderer(ev->surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	struct gl_shader *shader;
+	pixman_region32_t surface_blend;
+	GLint filter;
+
+	filter = view_filter(ev, output);
+
+	pixman_region32_init_rect(&surface_blend, 0, 0,
+				  ev->surface->width, ev->surface->height);
+	pixman_region32_subtract(&surface_blend, &surface_blend,
+				 &ev->surface->opaque);
+
+	/* Same split, and same alpha fixup, as in draw_view() */
+	if (pixman_region32_not_empty(&ev->surface->opaque)) {
+		shader = gs->shader;
+		if (shader == &gr->texture_shader_rgba)
+			shader = &gr->texture_shader_rgbx;
+
+		batch_region(ev, output, shader, filter, ev->alpha < 1.0,
+			     repaint, &ev->surface->opaque);
+	}
+
+	if (pixman_region32_not_empty(&surface_blend))
+		batch_region(ev, output, gs->shader, filter, 1,
+			     repaint, &surface_blend);
+
+	pixman_region32_fini(&surface_blend);
+}
+
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
 	  pixman_region32_t *damage) /* in global coordinates */
@@ -541,6 +741,10 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!gs->shader)
 		return;
 
+	/* Hidden by opaque views above */
+	if (ev->culled)
+		return;
+
 	pixman_region32_init(&repaint);
 	pixman_region32_intersect(&repaint,
 				  &ev->transform.masked_boundingbox, damage);
@@ -549,6 +753,13 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!pixman_region32_not_empty(&repaint))
 		goto out;
 
+	if (gs->atlas_shelf >= 0 && !gr->fan_debug) {
+		batch_view(ev, output, &repaint);
+		goto out;
+	}
+
+	batch_flush(gr, output);
+
 	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
 	if (gr->fan_debug) {
@@ -559,11 +770,15 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	use_shader(gr, gs->shader);
 	shader_uniforms(gs->shader, ev, output);
 
-	if (ev->transform.enabled || output->zoom.active ||
-	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
-		filter = GL_LINEAR;
-	else
-		filter = GL_NEAREST;
+	filter = view_filter(ev, output);
+
+	/* Atlas views only get here with fan debugging on */
+	if (gs->atlas_shelf >= 0) {
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, gr->atlas.texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+	}
 
 	for (i = 0; i < gs->num_textures; i++) {
 		glActiveTexture(GL_TEXTURE0 + i);
@@ -613,11 +828,14 @@ static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
 			draw_view(view, output, damage);
+
+	batch_flush(gr, output);
 }
 
 static void
@@ -993,6 +1211,348 @@ gl_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+static int
+box_area(const pixman_box32_t *box)
+{
+	return (box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+/* Merges a into b if that costs less than uploading both separately */
+static int
+merge_upload_box(pixman_box32_t *a, const pixman_box32_t *b)
+{
+	pixman_box32_t u;
+
+	u.x1 = MIN(a->x1, b->x1);
+	u.y1 = MIN(a->y1, b->y1);
+	u.x2 = MAX(a->x2, b->x2);
+	u.y2 = MAX(a->y2, b->y2);
+
+	if (box_area(&u) - box_area(a) - box_area(b) >= UPLOAD_CALL_COST)
+		return 0;
+
+	*a = u;
+	return 1;
+}
+
+/* Fewer, larger uploads for damage made of many small rectangles, like
+ * the glyphs of a terminal.  The boxes come in pixman's y-x banded
+ * order, so a linear pass first merges neighbours; if few enough are
+ * left, any pair is considered then. */
+static int
+merge_upload_boxes(pixman_box32_t *boxes, int n)
+{
+	int i, j, merged;
+
+	for (i = 0, j = 1; j < n; j++)
+		if (!merge_upload_box(&boxes[i], &boxes[j]))
+			boxes[++i] = boxes[j];
+	n = n > 0 ? i + 1 : 0;
+
+	if (n > UPLOAD_MERGE_MAX)
+		return n;
+
+	do {
+		merged = 0;
+		for (i = 0; i < n; i++) {
+			for (j = i + 1; j < n; j++) {
+				if (!merge_upload_box(&boxes[i], &boxes[j]))
+					continue;
+				boxes[j--] = boxes[--n];
+				merged = 1;
+			}
+		}
+	} while (merged);
+
+	return n;
+}
+
+/* The damaged parts of the buffer, merged for uploading.  Without
+ * GL_EXT_unpack_subimage only whole rows can be uploaded. */
+static int
+get_upload_boxes(struct gl_renderer *gr, struct gl_surface_state *gs,
+		 struct weston_surface *surface, pixman_box32_t **boxes_out)
+{
+	struct weston_buffer *buffer = gs->buffer_ref.buffer;
+	pixman_box32_t *rectangles, *boxes, r;
+	int i, n, area = 0;
+
+	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
+	boxes = malloc(MAX(n, 1) * sizeof *boxes);
+	if (!boxes)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+		if (!gr->has_unpack_subimage) {
+			r.x1 = 0;
+			r.x2 = gs->pitch;
+		}
+		boxes[i].x1 = MAX(r.x1, 0);
+		boxes[i].y1 = MAX(r.y1, 0);
+		boxes[i].x2 = MIN(r.x2, gs->pitch);
+		boxes[i].y2 = MIN(r.y2, buffer->height);
+	}
+
+	n = merge_upload_boxes(boxes, n);
+
+	/* Past a point, one upload of everything is cheaper */
+	for (i = 0; i < n; i++)
+		area += box_area(&boxes[i]);
+	if (n > 1 && area + n * UPLOAD_CALL_COST >=
+	    gs->pitch * buffer->height + UPLOAD_CALL_COST) {
+		boxes[0].x1 = 0;
+		boxes[0].y1 = 0;
+		boxes[0].x2 = gs->pitch;
+		boxes[0].y2 = buffer->height;
+		n = 1;
+	}
+
+	*boxes_out = boxes;
+
+	return n;
+}
+
+static int
+atlas_init(struct gl_renderer *gr)
+{
+	struct gl_atlas *atlas = &gr->atlas;
+	int size = ATLAS_MAX_SURFACE + 2;
+
+	atlas->scratch = malloc(size * size * sizeof *atlas->scratch);
+	if (!atlas->scratch)
+		return -1;
+
+	wl_array_init(&atlas->shelves);
+	atlas->top = 0;
+
+	glGenTextures(1, &atlas->texture);
+	glBindTexture(GL_TEXTURE_2D, atlas->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT, ATLAS_SIZE, ATLAS_SIZE,
+		     0, GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return 0;
+}
+
+static void
+atlas_fini(struct gl_renderer *gr)
+{
+	struct gl_atlas *atlas = &gr->atlas;
+	struct gl_atlas_shelf *shelf;
+
+	if (!atlas->texture)
+		return;
+
+	glDeleteTextures(1, &atlas->texture);
+	wl_array_for_each(shelf, &atlas->shelves)
+		wl_array_release(&shelf->gaps);
+	wl_array_release(&atlas->shelves);
+	free(atlas->scratch);
+	atlas->texture = 0;
+}
+
+/* Takes the first gap wide enough, or else the end of the shelf */
+static int
+shelf_alloc(struct gl_atlas_shelf *shelf, int w)
+{
+	struct gl_atlas_gap *gap, *gaps = shelf->gaps.data;
+	int x, i, n;
+
+	n = shelf->gaps.size / sizeof *gaps;
+	for (i = 0; i < n; i++) {
+		gap = &gaps[i];
+		if (gap->width < w)
+			continue;
+
+		x = gap->x;
+		gap->x += w;
+		gap->width -= w;
+		if (gap->width == 0) {
+			memmove(gap, gap + 1, (n - i - 1) * sizeof *gap);
+			shelf->gaps.size -= sizeof *gap;
+		}
+
+		return x;
+	}
+
+	if (shelf->x + w > ATLAS_SIZE)
+		return -1;
+
+	x = shelf->x;
+	shelf->x += w;
+
+	return x;
+}
+
+/* Returns a slot to its shelf, merging it with the free space around */
+static void
+shelf_free(struct gl_atlas_shelf *shelf, int x, int w)
+{
+	struct gl_atlas_gap *gap, *gaps = shelf->gaps.data;
+	int i, n;
+
+	n = shelf->gaps.size / sizeof *gaps;
+
+	if (x + w == shelf->x) {
+		shelf->x = x;
+		if (n > 0 && gaps[n - 1].x + gaps[n - 1].width == shelf->x) {
+			shelf->x = gaps[n - 1].x;
+			shelf->gaps.size -= sizeof *gaps;
+		}
+		return;
+	}
+
+	for (i = 0; i < n && gaps[i].x < x; i++)
+		;
+
+	if (i > 0 && gaps[i - 1].x + gaps[i - 1].width == x) {
+		gaps[i - 1].width += w;
+		if (i < n && x + w == gaps[i].x) {
+			gaps[i - 1].width += gaps[i].width;
+			memmove(&gaps[i], &gaps[i + 1],
+				(n - i - 1) * sizeof *gaps);
+			shelf->gaps.size -= sizeof *gaps;
+		}
+		return;
+	}
+
+	if (i < n && x + w == gaps[i].x) {
+		gaps[i].x = x;
+		gaps[i].width += w;
+		return;
+	}
+
+	/* A gap that cannot be recorded is only lost until the shelf
+	 * empties */
+	if (!wl_array_add(&shelf->gaps, sizeof *gap))
+		return;
+
+	gaps = shelf->gaps.data;
+	memmove(&gaps[i + 1], &gaps[i], (n - i) * sizeof *gaps);
+	gaps[i].x = x;
+	gaps[i].width = w;
+}
+
+static int
+atlas_alloc(struct gl_renderer *gr, struct gl_surface_state *gs,
+	    int width, int height)
+{
+	struct gl_atlas *atlas = &gr->atlas;
+	struct gl_atlas_shelf *shelf, *found = NULL;
+	int w, h, x = -1;
+
+	w = width + 2;
+	h = (height + 2 + ATLAS_SHELF_ALIGN - 1) & ~(ATLAS_SHELF_ALIGN - 1);
+
+	wl_array_for_each(shelf, &atlas->shelves) {
+		if (shelf->height != h)
+			continue;
+
+		x = shelf_alloc(shelf, w);
+		if (x >= 0) {
+			found = shelf;
+			break;
+		}
+	}
+
+	if (!found) {
+		if (atlas->top + h > ATLAS_SIZE)
+			return -1;
+
+		found = wl_array_add(&atlas->shelves, sizeof *found);
+		if (!found)
+			return -1;
+
+		found->y = atlas->top;
+		found->height = h;
+		found->x = 0;
+		found->count = 0;
+		wl_array_init(&found->gaps);
+		atlas->top += h;
+
+		x = shelf_alloc(found, w);
+	}
+
+	gs->atlas_shelf = found - (struct gl_atlas_shelf *) atlas->shelves.data;
+	gs->atlas_x = x + 1;
+	gs->atlas_y = found->y + 1;
+	gs->atlas_width = w;
+
+	found->count++;
+
+	return 0;
+}
+
+static void
+atlas_release(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	struct gl_atlas *atlas = &gr->atlas;
+	struct gl_atlas_shelf *shelves = atlas->shelves.data, *shelf;
+	int n;
+
+	if (gs->atlas_shelf < 0)
+		return;
+
+	shelf = &shelves[gs->atlas_shelf];
+	if (--shelf->count == 0) {
+		shelf->x = 0;
+		shelf->gaps.size = 0;
+	} else {
+		shelf_free(shelf, gs->atlas_x - 1, gs->atlas_width);
+	}
+
+	/* Empty shelves at the bottom can take any height again */
+	n = atlas->shelves.size / sizeof *shelves;
+	while (n > 0 && shelves[n - 1].count == 0) {
+		atlas->top = shelves[n - 1].y;
+		wl_array_release(&shelves[n - 1].gaps);
+		n--;
+	}
+	atlas->shelves.size = n * sizeof *shelves;
+
+	gs->atlas_shelf = -1;
+}
+
+/* Atlas slots are small enough that the whole buffer is uploaded,
+ * together with the border, in a single call. */
+static void
+atlas_upload(struct gl_renderer *gr, struct gl_surface_state *gs,
+	     struct weston_buffer *buffer)
+{
+	struct gl_atlas *atlas = &gr->atlas;
+	uint32_t *data, *src, *dst;
+	int y, width = buffer->width, height = buffer->height;
+
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	for (y = -1; y <= height; y++) {
+		src = data + MIN(MAX(y, 0), height - 1) * gs->pitch;
+		dst = atlas->scratch + (y + 1) * (width + 2);
+
+		dst[0] = src[0];
+		memcpy(dst + 1, src, width * sizeof *src);
+		dst[width + 1] = src[width - 1];
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+#ifdef GL_EXT_unpack_subimage
+	if (gr->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	}
+#endif
+
+	glBindTexture(GL_TEXTURE_2D, atlas->texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, gs->atlas_x - 1, gs->atlas_y - 1,
+			width + 2, height + 2,
+			GL_BGRA_EXT, GL_UNSIGNED_BYTE, atlas->scratch);
+}
+
 static void
 gl_renderer_flush_damage(struct weston_surface *surface)
 {
@@ -1000,13 +1560,10 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	struct gl_surface_state *gs = get_surface_state(surface);
 	struct weston_buffer *buffer = gs->buffer_ref.buffer;
 	struct weston_view *view;
-	int texture_used;
-
-#ifdef GL_EXT_unpack_subimage
-	pixman_box32_t *rectangles;
-	void *data;
-	int i, n;
-#endif
+	pixman_box32_t *boxes, *b;
+	int texture_used, stride, i, n;
+	size_t offset, size;
+	uint8_t *data;
 
 	pixman_region32_union(&gs->texture_damage,
 			      &gs->texture_damage, &surface->damage);
@@ -1033,26 +1590,25 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	    !gs->needs_full_upload)
 		goto done;
 
-	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
-
-	if (!gr->has_unpack_subimage) {
-		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
-			     gs->pitch, buffer->height, 0,
-			     gs->gl_format, gs->gl_pixel_type,
-			     wl_shm_buffer_get_data(buffer->shm_buffer));
-		wl_shm_buffer_end_access(buffer->shm_buffer);
-
+	if (gs->atlas_shelf >= 0) {
+		atlas_upload(gr, gs, buffer);
 		goto done;
 	}
 
-#ifdef GL_EXT_unpack_subimage
-	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
+	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
+
 	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+	stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
 
-	if (gs->needs_full_upload) {
+#ifdef GL_EXT_unpack_subimage
+	if (gr->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
 		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
 		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	}
+#endif
+
+	if (gs->needs_full_upload) {
 		wl_shm_buffer_begin_access(buffer->shm_buffer);
 		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
 			     gs->pitch, buffer->height, 0,
@@ -1061,21 +1617,66 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 		goto done;
 	}
 
-	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
-	wl_shm_buffer_begin_access(buffer->shm_buffer);
-	for (i = 0; i < n; i++) {
-		pixman_box32_t r;
+	n = get_upload_boxes(gr, gs, surface, &boxes);
+	if (n < 0)
+		goto done;
 
-		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+	/* Each box is uploaded from its whole rows, so that it is one
+	 * contiguous range of the buffer.  With a pixel buffer object,
+	 * these are copied into it first, and the textures are updated
+	 * from the copy, which the driver may do asynchronously instead
+	 * of stalling on a texture still in use.  Either way the client's
+	 * buffer is released at the end of this function. */
+	if (gr->use_upload_pbo) {
+		size = 0;
+		for (i = 0; i < n; i++)
+			size += (size_t) (boxes[i].y2 - boxes[i].y1) * stride;
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, gr->upload_pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER_NV, size, NULL,
+			     GL_STREAM_DRAW);
 
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r.x1);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, r.y1);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, r.x1, r.y1,
-				r.x2 - r.x1, r.y2 - r.y1,
-				gs->gl_format, gs->gl_pixel_type, data);
+		wl_shm_buffer_begin_access(buffer->shm_buffer);
+		for (i = 0, offset = 0; i < n; i++) {
+			b = &boxes[i];
+			size = (size_t) (b->y2 - b->y1) * stride;
+			glBufferSubData(GL_PIXEL_UNPACK_BUFFER_NV, offset,
+					size, data + b->y1 * stride);
+			offset += size;
+		}
+		wl_shm_buffer_end_access(buffer->shm_buffer);
+
+		/* Offsets into the buffer object from here on */
+		data = NULL;
+	} else {
+		wl_shm_buffer_begin_access(buffer->shm_buffer);
 	}
-	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	for (i = 0, offset = 0; i < n; i++) {
+		b = &boxes[i];
+
+#ifdef GL_EXT_unpack_subimage
+		if (gr->has_unpack_subimage)
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, b->x1);
 #endif
+		if (!gr->use_upload_pbo)
+			offset = (size_t) b->y1 * stride;
+
+		glTexSubImage2D(GL_TEXTURE_2D, 0, b->x1, b->y1,
+				b->x2 - b->x1, b->y2 - b->y1,
+				gs->gl_format, gs->gl_pixel_type,
+				data + offset);
+
+		if (gr->use_upload_pbo)
+			offset += (size_t) (b->y2 - b->y1) * stride;
+	}
+
+	if (gr->use_upload_pbo)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+	else
+		wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	free(boxes);
 
 done:
 	pixman_region32_fini(&gs->texture_damage);
@@ -1113,7 +1714,7 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 	struct gl_renderer *gr = get_renderer(ec);
 	struct gl_surface_state *gs = get_surface_state(es);
 	GLenum gl_format, gl_pixel_type;
-	int pitch;
+	int pitch, use_atlas;
 
 	buffer->shm_buffer = shm_buffer;
 	buffer->width = wl_shm_buffer_get_width(shm_buffer);
@@ -1147,11 +1748,17 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 	/* Only allocate a texture if it doesn't match existing one.
 	 * If a switch from DRM allocated buffer to a SHM buffer is
 	 * happening, we need to allocate a new texture buffer. */
+	use_atlas = gr->atlas.texture && gl_format == GL_BGRA_EXT &&
+		    buffer->width > 0 && buffer->height > 0 &&
+		    buffer->width <= ATLAS_MAX_SURFACE &&
+		    buffer->height <= ATLAS_MAX_SURFACE;
+
 	if (pitch != gs->pitch ||
 	    buffer->height != gs->height ||
 	    gl_format != gs->gl_format ||
 	    gl_pixel_type != gs->gl_pixel_type ||
-	    gs->buffer_type != BUFFER_TYPE_SHM) {
+	    gs->buffer_type != BUFFER_TYPE_SHM ||
+	    (gs->atlas_shelf >= 0 && gs->atlas_width != buffer->width + 2)) {
 		gs->pitch = pitch;
 		gs->height = buffer->height;
 		gs->target = GL_TEXTURE_2D;
@@ -1163,7 +1770,14 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 
 		gs->surface = es;
 
-		ensure_textures(gs, 1);
+		atlas_release(gr, gs);
+		if (use_atlas &&
+		    atlas_alloc(gr, gs, buffer->width, buffer->height) == 0) {
+			glDeleteTextures(gs->num_textures, gs->textures);
+			gs->num_textures = 0;
+		} else {
+			ensure_textures(gs, 1);
+		}
 	}
 }
 
@@ -1177,6 +1791,8 @@ gl_renderer_attach_egl(struct weston_surface *es, struct weston_buffer *buffer,
 	EGLint attribs[3];
 	int i, num_planes;
 
+	atlas_release(gr, gs);
+
 	buffer->legacy_buffer = (struct wl_buffer *)buffer->resource;
 	gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
 			 EGL_WIDTH, &buffer->width);
@@ -1263,6 +1879,7 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		gs->num_images = 0;
 		glDeleteTextures(gs->num_textures, gs->textures);
 		gs->num_textures = 0;
+		atlas_release(gr, gs);
 		gs->buffer_type = BUFFER_TYPE_NULL;
 		gs->y_inverted = 1;
 		return;
@@ -1295,6 +1912,7 @@ gl_renderer_surface_set_color(struct weston_surface *surface,
 	gs->color[2] = blue;
 	gs->color[3] = alpha;
 
+	atlas_release(gr, gs);
 	gs->shader = &gr->solid_shader;
 }
 
@@ -1309,6 +1927,7 @@ surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 	gs->surface->renderer_state = NULL;
 
 	glDeleteTextures(gs->num_textures, gs->textures);
+	atlas_release(gr, gs);
 
 	for (i = 0; i < gs->num_images; i++)
 		gr->destroy_image(gr->egl_display, gs->images[i]);
@@ -1362,6 +1981,7 @@ gl_renderer_create_surface(struct weston_surface *surface)
 	 */
 	gs->pitch = 1;
 	gs->y_inverted = 1;
+	gs->atlas_shelf = -1;
 
 	gs->surface = surface;
 
@@ -1817,6 +2437,10 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&gr->destroy_signal, gr);
 
+	if (gr->upload_pbo)
+		glDeleteBuffers(1, &gr->upload_pbo);
+	atlas_fini(gr);
+
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
@@ -1830,6 +2454,7 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->batch.vertices);
 
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
@@ -2046,9 +2671,12 @@ static int
 gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 {
 	struct gl_renderer *gr = get_renderer(ec);
+	struct weston_config_section *section;
 	const char *extensions;
 	EGLConfig context_config;
 	EGLBoolean ret;
+	GLint max_texture_size;
+	int use_atlas;
 
 	static const EGLint context_attribs[] = {
 		EGL_CONTEXT_CLIENT_VERSION, 2,
@@ -2113,6 +2741,27 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (strstr(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
+	section = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_bool(section, "gl-upload-pbo",
+				       &gr->use_upload_pbo, 0);
+	if (gr->use_upload_pbo &&
+	    !strstr(extensions, "GL_NV_pixel_buffer_object") &&
+	    strncmp((const char *) glGetString(GL_VERSION),
+		    "OpenGL ES 3", 11) != 0) {
+		weston_log("pixel buffer objects not available, "
+			   "gl-upload-pbo ignored\n");
+		gr->use_upload_pbo = 0;
+	}
+	if (gr->use_upload_pbo)
+		glGenBuffers(1, &gr->upload_pbo);
+
+	weston_config_section_get_bool(section, "gl-texture-atlas",
+				       &use_atlas, 1);
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+	if (use_atlas && max_texture_size >= ATLAS_SIZE &&
+	    atlas_init(gr) < 0)
+		weston_log("failed to create texture atlas\n");
+
 	glActiveTexture(GL_TEXTURE0);
 
 	if (compile_shaders(ec))
@@ -2132,6 +2781,11 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm upload through PBO: %s\n",
+			    gr->use_upload_pbo ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "texture atlas for small wl_shm "
+			    "surfaces: %s\n",
+			    gr->atlas.texture ? "yes" : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
 
@@ -161,6 +161,50 @@ default_grab_pointer_focus(struct weston_pointer_grab *grab)
 		weston_pointer_set_focus(pointer, view, sx, sy);
 }
 
+/* With [core] coalesce-motion, motion that cannot change the pointer
+ * focus only updates the position; moving the cursor, repicking and the
+ * motion signal wait for the next repaint of the cursor, see
+ * weston_compositor_flush_motion().  Clients still get every event. */
+static int
+pointer_move_coalesced(struct weston_pointer *pointer,
+		       wl_fixed_t x, wl_fixed_t y)
+{
+	struct weston_compositor *compositor = pointer->seat->compositor;
+	struct weston_view *focus = pointer->focus;
+	wl_fixed_t sx, sy;
+
+	if (!compositor->coalesce_motion ||
+	    focus == NULL || pointer->sprite == NULL ||
+	    pointer->sprite->output_mask == 0)
+		return 0;
+
+	weston_pointer_clamp(pointer, &x, &y);
+
+	/* The default grab keeps its focus while buttons are down.
+	 * Otherwise the focus has to stay the topmost view under the
+	 * pointer, which also rules out popups, other windows and
+	 * subsurfaces stacked above it. */
+	if (pointer->button_count == 0) {
+		if (weston_compositor_pick_view(compositor, x, y,
+						&sx, &sy) != focus)
+			return 0;
+	} else {
+		weston_view_from_global_fixed(focus, x, y, &sx, &sy);
+	}
+
+	pointer->x = x;
+	pointer->y = y;
+	pointer->sx = sx;
+	pointer->sy = sy;
+
+	if (!pointer->motion_pending) {
+		pointer->motion_pending = 1;
+		weston_view_schedule_repaint(pointer->sprite);
+	}
+
+	return 1;
+}
+
 static void
 default_grab_pointer_motion(struct weston_pointer_grab *grab, uint32_t time,
 			    wl_fixed_t x, wl_fixed_t y)
@@ -169,11 +213,14 @@ default_grab_pointer_motion(struct weston_pointer_grab *grab, uint32_t time,
 	struct wl_list *resource_list;
 	struct wl_resource *resource;
 
-	if (pointer->focus)
-		weston_view_from_global_fixed(pointer->focus, x, y,
-					      &pointer->sx, &pointer->sy);
+	if (!pointer_move_coalesced(pointer, x, y)) {
+		if (pointer->focus)
+			weston_view_from_global_fixed(pointer->focus, x, y,
+						      &pointer->sx,
+						      &pointer->sy);
 
-	weston_pointer_move(pointer, x, y);
+		weston_pointer_move(pointer, x, y);
+	}
 
 	resource_list = &pointer->focus_resource_list;
 	wl_resource_for_each(resource, resource_list) {
@@ -876,6 +923,7 @@ weston_pointer_move(struct weston_pointer *pointer, wl_fixed_t x, wl_fixed_t y)
 
 	pointer->x = x;
 	pointer->y = y;
+	pointer->motion_pending = 0;
 
 	ix = wl_fixed_to_int(x);
 	iy = wl_fixed_to_int(y);
@@ -891,6 +939,21 @@ weston_pointer_move(struct weston_pointer *pointer, wl_fixed_t x, wl_fixed_t y)
 	wl_signal_emit(&pointer->motion_signal, pointer);
 }
 
+/** Catch up with coalesced pointer motion, called once per repaint.
+ */
+WL_EXPORT void
+weston_compositor_flush_motion(struct weston_compositor *compositor)
+{
+	struct weston_seat *seat;
+	struct weston_pointer *pointer;
+
+	wl_list_for_each(seat, &compositor->seat_list, link) {
+		pointer = seat->pointer;
+		if (pointer && pointer->motion_pending)
+			weston_pointer_move(pointer, pointer->x, pointer->y);
+	}
+}
+
 /** Verify if the pointer is in a valid position and move it if it isn't.
  */
 static void
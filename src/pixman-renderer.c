@@ -24,24 +24,77 @@
 #include "config.h"
 
 #include <errno.h>
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "pixman-renderer.h"
+#include "worker-pool.h"
 
 #include <linux/input.h>
 
+/* Bands are never made thinner than this, so that the per-band setup
+ * cost stays small compared to the compositing itself. */
+#define MIN_BAND_HEIGHT 32
+
+/* Height of the rectangles approximating the area of a transformed
+ * view, see quad_to_region() */
+#define QUAD_STRIP_HEIGHT 8
+
 struct pixman_output_state {
+	/* NULL unless PIXMAN_RENDERER_OUTPUT_USE_SHADOW was requested */
 	void *shadow_buffer;
 	pixman_image_t *shadow_image;
 	pixman_image_t *hw_buffer;
+
+	/* struct pixman_paint, recorded for the band workers while
+	 * recording is set, see repaint_bands() */
+	struct wl_array paints;
+	int recording;
+};
+
+/* Everything the source transform of a view on an output depends on.
+ * Always memset before filling in, it is compared with memcmp(). */
+struct pixman_transform_key {
+	int32_t output_x, output_y;
+	int32_t output_width, output_height;
+	int32_t output_scale;
+	uint32_t output_transform;
+	float x, y;
+	int transform_enabled;
+	float matrix[16];
+	uint32_t buffer_transform;
+	int32_t buffer_scale;
+	wl_fixed_t src_x, src_y, src_width, src_height;
+	int32_t width, height;
+	int32_t width_from_buffer, height_from_buffer;
+	int32_t viewport_width, viewport_height;
+};
+
+/* One entry per view and output a surface is shown with */
+#define TRANSFORM_CACHE_SIZE 4
+
+struct pixman_transform_cache {
+	struct pixman_transform_key key;
+	pixman_transform_t transform;
+	pixman_filter_t filter;
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t color;
 	struct weston_buffer_reference buffer_ref;
 
+	struct pixman_transform_cache transforms[TRANSFORM_CACHE_SIZE];
+	int transforms_used, transforms_next;
+
+	/* Solid fill mask for views with alpha < 1 */
+	pixman_image_t *mask_image;
+	float mask_alpha;
+
 	struct wl_listener buffer_destroy_listener;
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
@@ -54,15 +107,58 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	struct worker_pool *worker_pool;
+	int band_count;
+	pthread_mutex_t access_mutex;
+
 	struct wl_signal destroy_signal;
 };
 
+/* A single composite into the shadow image, with everything resolved
+ * so that it can be replayed from any thread. */
+struct pixman_paint {
+	pixman_image_t *image;
+	pixman_color_t color;
+	struct wl_shm_buffer *shm_buffer;
+	pixman_region32_t region;	/* in output coordinates */
+	pixman_transform_t transform;
+	pixman_filter_t filter;
+	pixman_op_t op;
+	float alpha;
+};
+
+/* A convex quadrilateral in output coordinates */
+struct pixman_quad {
+	float x[4], y[4];
+};
+
+struct pixman_band_context {
+	struct pixman_renderer *pr;
+	struct pixman_output_state *po;
+	pixman_region32_t damage;	/* in output coordinates */
+	int x, y, width, height;
+	int band_height;
+	int copy_to_hw;
+};
+
+static const pixman_color_t repaint_debug_color = {
+	0x3fff, 0x0000, 0x0000, 0x3fff
+};
+
 static inline struct pixman_output_state *
 get_output_state(struct weston_output *output)
 {
 	return (struct pixman_output_state *)output->renderer_state;
 }
 
+/* Views are composited straight into the backend's buffer, unless
+ * the output has a shadow buffer. */
+static inline pixman_image_t *
+get_target_image(struct pixman_output_state *po)
+{
+	return po->shadow_image ? po->shadow_image : po->hw_buffer;
+}
+
 static int
 pixman_renderer_create_surface(struct weston_surface *surface);
 
@@ -167,58 +263,18 @@ transform_apply_viewport(pixman_transform_t *transform,
 	pixman_transform_translate(transform, NULL, D2F(src_x), D2F(src_y));
 }
 
+/* Set up the source transformation based on the surface position, the
+ * output position/transform/scale and the client specified buffer
+ * transform/scale */
 static void
-repaint_region(struct weston_view *ev, struct weston_output *output,
-	       pixman_region32_t *region, pixman_region32_t *surf_region,
-	       pixman_op_t pixman_op)
+compute_transform(struct weston_view *ev, struct weston_output *output,
+		  pixman_transform_t *transform, pixman_filter_t *filter)
 {
-	struct pixman_renderer *pr =
-		(struct pixman_renderer *) output->compositor->renderer;
-	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
-	pixman_region32_t final_region;
-	float view_x, view_y;
-	pixman_transform_t transform;
 	pixman_fixed_t fw, fh;
-	pixman_image_t *mask_image;
-	pixman_color_t mask = { 0, };
-
-	/* The final region to be painted is the intersection of
-	 * 'region' and 'surf_region'. However, 'region' is in the global
-	 * coordinates, and 'surf_region' is in the surface-local
-	 * coordinates
-	 */
-	pixman_region32_init(&final_region);
-	if (surf_region) {
-		pixman_region32_copy(&final_region, surf_region);
-
-		/* Convert from surface to global coordinates */
-		if (!ev->transform.enabled) {
-			pixman_region32_translate(&final_region, ev->geometry.x, ev->geometry.y);
-		} else {
-			weston_view_to_global_float(ev, 0, 0, &view_x, &view_y);
-			pixman_region32_translate(&final_region, (int)view_x, (int)view_y);
-		}
-
-		/* We need to paint the intersection */
-		pixman_region32_intersect(&final_region, &final_region, region);
-	} else {
-		/* If there is no surface region, just use the global region */
-		pixman_region32_copy(&final_region, region);
-	}
-
-	/* Convert from global to output coord */
-	region_global_to_output(output, &final_region);
 
-	/* And clip to it */
-	pixman_image_set_clip_region32 (po->shadow_image, &final_region);
-
-	/* Set up the source transformation based on the surface
-	   position, the output position/transform/scale and the client
-	   specified buffer transform/scale */
-	pixman_transform_init_identity(&transform);
-	pixman_transform_scale(&transform, NULL,
+	pixman_transform_init_identity(transform);
+	pixman_transform_scale(transform, NULL,
 			       pixman_double_to_fixed ((double)1.0/output->current_scale),
 			       pixman_double_to_fixed ((double)1.0/output->current_scale));
 
@@ -231,18 +287,18 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		break;
 	case WL_OUTPUT_TRANSFORM_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-		pixman_transform_rotate(&transform, NULL, 0, -pixman_fixed_1);
-		pixman_transform_translate(&transform, NULL, 0, fh);
+		pixman_transform_rotate(transform, NULL, 0, -pixman_fixed_1);
+		pixman_transform_translate(transform, NULL, 0, fh);
 		break;
 	case WL_OUTPUT_TRANSFORM_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		pixman_transform_rotate(&transform, NULL, -pixman_fixed_1, 0);
-		pixman_transform_translate(&transform, NULL, fw, fh);
+		pixman_transform_rotate(transform, NULL, -pixman_fixed_1, 0);
+		pixman_transform_translate(transform, NULL, fw, fh);
 		break;
 	case WL_OUTPUT_TRANSFORM_270:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		pixman_transform_rotate(&transform, NULL, 0, pixman_fixed_1);
-		pixman_transform_translate(&transform, NULL, fw, 0);
+		pixman_transform_rotate(transform, NULL, 0, pixman_fixed_1);
+		pixman_transform_translate(transform, NULL, fw, 0);
 		break;
 	}
 
@@ -251,14 +307,14 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		pixman_transform_scale(&transform, NULL,
+		pixman_transform_scale(transform, NULL,
 				       pixman_int_to_fixed (-1),
 				       pixman_int_to_fixed (1));
-		pixman_transform_translate(&transform, NULL, fw, 0);
+		pixman_transform_translate(transform, NULL, fw, 0);
 		break;
 	}
 
-        pixman_transform_translate(&transform, NULL,
+        pixman_transform_translate(transform, NULL,
 				   pixman_double_to_fixed (output->x),
 				   pixman_double_to_fixed (output->y));
 
@@ -282,14 +338,15 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 			}};
 
 		pixman_transform_invert(&surface_transform, &surface_transform);
-		pixman_transform_multiply (&transform, &surface_transform, &transform);
+		pixman_transform_multiply (transform,
+					   &surface_transform, transform);
 	} else {
-		pixman_transform_translate(&transform, NULL,
+		pixman_transform_translate(transform, NULL,
 					   pixman_double_to_fixed ((double)-ev->geometry.x),
 					   pixman_double_to_fixed ((double)-ev->geometry.y));
 	}
 
-	transform_apply_viewport(&transform, ev->surface);
+	transform_apply_viewport(transform, ev->surface);
 
 	fw = pixman_int_to_fixed(ev->surface->width_from_buffer);
 	fh = pixman_int_to_fixed(ev->surface->height_from_buffer);
@@ -299,10 +356,10 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		pixman_transform_scale(&transform, NULL,
+		pixman_transform_scale(transform, NULL,
 				       pixman_int_to_fixed (-1),
 				       pixman_int_to_fixed (1));
-		pixman_transform_translate(&transform, NULL, fw, 0);
+		pixman_transform_translate(transform, NULL, fw, 0);
 		break;
 	}
 
@@ -313,72 +370,512 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		break;
 	case WL_OUTPUT_TRANSFORM_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-		pixman_transform_rotate(&transform, NULL, 0, pixman_fixed_1);
-		pixman_transform_translate(&transform, NULL, fh, 0);
+		pixman_transform_rotate(transform, NULL, 0, pixman_fixed_1);
+		pixman_transform_translate(transform, NULL, fh, 0);
 		break;
 	case WL_OUTPUT_TRANSFORM_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		pixman_transform_rotate(&transform, NULL, -pixman_fixed_1, 0);
-		pixman_transform_translate(&transform, NULL, fw, fh);
+		pixman_transform_rotate(transform, NULL, -pixman_fixed_1, 0);
+		pixman_transform_translate(transform, NULL, fw, fh);
 		break;
 	case WL_OUTPUT_TRANSFORM_270:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		pixman_transform_rotate(&transform, NULL, 0, -pixman_fixed_1);
-		pixman_transform_translate(&transform, NULL, 0, fw);
+		pixman_transform_rotate(transform, NULL, 0, -pixman_fixed_1);
+		pixman_transform_translate(transform, NULL, 0, fw);
 		break;
 	}
 
-	pixman_transform_scale(&transform, NULL,
+	pixman_transform_scale(transform, NULL,
 			       pixman_double_to_fixed(vp->buffer.scale),
 			       pixman_double_to_fixed(vp->buffer.scale));
 
-	pixman_image_set_transform(ps->image, &transform);
-
 	if (ev->transform.enabled || output->current_scale != vp->buffer.scale)
-		pixman_image_set_filter(ps->image, PIXMAN_FILTER_BILINEAR, NULL, 0);
+		*filter = PIXMAN_FILTER_BILINEAR;
+	else
+		*filter = PIXMAN_FILTER_NEAREST;
+}
+
+static void
+transform_key_init(struct pixman_transform_key *key,
+		   struct weston_view *ev, struct weston_output *output)
+{
+	struct weston_surface *surface = ev->surface;
+	struct weston_buffer_viewport *vp = &surface->buffer_viewport;
+
+	memset(key, 0, sizeof *key);
+	key->output_x = output->x;
+	key->output_y = output->y;
+	key->output_width = output->width;
+	key->output_height = output->height;
+	key->output_scale = output->current_scale;
+	key->output_transform = output->transform;
+	key->transform_enabled = ev->transform.enabled;
+	if (ev->transform.enabled) {
+		memcpy(key->matrix, ev->transform.matrix.d,
+		       sizeof key->matrix);
+	} else {
+		key->x = ev->geometry.x;
+		key->y = ev->geometry.y;
+	}
+	key->buffer_transform = vp->buffer.transform;
+	key->buffer_scale = vp->buffer.scale;
+	key->src_x = vp->buffer.src_x;
+	key->src_y = vp->buffer.src_y;
+	key->src_width = vp->buffer.src_width;
+	key->src_height = vp->buffer.src_height;
+	key->width = surface->width;
+	key->height = surface->height;
+	key->width_from_buffer = surface->width_from_buffer;
+	key->height_from_buffer = surface->height_from_buffer;
+	key->viewport_width = vp->surface.width;
+	key->viewport_height = vp->surface.height;
+}
+
+/* Views rarely move from one frame to the next, so the composed
+ * transform is looked up by everything it is computed from and only
+ * recomputed when any of that changed. */
+static void
+get_transform(struct pixman_surface_state *ps,
+	      struct weston_view *ev, struct weston_output *output,
+	      pixman_transform_t *transform, pixman_filter_t *filter)
+{
+	struct pixman_transform_key key;
+	struct pixman_transform_cache *cache;
+	int i;
+
+	transform_key_init(&key, ev, output);
+
+	for (i = 0; i < ps->transforms_used; i++) {
+		cache = &ps->transforms[i];
+		if (memcmp(&cache->key, &key, sizeof key) == 0) {
+			*transform = cache->transform;
+			*filter = cache->filter;
+			return;
+		}
+	}
+
+	if (ps->transforms_used < TRANSFORM_CACHE_SIZE)
+		i = ps->transforms_used++;
 	else
-		pixman_image_set_filter(ps->image, PIXMAN_FILTER_NEAREST, NULL, 0);
+		i = ps->transforms_next++ % TRANSFORM_CACHE_SIZE;
+
+	cache = &ps->transforms[i];
+	cache->key = key;
+	compute_transform(ev, output, &cache->transform, &cache->filter);
 
-	if (ps->buffer_ref.buffer)
-		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
+	*transform = cache->transform;
+	*filter = cache->filter;
+}
 
-	if (ev->alpha < 1.0) {
-		mask.alpha = 0xffff * ev->alpha;
-		mask_image = pixman_image_create_solid_fill(&mask);
+/* A solid mask applying alpha, or NULL when it would not change
+ * anything */
+static pixman_image_t *
+create_mask_image(float alpha)
+{
+	pixman_color_t mask = { 0, };
+
+	if (alpha >= 1.0)
+		return NULL;
+
+	mask.alpha = 0xffff * alpha;
+
+	return pixman_image_create_solid_fill(&mask);
+}
+
+static pixman_image_t *
+get_mask_image(struct pixman_surface_state *ps, float alpha)
+{
+	if (alpha >= 1.0)
+		return NULL;
+
+	if (ps->mask_image && ps->mask_alpha == alpha)
+		return ps->mask_image;
+
+	if (ps->mask_image)
+		pixman_image_unref(ps->mask_image);
+
+	ps->mask_image = create_mask_image(alpha);
+	ps->mask_alpha = alpha;
+
+	return ps->mask_image;
+}
+
+static void
+paint_init(struct pixman_paint *paint,
+	   struct weston_view *ev, struct weston_output *output,
+	   pixman_region32_t *region, pixman_region32_t *surf_region,
+	   pixman_op_t pixman_op)
+{
+	struct pixman_surface_state *ps = get_surface_state(ev->surface);
+	float view_x, view_y;
+
+	paint->image = ps->image;
+	paint->color = ps->color;
+	paint->shm_buffer =
+		ps->buffer_ref.buffer ? ps->buffer_ref.buffer->shm_buffer : NULL;
+	paint->op = pixman_op;
+	paint->alpha = ev->alpha;
+
+	/* The final region to be painted is the intersection of
+	 * 'region' and 'surf_region'. However, 'region' is in the global
+	 * coordinates, and 'surf_region' is in the surface-local
+	 * coordinates
+	 */
+	pixman_region32_init(&paint->region);
+	if (surf_region) {
+		pixman_region32_copy(&paint->region, surf_region);
+
+		/* Convert from surface to global coordinates */
+		if (!ev->transform.enabled) {
+			pixman_region32_translate(&paint->region, ev->geometry.x, ev->geometry.y);
+		} else {
+			weston_view_to_global_float(ev, 0, 0, &view_x, &view_y);
+			pixman_region32_translate(&paint->region, (int)view_x, (int)view_y);
+		}
+
+		/* We need to paint the intersection */
+		pixman_region32_intersect(&paint->region, &paint->region, region);
 	} else {
-		mask_image = NULL;
+		/* If there is no surface region, just use the global region */
+		pixman_region32_copy(&paint->region, region);
 	}
 
-	pixman_image_composite32(pixman_op,
-				 ps->image, /* src */
+	/* Convert from global to output coord */
+	region_global_to_output(output, &paint->region);
+
+	get_transform(ps, ev, output, &paint->transform, &paint->filter);
+}
+
+static void
+renderer_begin_access(struct pixman_renderer *pr, struct wl_shm_buffer *buffer)
+{
+	/* The shm pool bookkeeping is not thread safe */
+	if (pr->worker_pool)
+		pthread_mutex_lock(&pr->access_mutex);
+	wl_shm_buffer_begin_access(buffer);
+	if (pr->worker_pool)
+		pthread_mutex_unlock(&pr->access_mutex);
+}
+
+static void
+renderer_end_access(struct pixman_renderer *pr, struct wl_shm_buffer *buffer)
+{
+	if (pr->worker_pool)
+		pthread_mutex_lock(&pr->access_mutex);
+	wl_shm_buffer_end_access(buffer);
+	if (pr->worker_pool)
+		pthread_mutex_unlock(&pr->access_mutex);
+}
+
+static void
+paint_composite(struct pixman_renderer *pr, struct pixman_paint *paint,
+		pixman_image_t *src, pixman_image_t *mask_image,
+		pixman_image_t *dest, pixman_region32_t *clip,
+		pixman_image_t *debug_color)
+{
+	pixman_image_set_clip_region32 (dest, clip);
+
+	pixman_image_set_transform(src, &paint->transform);
+	pixman_image_set_filter(src, paint->filter, NULL, 0);
+
+	if (paint->shm_buffer)
+		renderer_begin_access(pr, paint->shm_buffer);
+
+	pixman_image_composite32(paint->op,
+				 src, /* src */
 				 mask_image, /* mask */
-				 po->shadow_image, /* dest */
+				 dest, /* dest */
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
-				 pixman_image_get_width (po->shadow_image), /* width */
-				 pixman_image_get_height (po->shadow_image) /* height */);
-
-	if (mask_image)
-		pixman_image_unref(mask_image);
+				 pixman_image_get_width (dest), /* width */
+				 pixman_image_get_height (dest) /* height */);
 
-	if (ps->buffer_ref.buffer)
-		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
+	if (paint->shm_buffer)
+		renderer_end_access(pr, paint->shm_buffer);
 
-	if (pr->repaint_debug)
+	if (debug_color)
 		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
+					 debug_color, /* src */
 					 NULL /* mask */,
-					 po->shadow_image, /* dest */
+					 dest, /* dest */
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+					 pixman_image_get_width (dest), /* width */
+					 pixman_image_get_height (dest) /* height */);
+
+	pixman_image_set_clip_region32 (dest, NULL);
+}
+
+/* Paints everything recorded so far, in order, on this thread.  Used
+ * when a paint cannot be recorded and has to be painted right away, so
+ * that it does not end up underneath the views recorded before it. */
+static void
+paints_flush(struct pixman_renderer *pr, struct pixman_output_state *po)
+{
+	struct pixman_paint *paint;
+	pixman_image_t *mask;
+
+	wl_array_for_each(paint, &po->paints) {
+		mask = create_mask_image(paint->alpha);
+		paint_composite(pr, paint, paint->image, mask,
+				get_target_image(po), &paint->region,
+				pr->repaint_debug ? pr->debug_color : NULL);
+		if (mask)
+			pixman_image_unref(mask);
+		pixman_region32_fini(&paint->region);
+	}
+	po->paints.size = 0;
+}
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+/* Paints right away or, with a worker pool, records the paint to be
+ * replayed band by band in repaint_bands().  Takes over the region of
+ * the paint. */
+static void
+paint_submit(struct pixman_paint *paint,
+	     struct weston_view *ev, struct weston_output *output)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_surface_state *ps = get_surface_state(ev->surface);
+	struct pixman_paint *recorded;
+
+	if (po->recording && pixman_region32_not_empty(&paint->region)) {
+		recorded = wl_array_add(&po->paints, sizeof *recorded);
+		if (recorded) {
+			*recorded = *paint;
+			return;
+		}
+
+		paints_flush(pr, po);
+	}
+
+	paint_composite(pr, paint, paint->image,
+			get_mask_image(ps, paint->alpha), get_target_image(po),
+			&paint->region,
+			pr->repaint_debug ? pr->debug_color : NULL);
+
+	pixman_region32_fini(&paint->region);
+}
+
+static void
+repaint_region(struct weston_view *ev, struct weston_output *output,
+	       pixman_region32_t *region, pixman_region32_t *surf_region,
+	       pixman_op_t pixman_op)
+{
+	struct pixman_paint paint;
+
+	paint_init(&paint, ev, output, region, surf_region, pixman_op);
+	paint_submit(&paint, ev, output);
+}
+
+/* The corners of 'rect', in surface coordinates, on the output */
+static void
+view_quad(struct weston_view *ev, struct weston_output *output,
+	  float x1, float y1, float x2, float y2, struct pixman_quad *q)
+{
+	float sx[4] = { x1, x2, x2, x1 };
+	float sy[4] = { y1, y1, y2, y2 };
+	float x, y;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		weston_view_to_global_float(ev, sx[i], sy[i], &x, &y);
+		weston_transformed_coord(output->width, output->height,
+					 output->transform,
+					 output->current_scale,
+					 x - output->x, y - output->y,
+					 &q->x[i], &q->y[i]);
+	}
+}
+
+/* The horizontal extent of a quad on the line at y */
+static int
+quad_span(const struct pixman_quad *q, float y, float *x1, float *x2)
+{
+	float xi, yi, xj, yj, x;
+	int i, found = 0;
+
+	for (i = 0; i < 4; i++) {
+		xi = q->x[i];
+		yi = q->y[i];
+		xj = q->x[(i + 1) % 4];
+		yj = q->y[(i + 1) % 4];
+
+		if (y < MIN(yi, yj) || y > MAX(yi, yj))
+			continue;
+
+		if (yi == yj) {
+			x = MIN(xi, xj);
+			*x1 = found ? MIN(*x1, x) : x;
+			x = MAX(xi, xj);
+			*x2 = found ? MAX(*x2, x) : x;
+		} else {
+			x = xi + (y - yi) * (xj - xi) / (yj - yi);
+			*x1 = found ? MIN(*x1, x) : x;
+			*x2 = found ? MAX(*x2, x) : x;
+		}
+		found = 1;
+	}
+
+	return found;
+}
+
+/* Approximates the area of a quad with one rectangle per strip of
+ * QUAD_STRIP_HEIGHT rows.  With 'inner', the rectangles only contain
+ * pixels entirely inside the quad, otherwise they contain all pixels
+ * the quad touches.  As the quad is convex, its left edge is convex and
+ * its right edge concave, so it is enough to look at the top and bottom
+ * of each strip and at the corners in between. */
+static void
+quad_to_region(const struct pixman_quad *q, int inner,
+	       pixman_region32_t *region)
+{
+	pixman_box32_t *boxes;
+	float ymin, ymax, a1, a2, b1, b2, x1, x2;
+	int y, y1, y2, h, i, n = 0;
+
+	ymin = ymax = q->y[0];
+	for (i = 1; i < 4; i++) {
+		ymin = MIN(ymin, q->y[i]);
+		ymax = MAX(ymax, q->y[i]);
+	}
+
+	y1 = floorf(ymin);
+	y2 = ceilf(ymax);
+	boxes = malloc(((y2 - y1) / QUAD_STRIP_HEIGHT + 1) * sizeof *boxes);
+	if (!boxes || y2 <= y1) {
+		free(boxes);
+		pixman_region32_init(region);
+		return;
+	}
+
+	for (y = y1; y < y2; y += QUAD_STRIP_HEIGHT) {
+		h = MIN(QUAD_STRIP_HEIGHT, y2 - y);
+
+		if (inner) {
+			if (!quad_span(q, y, &a1, &a2) ||
+			    !quad_span(q, y + h, &b1, &b2))
+				continue;
+			x1 = ceilf(MAX(a1, b1));
+			x2 = floorf(MIN(a2, b2));
+		} else {
+			quad_span(q, MAX(y, ymin), &x1, &x2);
+			if (quad_span(q, MIN(y + h, ymax), &b1, &b2)) {
+				x1 = MIN(x1, b1);
+				x2 = MAX(x2, b2);
+			}
+			for (i = 0; i < 4; i++) {
+				if (q->y[i] < y || q->y[i] > y + h)
+					continue;
+				x1 = MIN(x1, q->x[i]);
+				x2 = MAX(x2, q->x[i]);
+			}
+			x1 = floorf(x1);
+			x2 = ceilf(x2);
+		}
+
+		if (x1 >= x2)
+			continue;
+
+		boxes[n].x1 = x1;
+		boxes[n].y1 = y;
+		boxes[n].x2 = x2;
+		boxes[n].y2 = y + h;
+		n++;
+	}
+
+	pixman_region32_init_rects(region, boxes, n);
+	free(boxes);
+}
+
+/* Size of one buffer pixel in surface coordinates, at least 1 */
+static void
+buffer_pixel_size(struct weston_surface *surface, int *px, int *py)
+{
+	struct weston_buffer_viewport *vp = &surface->buffer_viewport;
+	double src_width, src_height;
+
+	if (vp->buffer.src_width == wl_fixed_from_int(-1)) {
+		src_width = surface->width_from_buffer;
+		src_height = surface->height_from_buffer;
+	} else {
+		src_width = wl_fixed_to_double(vp->buffer.src_width);
+		src_height = wl_fixed_to_double(vp->buffer.src_height);
+	}
+
+	*px = 1;
+	*py = 1;
+	if (src_width > 0.0 && surface->width > src_width * vp->buffer.scale)
+		*px = ceil(surface->width / (src_width * vp->buffer.scale));
+	if (src_height > 0.0 && surface->height > src_height * vp->buffer.scale)
+		*py = ceil(surface->height / (src_height * vp->buffer.scale));
+}
+
+/* Views with a transform other than a translation.  Rather than
+ * blending the whole bounding box, only the strips the view actually
+ * covers are blended; the source samples as transparent outside the
+ * buffer, which gives the edges.  The parts of the opaque region far
+ * enough from its edges to not be filtered with translucent pixels are
+ * still copied without blending. */
+static void
+repaint_region_complex(struct weston_view *ev, struct weston_output *output,
+		       pixman_region32_t *region) /* in global coordinates */
+{
+	struct weston_surface *surface = ev->surface;
+	pixman_region32_t damage, covered, opaque, r;
+	pixman_box32_t *rects;
+	struct pixman_quad quad, q;
+	struct pixman_paint paint;
+	int i, n, px, py;
+
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, region);
+	region_global_to_output(output, &damage);
+
+	view_quad(ev, output, 0, 0, surface->width, surface->height, &quad);
+	quad_to_region(&quad, 0, &covered);
+	pixman_region32_intersect(&covered, &covered, &damage);
+
+	pixman_region32_init(&opaque);
+	if (ev->alpha == 1.0) {
+		/* Bilinear filtering reaches one buffer pixel out, which
+		 * the viewport may scale to several surface units */
+		buffer_pixel_size(surface, &px, &py);
+		rects = pixman_region32_rectangles(&surface->opaque, &n);
+		for (i = 0; i < n; i++) {
+			if (rects[i].x2 - rects[i].x1 <= 2 * px ||
+			    rects[i].y2 - rects[i].y1 <= 2 * py)
+				continue;
+
+			view_quad(ev, output,
+				  rects[i].x1 + px, rects[i].y1 + py,
+				  rects[i].x2 - px, rects[i].y2 - py, &q);
+			quad_to_region(&q, 1, &r);
+			pixman_region32_union(&opaque, &opaque, &r);
+			pixman_region32_fini(&r);
+		}
+
+		pixman_region32_intersect(&opaque, &opaque, &covered);
+		pixman_region32_subtract(&covered, &covered, &opaque);
+	}
+
+	if (pixman_region32_not_empty(&opaque)) {
+		paint_init(&paint, ev, output, region, NULL, PIXMAN_OP_SRC);
+		pixman_region32_copy(&paint.region, &opaque);
+		paint_submit(&paint, ev, output);
+	}
+
+	if (pixman_region32_not_empty(&covered)) {
+		paint_init(&paint, ev, output, region, NULL, PIXMAN_OP_OVER);
+		pixman_region32_copy(&paint.region, &covered);
+		paint_submit(&paint, ev, output);
+	}
 
-	pixman_region32_fini(&final_region);
+	pixman_region32_fini(&opaque);
+	pixman_region32_fini(&covered);
+	pixman_region32_fini(&damage);
 }
 
 static void
@@ -392,8 +889,8 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	/* non-opaque region in surface coordinates: */
 	pixman_region32_t surface_blend;
 
-	/* No buffer attached */
-	if (!ps->image)
+	/* No buffer attached, or hidden by opaque views above */
+	if (!ps->image || ev->culled)
 		return;
 
 	pixman_region32_init(&repaint);
@@ -409,10 +906,10 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		zoom_logged = 1;
 	}
 
-	/* TODO: Implement repaint_region_complex() using pixman_composite_trapezoids() */
-	if (ev->alpha != 1.0 ||
-	    (ev->transform.enabled &&
-	     ev->transform.matrix.type != WESTON_MATRIX_TRANSFORM_TRANSLATE)) {
+	if (ev->transform.enabled &&
+	    ev->transform.matrix.type != WESTON_MATRIX_TRANSFORM_TRANSLATE) {
+		repaint_region_complex(ev, output, &repaint);
+	} else if (ev->alpha != 1.0) {
 		repaint_region(ev, output, &repaint, NULL, PIXMAN_OP_OVER);
 	} else {
 		/* blended region is whole surface minus opaque region: */
@@ -445,6 +942,25 @@ repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
 			draw_view(view, output, damage);
 }
 
+static void
+copy_region(pixman_image_t *src, pixman_image_t *dest,
+	    pixman_region32_t *region) /* in output coordinates */
+{
+	pixman_image_set_clip_region32 (dest, region);
+
+	pixman_image_composite32(PIXMAN_OP_SRC,
+				 src, /* src */
+				 NULL /* mask */,
+				 dest, /* dest */
+				 0, 0, /* src_x, src_y */
+				 0, 0, /* mask_x, mask_y */
+				 0, 0, /* dest_x, dest_y */
+				 pixman_image_get_width (dest), /* width */
+				 pixman_image_get_height (dest) /* height */);
+
+	pixman_image_set_clip_region32 (dest, NULL);
+}
+
 static void
 copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 {
@@ -456,33 +972,165 @@ copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 
 	region_global_to_output(output, &output_region);
 
-	pixman_image_set_clip_region32 (po->hw_buffer, &output_region);
+	copy_region(po->shadow_image, po->hw_buffer, &output_region);
+
 	pixman_region32_fini(&output_region);
+}
 
-	pixman_image_composite32(PIXMAN_OP_SRC,
-				 po->shadow_image, /* src */
-				 NULL /* mask */,
-				 po->hw_buffer, /* dest */
-				 0, 0, /* src_x, src_y */
-				 0, 0, /* mask_x, mask_y */
-				 0, 0, /* dest_x, dest_y */
-				 pixman_image_get_width (po->hw_buffer), /* width */
-				 pixman_image_get_height (po->hw_buffer) /* height */);
+/* Creates a private image sharing the pixels of 'image', so that each
+ * worker can set its own clip, transform and filter. */
+static pixman_image_t *
+image_wrap(pixman_image_t *image)
+{
+	return pixman_image_create_bits(pixman_image_get_format(image),
+					pixman_image_get_width(image),
+					pixman_image_get_height(image),
+					pixman_image_get_data(image),
+					pixman_image_get_stride(image));
+}
 
-	pixman_image_set_clip_region32 (po->hw_buffer, NULL);
+static pixman_image_t *
+paint_create_source(struct pixman_paint *paint)
+{
+	/* Solid color surfaces have no pixel data to share */
+	if (!pixman_image_get_data(paint->image))
+		return pixman_image_create_solid_fill(&paint->color);
+
+	return image_wrap(paint->image);
+}
+
+static void
+repaint_band(void *data, int index)
+{
+	struct pixman_band_context *ctx = data;
+	struct pixman_output_state *po = ctx->po;
+	struct pixman_paint *paint;
+	pixman_image_t *dest, *src, *mask, *hw, *debug_color = NULL;
+	pixman_region32_t band, clip;
+	int y1, y2;
+
+	y1 = ctx->y + index * ctx->band_height;
+	y2 = MIN(y1 + ctx->band_height, ctx->y + ctx->height);
+
+	pixman_region32_init_rect(&band, ctx->x, y1, ctx->width, y2 - y1);
+	pixman_region32_intersect(&band, &band, &ctx->damage);
+
+	if (!pixman_region32_not_empty(&band))
+		goto out;
+
+	dest = image_wrap(get_target_image(po));
+	if (!dest)
+		goto out;
+
+	if (ctx->pr->repaint_debug)
+		debug_color =
+			pixman_image_create_solid_fill(&repaint_debug_color);
+
+	pixman_region32_init(&clip);
+	wl_array_for_each(paint, &po->paints) {
+		pixman_region32_intersect(&clip, &paint->region, &band);
+		if (!pixman_region32_not_empty(&clip))
+			continue;
+
+		src = paint_create_source(paint);
+		if (!src)
+			continue;
+
+		/* Like the source, each band gets its own mask image */
+		mask = create_mask_image(paint->alpha);
+
+		paint_composite(ctx->pr, paint, src, mask, dest, &clip,
+				debug_color);
+		if (mask)
+			pixman_image_unref(mask);
+		pixman_image_unref(src);
+	}
+	pixman_region32_fini(&clip);
+
+	if (debug_color)
+		pixman_image_unref(debug_color);
+
+	/* Copy the band out while it is still hot in the cache */
+	if (ctx->copy_to_hw) {
+		hw = image_wrap(po->hw_buffer);
+		if (hw) {
+			copy_region(dest, hw, &band);
+			pixman_image_unref(hw);
+		}
+	}
+
+	pixman_image_unref(dest);
+
+out:
+	pixman_region32_fini(&band);
+}
+
+static void
+repaint_bands(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_band_context ctx;
+	struct pixman_paint *paint;
+	pixman_box32_t *extents;
+	int count;
+
+	/* Only records the paints, see paint_submit() */
+	po->recording = 1;
+	repaint_surfaces(output, damage);
+	po->recording = 0;
+
+	ctx.pr = pr;
+	ctx.po = po;
+	ctx.copy_to_hw = po->shadow_image &&
+		pixman_image_get_data(po->hw_buffer) != NULL;
+
+	pixman_region32_init(&ctx.damage);
+	pixman_region32_copy(&ctx.damage, damage);
+	region_global_to_output(output, &ctx.damage);
+
+	extents = pixman_region32_extents(&ctx.damage);
+	ctx.x = extents->x1;
+	ctx.y = extents->y1;
+	ctx.width = extents->x2 - extents->x1;
+	ctx.height = extents->y2 - extents->y1;
+
+	if (ctx.height > 0) {
+		count = (ctx.height + MIN_BAND_HEIGHT - 1) / MIN_BAND_HEIGHT;
+		count = MIN(count, pr->band_count);
+		ctx.band_height = (ctx.height + count - 1) / count;
+		count = (ctx.height + ctx.band_height - 1) / ctx.band_height;
+
+		worker_pool_run(pr->worker_pool, count, repaint_band, &ctx);
+	}
+
+	if (po->shadow_image && !ctx.copy_to_hw)
+		copy_to_hw_buffer(output, damage);
+
+	wl_array_for_each(paint, &po->paints)
+		pixman_region32_fini(&paint->region);
+	po->paints.size = 0;
+
+	pixman_region32_fini(&ctx.damage);
 }
 
 static void
 pixman_renderer_repaint_output(struct weston_output *output,
 			     pixman_region32_t *output_damage)
 {
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 	struct pixman_output_state *po = get_output_state(output);
 
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
-	copy_to_hw_buffer(output, output_damage);
+	if (pr->worker_pool && pixman_image_get_data(get_target_image(po))) {
+		repaint_bands(output, output_damage);
+	} else {
+		repaint_surfaces(output, output_damage);
+		if (po->shadow_image)
+			copy_to_hw_buffer(output, output_damage);
+	}
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
@@ -590,6 +1238,8 @@ pixman_renderer_surface_state_destroy(struct pixman_surface_state *ps)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	if (ps->mask_image)
+		pixman_image_unref(ps->mask_image);
 	weston_buffer_reference(&ps->buffer_ref, NULL);
 	free(ps);
 }
@@ -654,6 +1304,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
+	ps->color = color;
 	
 	if (ps->image) {
 		pixman_image_unref(ps->image);
@@ -670,6 +1321,12 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
+
+	if (pr->worker_pool) {
+		worker_pool_destroy(pr->worker_pool);
+		pthread_mutex_destroy(&pr->access_mutex);
+	}
+
 	free(pr);
 
 	ec->renderer = NULL;
@@ -685,11 +1342,8 @@ debug_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
 	pr->repaint_debug ^= 1;
 
 	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
+		pr->debug_color =
+			pixman_image_create_solid_fill(&repaint_debug_color);
 	} else {
 		pixman_image_unref(pr->debug_color);
 		weston_compositor_damage_all(ec);
@@ -700,11 +1354,32 @@ WL_EXPORT int
 pixman_renderer_init(struct weston_compositor *ec)
 {
 	struct pixman_renderer *renderer;
+	struct weston_config_section *section;
+	int threads;
 
 	renderer = calloc(1, sizeof *renderer);
 	if (renderer == NULL)
 		return -1;
 
+	section = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_int(section, "pixman-threads", &threads, 1);
+
+	if (threads > 1) {
+		renderer->worker_pool = worker_pool_create(threads - 1);
+		if (renderer->worker_pool) {
+			pthread_mutex_init(&renderer->access_mutex, NULL);
+			threads = worker_pool_get_size(renderer->worker_pool);
+			/* A few bands per thread, so that threads whose
+			 * bands are cheap can pick up more work */
+			renderer->band_count = threads * 4;
+			weston_log("pixman renderer: compositing with "
+				   "%d threads\n", threads);
+		} else {
+			weston_log("pixman renderer: failed to create "
+				   "worker threads, compositing serially\n");
+		}
+	}
+
 	renderer->repaint_debug = 0;
 	renderer->debug_color = NULL;
 	renderer->base.read_pixels = pixman_renderer_read_pixels;
@@ -744,7 +1419,7 @@ pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *
 }
 
 WL_EXPORT int
-pixman_renderer_output_create(struct weston_output *output)
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags)
 {
 	struct pixman_output_state *po = calloc(1, sizeof *po);
 	int w, h;
@@ -752,27 +1427,31 @@ pixman_renderer_output_create(struct weston_output *output)
 	if (!po)
 		return -1;
 
-	/* set shadow image transformation */
-	w = output->current_mode->width;
-	h = output->current_mode->height;
+	if (flags & PIXMAN_RENDERER_OUTPUT_USE_SHADOW) {
+		/* set shadow image transformation */
+		w = output->current_mode->width;
+		h = output->current_mode->height;
 
-	po->shadow_buffer = malloc(w * h * 4);
+		po->shadow_buffer = malloc(w * h * 4);
 
-	if (!po->shadow_buffer) {
-		free(po);
-		return -1;
-	}
+		if (!po->shadow_buffer) {
+			free(po);
+			return -1;
+		}
 
-	po->shadow_image =
-		pixman_image_create_bits(PIXMAN_x8r8g8b8, w, h,
-					 po->shadow_buffer, w * 4);
+		po->shadow_image =
+			pixman_image_create_bits(PIXMAN_x8r8g8b8, w, h,
+						 po->shadow_buffer, w * 4);
 
-	if (!po->shadow_image) {
-		free(po->shadow_buffer);
-		free(po);
-		return -1;
+		if (!po->shadow_image) {
+			free(po->shadow_buffer);
+			free(po);
+			return -1;
+		}
 	}
 
+	wl_array_init(&po->paints);
+
 	output->renderer_state = po;
 
 	return 0;
@@ -783,12 +1462,14 @@ pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
 
-	pixman_image_unref(po->shadow_image);
+	if (po->shadow_image)
+		pixman_image_unref(po->shadow_image);
 
 	if (po->hw_buffer)
 		pixman_image_unref(po->hw_buffer);
 
 	free(po->shadow_buffer);
+	wl_array_release(&po->paints);
 
 	po->shadow_buffer = NULL;
 	po->shadow_image = NULL;
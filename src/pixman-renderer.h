@@ -27,8 +27,20 @@
 int
 pixman_renderer_init(struct weston_compositor *ec);
 
+enum pixman_renderer_output_flags {
+	/* Composite into an intermediate buffer and copy the damage to
+	 * the backend's buffer afterwards. Only worth it when reading
+	 * back from the backend's buffer is slow, as with an uncached
+	 * framebuffer. */
+	PIXMAN_RENDERER_OUTPUT_USE_SHADOW = (1 << 0),
+};
+
+/* Without a shadow buffer, the buffer passed to
+ * pixman_renderer_output_set_buffer() is rendered to directly, so the
+ * damage passed to repaint_output must also cover whatever changed
+ * since that buffer was last painted. */
 int
-pixman_renderer_output_create(struct weston_output *output);
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags);
 
 void
 pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *buffer);
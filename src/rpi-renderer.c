@@ -1146,6 +1146,9 @@ is_view_not_visible(struct weston_view *view)
 	int ret;
 	pixman_region32_t unocc;
 
+	if (view->culled)
+		return 1;
+
 	pixman_region32_init(&unocc);
 	pixman_region32_subtract(&unocc, &view->transform.boundingbox,
 				 &view->clip);
@@ -68,7 +68,11 @@ struct shared_output {
 		struct wl_list free_buffers;
 	} shm;
 
-	int cache_dirty;
+	/* Damage since the last commit to the parent, in output
+	 * coordinates */
+	pixman_region32_t damage;
+
+	/* Only for outputs with a transform or scale */
 	pixman_image_t *cache_image;
 	uint32_t *tmp_data;
 	size_t tmp_data_size;
@@ -538,25 +542,8 @@ static void
 shared_output_destroy(struct shared_output *so);
 
 static int
-shared_output_ensure_tmp_data(struct shared_output *so,
-			      pixman_region32_t *region)
+shared_output_ensure_tmp_data(struct shared_output *so, size_t size)
 {
-	pixman_box32_t *ext;
-	size_t size;
-
-	if (!pixman_region32_not_empty(region))
-		return 0;
-
-	ext = pixman_region32_extents(region);
-
-	/* Damage is in output coordinates.
-	 *
-	 * We are multiplying by 4 because the temporary data needs to be able
-	 * to store an 32 bit-per-pixel buffer.
-	 */
-	size = 4 * (ext->x2 - ext->x1) * (ext->y2 - ext->y1)
-		 * so->output->current_scale * so->output->current_scale;
-
 	if (so->tmp_data != NULL && size <= so->tmp_data_size)
 		return 0;
 
@@ -573,51 +560,180 @@ shared_output_ensure_tmp_data(struct shared_output *so,
 	return 0;
 }
 
-static void
-shared_output_update(struct shared_output *so);
+/* Damage is in output coordinates. Rectangles that are read through
+ * the temporary data are as big as the damage at most, and we need
+ * a row of the output for flipping rows. */
+static int
+shared_output_ensure_tmp_data_for(struct shared_output *so,
+				   pixman_region32_t *region)
+{
+	pixman_box32_t *ext;
+	size_t size;
+
+	if (!pixman_region32_not_empty(region))
+		return 0;
 
+	ext = pixman_region32_extents(region);
+	size = 4 * (ext->x2 - ext->x1) * (ext->y2 - ext->y1)
+		 * so->output->current_scale * so->output->current_scale;
+
+	return shared_output_ensure_tmp_data(so, MAX(size,
+				4 * (size_t) so->output->current_mode->width));
+}
+
+/* Reads a rectangle in buffer coordinates into 'dest', an image with
+ * 'stride' pixels per row */
 static void
-shared_output_frame_callback(void *data, struct wl_callback *cb, uint32_t time)
+shared_output_read_rect(struct shared_output *so, pixman_box32_t *r,
+			uint32_t *dest, int stride)
 {
-	struct shared_output *so = data;
+	struct weston_output *output = so->output;
+	int32_t x = r->x1, y = r->y1;
+	int32_t width = r->x2 - r->x1, height = r->y2 - r->y1;
+
+	if (output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP) {
+		output->compositor->renderer->read_pixels(
+			output, PIXMAN_a8r8g8b8, so->tmp_data,
+			x, output->current_mode->height - r->y2,
+			width, height);
+
+		pixman_blt(so->tmp_data, dest, -width, stride,
+			   32, 32, 0, 1 - height, x, y, width, height);
+	} else {
+		output->compositor->renderer->read_pixels(
+			output, PIXMAN_a8r8g8b8, so->tmp_data,
+			x, y, width, height);
 
-	if (cb != so->parent.frame_cb)
-		return;
+		pixman_blt(so->tmp_data, dest, width, stride,
+			   32, 32, 0, 0, x, y, width, height);
+	}
+}
 
-	wl_callback_destroy(cb);
-	so->parent.frame_cb = NULL;
+/* Reads rows y1 to y2 at full width straight into 'dest' */
+static void
+shared_output_read_rows(struct shared_output *so, uint32_t *dest,
+			int32_t y1, int32_t y2)
+{
+	struct weston_output *output = so->output;
+	int32_t width = output->current_mode->width;
+	int32_t height = output->current_mode->height;
+	uint32_t *top, *bottom;
+	size_t row = width * 4;
+
+	dest += y1 * width;
+
+	if (!(output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)) {
+		output->compositor->renderer->read_pixels(
+			output, PIXMAN_a8r8g8b8, dest,
+			0, y1, width, y2 - y1);
+		return;
+	}
 
-	shared_output_update(so);
+	output->compositor->renderer->read_pixels(
+		output, PIXMAN_a8r8g8b8, dest,
+		0, height - y2, width, y2 - y1);
+
+	/* The rows come bottom-up */
+	top = dest;
+	bottom = dest + (y2 - y1 - 1) * width;
+	for (; top < bottom; top += width, bottom -= width) {
+		memcpy(so->tmp_data, top, row);
+		memcpy(top, bottom, row);
+		memcpy(bottom, so->tmp_data, row);
+	}
 }
 
-static const struct wl_callback_listener shared_output_frame_listener = {
-	shared_output_frame_callback
-};
+/* Without transform or scale the shm buffer has the layout of the
+ * framebuffer, so the damage is read right into it. Bands of rows
+ * that are mostly damaged are read at full width in one go. */
+static int
+shared_output_read_direct(struct shared_output *so, struct ss_shm_buffer *sb)
+{
+	int32_t width = so->output->current_mode->width;
+	pixman_box32_t *r;
+	int i, j, k, nrects, damaged;
 
-static void
-shared_output_update(struct shared_output *so)
+	if (shared_output_ensure_tmp_data_for(so, &sb->damage) < 0)
+		return -1;
+
+	r = pixman_region32_rectangles(&sb->damage, &nrects);
+	for (i = 0; i < nrects; i = j) {
+		damaged = 0;
+		for (j = i; j < nrects && r[j].y1 == r[i].y1; j++)
+			damaged += r[j].x2 - r[j].x1;
+
+		if (damaged * 2 >= width) {
+			shared_output_read_rows(so, sb->data,
+						r[i].y1, r[i].y2);
+			continue;
+		}
+
+		for (k = i; k < j; k++)
+			shared_output_read_rect(so, &r[k], sb->data, width);
+	}
+
+	return 0;
+}
+
+/* With a transform, the damage since the last commit is read into a
+ * cache of the framebuffer, which is then composited into the shm
+ * buffer. */
+static int
+shared_output_read_cached(struct shared_output *so, struct ss_shm_buffer *sb)
 {
-	struct ss_shm_buffer *sb;
+	struct weston_output *output = so->output;
+	pixman_region32_t damage;
+	pixman_transform_t transform;
+	int32_t width, height;
 	pixman_box32_t *r;
 	int i, nrects;
-	pixman_transform_t transform;
 
-	/* Only update if we need to */
-	if (!so->cache_dirty || so->parent.frame_cb)
-		return;
+	width = output->current_mode->width;
+	height = output->current_mode->height;
 
-	sb = shared_output_get_shm_buffer(so);
-	if (sb == NULL) {
-		shared_output_destroy(so);
-		return;
+	pixman_region32_init(&damage);
+	weston_transformed_region(output->width, output->height,
+				  output->transform, output->current_scale,
+				  &so->damage, &damage);
+
+	if (!so->cache_image ||
+	    pixman_image_get_width(so->cache_image) != width ||
+	    pixman_image_get_height(so->cache_image) != height) {
+		if (so->cache_image)
+			pixman_image_unref(so->cache_image);
+
+		so->cache_image =
+			pixman_image_create_bits(PIXMAN_a8r8g8b8,
+						 width, height, NULL,
+						 width * 4);
+		if (!so->cache_image) {
+			pixman_region32_fini(&damage);
+			return -1;
+		}
+
+		pixman_region32_fini(&damage);
+		pixman_region32_init_rect(&damage, 0, 0, width, height);
 	}
 
-	output_compute_transform(so->output, &transform);
+	if (shared_output_ensure_tmp_data_for(so, &damage) < 0) {
+		pixman_region32_fini(&damage);
+		return -1;
+	}
+
+	r = pixman_region32_rectangles(&damage, &nrects);
+	for (i = 0; i < nrects; ++i)
+		shared_output_read_rect(so, &r[i],
+					pixman_image_get_data(so->cache_image),
+					width);
+
+	pixman_region32_fini(&damage);
+
+	output_compute_transform(output, &transform);
 	pixman_image_set_transform(so->cache_image, &transform);
 
 	pixman_image_set_clip_region32(sb->pm_image, &sb->damage);
 
-	if (so->output->current_scale == 1) {
+	if (output->current_scale == 1) {
 		pixman_image_set_filter(so->cache_image,
 					PIXMAN_FILTER_NEAREST, NULL, 0);
 	} else {
@@ -632,13 +748,67 @@ shared_output_update(struct shared_output *so)
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
-				 so->output->width, /* width */
-				 so->output->height /* height */);
+				 output->width, /* width */
+				 output->height /* height */);
 
 	pixman_image_set_transform(sb->pm_image, NULL);
 	pixman_image_set_clip_region32(sb->pm_image, NULL);
 
-	r = pixman_region32_rectangles(&sb->damage, &nrects);
+	return 0;
+}
+
+static void
+shared_output_frame_callback(void *data, struct wl_callback *cb, uint32_t time)
+{
+	struct shared_output *so = data;
+
+	if (cb != so->parent.frame_cb)
+		return;
+
+	wl_callback_destroy(cb);
+	so->parent.frame_cb = NULL;
+
+	/* Pixels can only be read back while repainting */
+	if (pixman_region32_not_empty(&so->damage))
+		weston_output_schedule_repaint(so->output);
+}
+
+static const struct wl_callback_listener shared_output_frame_listener = {
+	shared_output_frame_callback
+};
+
+/* Called from the output frame signal, with the output contents
+ * ready to be read back. */
+static void
+shared_output_update(struct shared_output *so)
+{
+	struct weston_output *output = so->output;
+	struct ss_shm_buffer *sb;
+	pixman_box32_t *r;
+	int i, nrects, ret;
+
+	/* Only update if we need to */
+	if (!pixman_region32_not_empty(&so->damage) || so->parent.frame_cb)
+		return;
+
+	sb = shared_output_get_shm_buffer(so);
+	if (sb == NULL) {
+		shared_output_destroy(so);
+		return;
+	}
+
+	if (output->transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+	    output->current_scale == 1)
+		ret = shared_output_read_direct(so, sb);
+	else
+		ret = shared_output_read_cached(so, sb);
+
+	if (ret < 0) {
+		shared_output_destroy(so);
+		return;
+	}
+
+	r = pixman_region32_rectangles(&so->damage, &nrects);
 	for (i = 0; i < nrects; ++i)
 		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
 				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
@@ -650,12 +820,11 @@ shared_output_update(struct shared_output *so)
 				 &shared_output_frame_listener, so);
 
 	wl_surface_commit(so->parent.surface);
-	wl_callback_destroy(wl_display_sync(so->parent.display));
 	wl_display_flush(so->parent.display);
 
 	/* Clear the buffer damage */
-	pixman_region32_fini(&sb->damage);
-	pixman_region32_init(&sb->damage);
+	pixman_region32_clear(&sb->damage);
+	pixman_region32_clear(&so->damage);
 }
 
 static void
@@ -775,10 +944,6 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		container_of(listener, struct shared_output, frame_listener);
 	pixman_region32_t damage;
 	struct ss_shm_buffer *sb;
-	int32_t x, y, width, height, stride;
-	int i, nrects, do_yflip;
-	pixman_box32_t *r;
-	uint32_t *cache_data;
 
 	/* Damage in output coordinates */
 	pixman_region32_init(&damage);
@@ -789,73 +954,10 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 	/* Apply damage to all buffers */
 	wl_list_for_each(sb, &so->shm.buffers, link)
 		pixman_region32_union(&sb->damage, &sb->damage, &damage);
-
-	/* Transform to buffer coordinates */
-	weston_transformed_region(so->output->width, so->output->height,
-				  so->output->transform,
-				  so->output->current_scale,
-				  &damage, &damage);
-
-	width = so->output->current_mode->width;
-	height = so->output->current_mode->height;
-	stride = width;
-
-	if (!so->cache_image ||
-	    pixman_image_get_width(so->cache_image) != width ||
-	    pixman_image_get_height(so->cache_image) != height) {
-		if (so->cache_image)
-			pixman_image_unref(so->cache_image);
-
-		so->cache_image =
-			pixman_image_create_bits(PIXMAN_a8r8g8b8,
-						 width, height, NULL,
-						 stride);
-		if (!so->cache_image) {
-			shared_output_destroy(so);
-			return;
-		}
-
-		pixman_region32_fini(&damage);
-		pixman_region32_init_rect(&damage, 0, 0, width, height);
-	}
-
-	if (shared_output_ensure_tmp_data(so, &damage) < 0) {
-		shared_output_destroy(so);
-		return;
-	}
-
-	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-
-	cache_data = pixman_image_get_data(so->cache_image);
-	r = pixman_region32_rectangles(&damage, &nrects);
-	for (i = 0; i < nrects; ++i) {
-		x = r[i].x1;
-		y = r[i].y1;
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
-
-		if (do_yflip) {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, so->output->current_mode->height - r[i].y2,
-				width, height);
-
-			pixman_blt(so->tmp_data, cache_data, -width, stride,
-				   32, 32, 0, 1 - height, x, y, width, height);
-		} else {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, y, width, height);
-
-			pixman_blt(so->tmp_data, cache_data, width, stride,
-				   32, 32, 0, 0, x, y, width, height);
-		}
-	}
+	pixman_region32_union(&so->damage, &so->damage, &damage);
 
 	pixman_region32_fini(&damage);
 
-	so->cache_dirty = 1;
-
 	shared_output_update(so);
 }
 
@@ -939,6 +1041,8 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
+	pixman_region32_init_rect(&so->damage, 0, 0,
+				  output->width, output->height);
 
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
@@ -980,8 +1084,10 @@ shared_output_destroy(struct shared_output *so)
 	wl_list_remove(&so->output_destroyed.link);
 	wl_list_remove(&so->frame_listener.link);
 
-	pixman_image_unref(so->cache_image);
+	if (so->cache_image)
+		pixman_image_unref(so->cache_image);
 	free(so->tmp_data);
+	pixman_region32_fini(&so->damage);
 
 	free(so);
 }
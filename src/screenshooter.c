@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -32,6 +34,8 @@
 
 #include "compositor.h"
 #include "screenshooter-server-protocol.h"
+#include "wcap-encoder.h"
+#include "worker-pool.h"
 
 #include "../wcap/wcap-decode.h"
 
@@ -304,49 +308,244 @@ screenshooter_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
 	free(screenshooter_exe);
 }
 
+/* Frames are encoded and written out by a separate thread so that
+ * recording does not hold up the repaint loop. When it falls behind
+ * by this many frames, the compositor waits for it. */
+#define RECORDER_QUEUE_LENGTH 4
+
+/* Damage rectangles are split in bands of about this many pixels,
+ * which are encoded in parallel. */
+#define RECORDER_BAND_PIXELS (64 * 1024)
+
+struct recorder_frame {
+	uint32_t msecs;
+	pixman_box32_t *rects;
+	int nrects, rects_size;
+	uint32_t *data;		/* pixels of every rectangle, one after
+				 * the other, then encoded in place */
+	size_t data_size;
+};
+
+struct recorder_band {
+	uint32_t *data;
+	int x1, x2, y, ystep, rows;
+};
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
+	uint32_t *frame;
+	int stride, yflip;
 	uint32_t total;
+	int write_error;
 	int fd;
 	struct wl_listener frame_listener;
 	int count, destroying;
+
+	/* Only used by the recorder thread and the worker pool */
+	struct worker_pool *pool;
+	struct recorder_band *bands;
+	struct wcap_band *encoded;
+	int bands_size;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct recorder_frame queue[RECORDER_QUEUE_LENGTH];
+	int head, queued, quit;
 };
 
-static uint32_t *
-output_run(uint32_t *p, uint32_t delta, int run)
+static void
+weston_recorder_destroy(struct weston_recorder *recorder);
+
+static int
+recorder_frame_reserve(struct recorder_frame *frame, int nrects,
+		       size_t pixels)
 {
-	int i;
+	pixman_box32_t *rects;
+	uint32_t *data;
+
+	if (nrects > frame->rects_size) {
+		rects = realloc(frame->rects, nrects * sizeof *rects);
+		if (!rects)
+			return -1;
+		frame->rects = rects;
+		frame->rects_size = nrects;
+	}
 
-	while (run > 0) {
-		if (run <= 0xe0) {
-			*p++ = delta | ((run - 1) << 24);
-			break;
+	if (pixels > frame->data_size) {
+		data = realloc(frame->data, pixels * sizeof *data);
+		if (!data)
+			return -1;
+		frame->data = data;
+		frame->data_size = pixels;
+	}
+
+	return 0;
+}
+
+static void
+recorder_encode_band(void *data, int index)
+{
+	struct weston_recorder *recorder = data;
+	struct recorder_band *band = &recorder->bands[index];
+
+	wcap_encode_band(&recorder->encoded[index], band->data, band->data,
+			 recorder->frame, recorder->stride,
+			 band->x1, band->x2, band->y, band->ystep, band->rows);
+}
+
+static int
+recorder_split_bands(struct weston_recorder *recorder,
+		     struct recorder_frame *frame)
+{
+	struct recorder_band *band;
+	struct wcap_band *encoded;
+	pixman_box32_t *r;
+	uint32_t *data = frame->data;
+	int i, j, width, height, rows, count = 0, size;
+
+	for (i = 0; i < frame->nrects; i++) {
+		r = &frame->rects[i];
+		width = r->x2 - r->x1;
+		height = r->y2 - r->y1;
+		rows = MAX(RECORDER_BAND_PIXELS / width, 1);
+
+		for (j = 0; j < height; j += rows) {
+			if (count == recorder->bands_size) {
+				size = recorder->bands_size * 2 + 16;
+				band = realloc(recorder->bands,
+					       size * sizeof *band);
+				if (!band)
+					return -1;
+				recorder->bands = band;
+
+				encoded = realloc(recorder->encoded,
+						  size * sizeof *encoded);
+				if (!encoded)
+					return -1;
+				recorder->encoded = encoded;
+				recorder->bands_size = size;
+			}
+
+			band = &recorder->bands[count++];
+			band->data = data + j * width;
+			band->x1 = r->x1;
+			band->x2 = r->x2;
+			band->rows = MIN(rows, height - j);
+			if (recorder->yflip) {
+				band->y = r->y2 - j - 1;
+				band->ystep = -1;
+			} else {
+				band->y = r->y1 + j;
+				band->ystep = 1;
+			}
 		}
 
-		i = 24 - __builtin_clz(run);
-		*p++ = delta | ((i + 0xe0) << 24);
-		run -= 1 << (7 + i);
+		data += width * height;
 	}
 
-	return p;
+	return count;
 }
 
-static uint32_t
-component_delta(uint32_t next, uint32_t prev)
+static void
+recorder_write(struct weston_recorder *recorder, struct iovec *v, int count)
 {
-	unsigned char dr, dg, db;
-
-	dr = (next >> 16) - (prev >> 16);
-	dg = (next >>  8) - (prev >>  8);
-	db = (next >>  0) - (prev >>  0);
+	ssize_t len;
+
+	while (count > 0 && !recorder->write_error) {
+		len = writev(recorder->fd, v, count);
+		if (len < 0) {
+			if (errno != EINTR)
+				recorder->write_error = errno;
+			continue;
+		}
 
-	return (dr << 16) | (dg << 8) | (db << 0);
+		recorder->total += len;
+		while (count > 0 && (size_t) len >= v->iov_len) {
+			len -= v->iov_len;
+			v++;
+			count--;
+		}
+		if (count > 0) {
+			v->iov_base = (char *) v->iov_base + len;
+			v->iov_len -= len;
+		}
+	}
 }
 
 static void
-weston_recorder_destroy(struct weston_recorder *recorder);
+recorder_write_frame(struct weston_recorder *recorder,
+		     struct recorder_frame *frame)
+{
+	struct {
+		uint32_t msecs;
+		uint32_t nrects;
+	} header;
+	struct iovec v[3];
+	uint32_t *p;
+	int i, j, nbands, height, rows;
+
+	nbands = recorder_split_bands(recorder, frame);
+	if (nbands < 0) {
+		recorder->write_error = ENOMEM;
+		return;
+	}
+
+	worker_pool_run(recorder->pool, nbands,
+			recorder_encode_band, recorder);
+
+	/* Join the bands of every rectangle, packing the encoded
+	 * rectangles one after the other at the start of the frame. */
+	p = frame->data;
+	for (i = 0, j = 0; i < frame->nrects; i++) {
+		height = frame->rects[i].y2 - frame->rects[i].y1;
+		rows = MAX(RECORDER_BAND_PIXELS /
+			   (frame->rects[i].x2 - frame->rects[i].x1), 1);
+		nbands = (height + rows - 1) / rows;
+		p = wcap_encode_join(p, &recorder->encoded[j], nbands);
+		j += nbands;
+	}
+
+	header.msecs = frame->msecs;
+	header.nrects = frame->nrects;
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_base = frame->rects;
+	v[1].iov_len = frame->nrects * sizeof *frame->rects;
+	v[2].iov_base = frame->data;
+	v[2].iov_len = (p - frame->data) * sizeof *p;
+	recorder_write(recorder, v, 3);
+}
+
+static void *
+recorder_thread(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct recorder_frame *frame;
+
+	pthread_mutex_lock(&recorder->mutex);
+	for (;;) {
+		while (recorder->queued == 0 && !recorder->quit)
+			pthread_cond_wait(&recorder->cond, &recorder->mutex);
+
+		/* Drain the queue before quitting */
+		if (recorder->queued == 0)
+			break;
+
+		frame = &recorder->queue[recorder->head];
+		pthread_mutex_unlock(&recorder->mutex);
+
+		recorder_write_frame(recorder, frame);
+
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->head = (recorder->head + 1) % RECORDER_QUEUE_LENGTH;
+		recorder->queued--;
+		pthread_cond_broadcast(&recorder->cond);
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return NULL;
+}
 
 static void
 weston_recorder_frame_notify(struct wl_listener *listener, void *data)
@@ -355,25 +554,13 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = output->frame_time;
+	struct recorder_frame *frame;
 	pixman_box32_t *r;
 	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
+	int i, n, width, height;
+	size_t pixels;
+	uint32_t *p;
 	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
 
 	pixman_region32_init(&damage);
 	pixman_region32_init(&transformed_damage);
@@ -386,74 +573,57 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 	pixman_region32_fini(&damage);
 
 	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
+	if (n == 0)
+		goto out;
+
+	pixels = 0;
+	for (i = 0; i < n; i++)
+		pixels += (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	pthread_mutex_lock(&recorder->mutex);
+	while (recorder->queued == RECORDER_QUEUE_LENGTH)
+		pthread_cond_wait(&recorder->cond, &recorder->mutex);
+	frame = &recorder->queue[(recorder->head + recorder->queued) %
+				 RECORDER_QUEUE_LENGTH];
+	pthread_mutex_unlock(&recorder->mutex);
+
+	if (recorder_frame_reserve(frame, n, pixels) < 0) {
+		/* The encoder only sees damaged pixels, so have the next
+		 * frame bring it up to date */
+		weston_log("%s: out of memory, dropping frame\n", __func__);
+		weston_output_damage(output);
+		goto out;
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	frame->msecs = output->frame_time;
+	frame->nrects = n;
+	memcpy(frame->rects, r, n * sizeof *r);
 
+	p = frame->data;
 	for (i = 0; i < n; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
+		if (recorder->yflip)
 			y_orig = output->current_mode->height - r[i].y2;
 		else
 			y_orig = r[i].y1;
 
 		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
+				compositor->read_format, p,
 				r[i].x1, y_orig, width, height);
+		p += width * height;
+	}
 
-		s = recorder->rect;
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				y_orig = r[i].y2 - j - 1;
-			else
-				y_orig = r[i].y1 + j;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
-		}
-
-		p = output_run(p, prev, run);
-
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->queued++;
+	pthread_cond_broadcast(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
 
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
-	}
+	recorder->count++;
 
+out:
 	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
 
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
@@ -462,51 +632,71 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 static void
 weston_recorder_free(struct weston_recorder *recorder)
 {
+	int i;
+
 	if (recorder == NULL)
 		return;
-	free(recorder->rect);
-	free(recorder->tmpbuf);
+
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++) {
+		free(recorder->queue[i].rects);
+		free(recorder->queue[i].data);
+	}
+	worker_pool_destroy(recorder->pool);
+	pthread_cond_destroy(&recorder->cond);
+	pthread_mutex_destroy(&recorder->mutex);
+	free(recorder->bands);
+	free(recorder->encoded);
 	free(recorder->frame);
 	free(recorder);
 }
 
+static int
+recorder_start_thread(struct weston_recorder *recorder)
+{
+	long ncpus;
+	int ret;
+
+	/* The recorder thread takes part in the encoding, so use at
+	 * most three more threads. */
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	recorder->pool = worker_pool_create(MIN(ncpus, 4) - 1);
+
+	ret = worker_thread_create(&recorder->thread,
+				   recorder_thread, recorder);
+
+	return ret == 0 ? 0 : -1;
+}
+
 static void
 weston_recorder_create(struct weston_output *output, const char *filename)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
-	int stride, size;
+	int size;
 	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
-	recorder = malloc(sizeof *recorder);
+	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
 		weston_log("%s: out of memory\n", __func__);
 		return;
 	}
 
-	stride = output->current_mode->width;
-	size = stride * 4 * output->current_mode->height;
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->cond, NULL);
+
+	recorder->yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	recorder->stride = output->current_mode->width;
+	size = recorder->stride * 4 * output->current_mode->height;
 	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
-	recorder->total = 0;
-	recorder->count = 0;
-	recorder->destroying = 0;
 	recorder->output = output;
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	if (recorder->frame == NULL) {
 		weston_log("%s: out of memory\n", __func__);
 		weston_recorder_free(recorder);
 		return;
 	}
 
-	if (do_yflip)
-		recorder->tmpbuf = NULL;
-	else
-		recorder->tmpbuf = malloc(size);
-
 	header.magic = WCAP_HEADER_MAGIC;
 
 	switch (compositor->read_format) {
@@ -536,6 +726,13 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	header.height = output->current_mode->height;
 	recorder->total += write(recorder->fd, &header, sizeof header);
 
+	if (recorder_start_thread(recorder) < 0) {
+		weston_log("failed to start recorder thread\n");
+		close(recorder->fd);
+		weston_recorder_free(recorder);
+		return;
+	}
+
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
 	output->disable_planes++;
@@ -546,6 +743,19 @@ static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
+
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->quit = 1;
+	pthread_cond_broadcast(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+	pthread_join(recorder->thread, NULL);
+
+	weston_log("stopping recorder, total file size %dM, %d frames\n",
+		   recorder->total / (1024 * 1024), recorder->count);
+	if (recorder->write_error)
+		weston_log("recorder failed to write frames: %s\n",
+			   strerror(recorder->write_error));
+
 	close(recorder->fd);
 	recorder->output->disable_planes--;
 	weston_recorder_free(recorder);
@@ -572,10 +782,6 @@ recorder_binding(struct weston_seat *seat, uint32_t time, uint32_t key, void *da
 		recorder = container_of(listener, struct weston_recorder,
 					frame_listener);
 
-		weston_log(
-			"stopping recorder, total file size %dM, %d frames\n",
-			recorder->total / (1024 * 1024), recorder->count);
-
 		recorder->destroying = 1;
 		weston_output_schedule_repaint(recorder->output);
 	} else {
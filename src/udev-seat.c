@@ -79,7 +79,7 @@ device_added(struct udev_device *udev_device, struct udev_input *input)
 		return 0;
 	}
 
-	device = evdev_device_create(&seat->base, devnode, fd);
+	device = evdev_device_create(&seat->base, devnode, fd, input->thread);
 	if (device == EVDEV_UNHANDLED_DEVICE) {
 		weston_launcher_close(c->launcher, fd);
 		weston_log("not using input device '%s'.\n", devnode);
@@ -255,6 +255,7 @@ udev_input_enable(struct udev_input *input)
 	if (udev_monitor_enable_receiving(input->udev_monitor)) {
 		weston_log("udev: failed to bind the udev monitor\n");
 		udev_monitor_unref(input->udev_monitor);
+		input->udev_monitor = NULL;
 		return -1;
 	}
 
@@ -265,6 +266,7 @@ udev_input_enable(struct udev_input *input)
 				     evdev_udev_handler, input);
 	if (!input->udev_monitor_source) {
 		udev_monitor_unref(input->udev_monitor);
+		input->udev_monitor = NULL;
 		return -1;
 	}
 
@@ -313,17 +315,35 @@ int
 udev_input_init(struct udev_input *input, struct weston_compositor *c, struct udev *udev,
 		const char *seat_id)
 {
+	struct weston_config_section *s;
+	int use_thread;
+
 	memset(input, 0, sizeof *input);
 	input->seat_id = strdup(seat_id);
 	input->compositor = c;
 	input->udev = udev;
 	input->udev = udev_ref(udev);
+
+	s = weston_config_get_section(c->config, "core", NULL, NULL);
+	weston_config_section_get_bool(s, "input-thread", &use_thread, 0);
+	if (use_thread) {
+		input->thread = evdev_input_thread_create(c);
+		if (input->thread)
+			weston_log("reading input devices on a separate thread\n");
+		else
+			weston_log("failed to start input thread, "
+				   "reading input on the main loop\n");
+	}
+
 	if (udev_input_enable(input) < 0)
 		goto err;
 
 	return 0;
 
  err:
+	/* Devices that did get added may be read on the input thread */
+	udev_input_disable(input);
+	evdev_input_thread_destroy(input->thread);
 	free(input->seat_id);
 	return -1;
 }
@@ -335,6 +355,7 @@ udev_input_destroy(struct udev_input *input)
 	udev_input_disable(input);
 	wl_list_for_each_safe(seat, next, &input->compositor->seat_list, base.link)
 		udev_seat_destroy(seat);
+	evdev_input_thread_destroy(input->thread);
 	udev_unref(input->udev);
 	free(input->seat_id);
 }
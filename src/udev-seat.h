@@ -41,6 +41,7 @@ struct udev_input {
 	struct wl_event_source *udev_monitor_source;
 	char *seat_id;
 	struct weston_compositor *compositor;
+	struct evdev_input_thread *thread;
 	int enabled;
 };
 
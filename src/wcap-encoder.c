@@ -0,0 +1,319 @@
+/*
+ * Copyright © 2008-2011 Kristian Høgsberg
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_AVX2_ENCODER 1
+#include <immintrin.h>
+#endif
+
+#include "wcap-encoder.h"
+
+/* Deltas are computed a chunk of pixels at a time, then scanned for
+ * runs. */
+#define CHUNK_SIZE 64
+
+static uint32_t *
+output_run(uint32_t *p, uint32_t delta, int run)
+{
+	int i;
+
+	while (run > 0) {
+		if (run <= 0xe0) {
+			*p++ = delta | ((run - 1) << 24);
+			break;
+		}
+
+		i = 24 - __builtin_clz(run);
+		*p++ = delta | ((i + 0xe0) << 24);
+		run -= 1 << (7 + i);
+	}
+
+	return p;
+}
+
+/* The per-channel difference is a byte-wise subtraction, alpha is
+ * dropped. */
+static void
+component_delta_c(uint32_t *delta, const uint32_t *next, uint32_t *prev,
+		  int n)
+{
+	unsigned char dr, dg, db;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		dr = (next[i] >> 16) - (prev[i] >> 16);
+		dg = (next[i] >>  8) - (prev[i] >>  8);
+		db = (next[i] >>  0) - (prev[i] >>  0);
+		delta[i] = (dr << 16) | (dg << 8) | (db << 0);
+		prev[i] = next[i];
+	}
+}
+
+/* Returns how many of the n deltas equal 'value', from the start */
+static int
+count_equal_c(const uint32_t *delta, int n, uint32_t value)
+{
+	int i;
+
+	for (i = 0; i < n && delta[i] == value; i++)
+		;
+
+	return i;
+}
+
+#ifdef __SSE2__
+static void
+component_delta_sse2(uint32_t *delta, const uint32_t *next, uint32_t *prev,
+		     int n)
+{
+	const __m128i mask = _mm_set1_epi32(0x00ffffff);
+	__m128i a, b;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = _mm_loadu_si128((const __m128i *) (next + i));
+		b = _mm_loadu_si128((const __m128i *) (prev + i));
+		_mm_storeu_si128((__m128i *) (delta + i),
+				 _mm_and_si128(_mm_sub_epi8(a, b), mask));
+		_mm_storeu_si128((__m128i *) (prev + i), a);
+	}
+
+	component_delta_c(delta + i, next + i, prev + i, n - i);
+}
+
+static int
+count_equal_sse2(const uint32_t *delta, int n, uint32_t value)
+{
+	const __m128i v = _mm_set1_epi32(value);
+	__m128i d;
+	int i, mask;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		d = _mm_loadu_si128((const __m128i *) (delta + i));
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi32(d, v)) ^ 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask) / 4;
+	}
+
+	return i + count_equal_c(delta + i, n - i, value);
+}
+#endif
+
+#ifdef HAVE_AVX2_ENCODER
+__attribute__((target("avx2")))
+static void
+component_delta_avx2(uint32_t *delta, const uint32_t *next, uint32_t *prev,
+		     int n)
+{
+	const __m256i mask = _mm256_set1_epi32(0x00ffffff);
+	__m256i a, b;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm256_loadu_si256((const __m256i *) (next + i));
+		b = _mm256_loadu_si256((const __m256i *) (prev + i));
+		_mm256_storeu_si256((__m256i *) (delta + i),
+				    _mm256_and_si256(_mm256_sub_epi8(a, b),
+						     mask));
+		_mm256_storeu_si256((__m256i *) (prev + i), a);
+	}
+
+	component_delta_c(delta + i, next + i, prev + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int
+count_equal_avx2(const uint32_t *delta, int n, uint32_t value)
+{
+	const __m256i v = _mm256_set1_epi32(value);
+	__m256i d;
+	uint32_t mask;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		d = _mm256_loadu_si256((const __m256i *) (delta + i));
+		mask = ~(uint32_t)
+			_mm256_movemask_epi8(_mm256_cmpeq_epi32(d, v));
+		if (mask)
+			return i + __builtin_ctz(mask) / 4;
+	}
+
+	return i + count_equal_c(delta + i, n - i, value);
+}
+#endif
+
+struct encoder_funcs {
+	void (*component_delta)(uint32_t *delta, const uint32_t *next,
+				uint32_t *prev, int n);
+	int (*count_equal)(const uint32_t *delta, int n, uint32_t value);
+};
+
+static void
+get_encoder_funcs(struct encoder_funcs *funcs)
+{
+#ifdef HAVE_AVX2_ENCODER
+	if (__builtin_cpu_supports("avx2")) {
+		funcs->component_delta = component_delta_avx2;
+		funcs->count_equal = count_equal_avx2;
+		return;
+	}
+#endif
+#ifdef __SSE2__
+	funcs->component_delta = component_delta_sse2;
+	funcs->count_equal = count_equal_sse2;
+#else
+	funcs->component_delta = component_delta_c;
+	funcs->count_equal = count_equal_c;
+#endif
+}
+
+void
+wcap_encode_band(struct wcap_band *band, uint32_t *out, const uint32_t *src,
+		 uint32_t *frame, int stride,
+		 int x1, int x2, int y, int ystep, int rows)
+{
+	struct encoder_funcs funcs;
+	uint32_t delta[CHUNK_SIZE];
+	uint32_t prev = 0, *p = out, *d;
+	int width = x2 - x1, run = 0, have_head = 0;
+	int i, j, k, m, n;
+
+	get_encoder_funcs(&funcs);
+
+	for (j = 0; j < rows; j++, y += ystep) {
+		d = frame + stride * y + x1;
+
+		for (k = 0; k < width; k += n) {
+			n = width - k < CHUNK_SIZE ? width - k : CHUNK_SIZE;
+			funcs.component_delta(delta, src, d + k, n);
+			src += n;
+
+			i = 0;
+			if (run == 0) {
+				prev = delta[0];
+				run = 1;
+				i = 1;
+			}
+
+			for (; i < n; i++) {
+				/* Only look for long runs once there is one */
+				if (delta[i] == prev) {
+					m = funcs.count_equal(delta + i, n - i,
+							      prev);
+					run += m;
+					i += m - 1;
+					continue;
+				}
+
+				/* The run of 'prev' ends here. The first
+				 * one of the band stays open, and the
+				 * pixels it covers leave room for the
+				 * runs that follow. */
+				if (!have_head) {
+					band->head_delta = prev;
+					band->head_run = run;
+					have_head = 1;
+					p = out + run;
+				} else {
+					p = output_run(p, prev, run);
+				}
+
+				prev = delta[i];
+				run = 1;
+			}
+		}
+	}
+
+	if (!have_head) {
+		band->head_delta = prev;
+		band->head_run = run;
+		band->tail_delta = 0;
+		band->tail_run = 0;
+		p = out + run;
+	} else {
+		band->tail_delta = prev;
+		band->tail_run = run;
+	}
+
+	band->start = out + band->head_run;
+	band->end = p;
+}
+
+uint32_t *
+wcap_encode_join(uint32_t *p, const struct wcap_band *bands, int count)
+{
+	const struct wcap_band *band;
+	uint32_t delta = 0;
+	size_t length;
+	int i, run = 0;
+
+	for (i = 0; i < count; i++) {
+		band = &bands[i];
+
+		if (run > 0 && band->head_delta != delta) {
+			p = output_run(p, delta, run);
+			run = 0;
+		}
+		delta = band->head_delta;
+		run += band->head_run;
+
+		if (band->tail_run == 0)
+			continue;
+
+		p = output_run(p, delta, run);
+		length = band->end - band->start;
+		memmove(p, band->start, length * sizeof *p);
+		p += length;
+
+		delta = band->tail_delta;
+		run = band->tail_run;
+	}
+
+	return output_run(p, delta, run);
+}
+
+uint32_t *
+wcap_encode_rect(uint32_t *out, const uint32_t *src,
+		 uint32_t *frame, int stride,
+		 int x1, int y1, int x2, int y2, int yflip)
+{
+	struct wcap_band band;
+
+	if (yflip)
+		wcap_encode_band(&band, out, src, frame, stride,
+				 x1, x2, y2 - 1, -1, y2 - y1);
+	else
+		wcap_encode_band(&band, out, src, frame, stride,
+				 x1, x2, y1, 1, y2 - y1);
+
+	return wcap_encode_join(out, &band, 1);
+}
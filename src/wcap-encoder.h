@@ -0,0 +1,69 @@
+/*
+ * Copyright © 2008-2011 Kristian Høgsberg
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef WESTON_WCAP_ENCODER_H
+#define WESTON_WCAP_ENCODER_H
+
+#include <stdint.h>
+
+/* Run-length encodes the per-channel difference between the pixels in
+ * 'src', 'x2 - x1' by 'y2 - y1' tightly packed rows, and the same
+ * rectangle of 'frame', a full frame with 'stride' pixels per row.
+ * The rectangle of 'frame' is updated to the new contents. When
+ * 'yflip' is set, the rows of 'src' are bottom-up.
+ *
+ * The encoded data never takes more words than there are pixels and
+ * is never written ahead of the pixel being read, so 'out' may be
+ * 'src'. Returns the end of the encoded data written to 'out'. */
+uint32_t *
+wcap_encode_rect(uint32_t *out, const uint32_t *src,
+		 uint32_t *frame, int stride,
+		 int x1, int y1, int x2, int y2, int yflip);
+
+/* A rectangle can also be encoded as several bands of rows, possibly
+ * in parallel. The first and the last run of a band may continue into
+ * the neighbouring bands, so they are left open; only the runs in
+ * between are encoded, in [start, end). */
+struct wcap_band {
+	uint32_t head_delta, tail_delta;
+	int head_run, tail_run;		/* tail_run is 0 for a single run */
+	uint32_t *start, *end;
+};
+
+/* Encodes 'rows' rows of 'x2 - x1' pixels from 'src', the first one
+ * going to row 'y' of 'frame' and the following ones 'ystep' rows
+ * apart. 'out' may be 'src', as above. */
+void
+wcap_encode_band(struct wcap_band *band, uint32_t *out, const uint32_t *src,
+		 uint32_t *frame, int stride,
+		 int x1, int x2, int y, int ystep, int rows);
+
+/* Writes out the runs of consecutive bands of one rectangle, merging
+ * the runs that continue across bands, and returns the end of the
+ * encoded data. The result is identical to what wcap_encode_rect()
+ * produces. 'p' may be at most the 'out' of the first band, so bands
+ * encoded next to each other in one buffer can be joined in place. */
+uint32_t *
+wcap_encode_join(uint32_t *p, const struct wcap_band *bands, int count);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#include "weston-test-client-helper.h"
+#include "weston-bench.h"
+
+/* Client side benchmarks, run with the headless backend in uncapped
+ * mode so that frame callbacks are not throttled to the refresh rate:
+ * see "make bench". */
+
+#define NUM_CLIENTS 8
+#define COMMIT_FRAMES 300
+#define DAMAGE_SIZE 64
+
+#define TREE_DEPTH 32
+#define TREE_FRAMES 300
+
+static struct wl_subcompositor *
+get_subcompositor(struct client *client)
+{
+	struct global *g;
+	struct global *global_sub = NULL;
+	struct wl_subcompositor *sub;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, "wl_subcompositor"))
+			continue;
+
+		global_sub = g;
+	}
+
+	assert(global_sub && "no wl_subcompositor found");
+
+	sub = wl_registry_bind(client->wl_registry, global_sub->name,
+			       &wl_subcompositor_interface, 1);
+	assert(sub);
+
+	return sub;
+}
+
+static void
+damage_and_commit(struct surface *surface, int frame, int *done)
+{
+	int x, y, i;
+	uint32_t *p;
+
+	x = (frame * 16) % (surface->width - DAMAGE_SIZE);
+	y = (frame * 8) % (surface->height - DAMAGE_SIZE);
+
+	for (i = 0; i < DAMAGE_SIZE; i++) {
+		p = (uint32_t *) surface->data +
+			(y + i) * surface->width + x;
+		memset(p, frame & 0xff, DAMAGE_SIZE * sizeof *p);
+	}
+
+	wl_surface_attach(surface->wl_surface, surface->wl_buffer, 0, 0);
+	wl_surface_damage(surface->wl_surface, x, y,
+			  DAMAGE_SIZE, DAMAGE_SIZE);
+	if (done)
+		frame_callback_set(surface->wl_surface, done);
+	wl_surface_commit(surface->wl_surface);
+}
+
+TEST(shm_commit_clients)
+{
+	struct client *clients[NUM_CLIENTS];
+	int done[NUM_CLIENTS];
+	char name[64];
+	uint64_t start;
+	int i, frame;
+
+	for (i = 0; i < NUM_CLIENTS; i++)
+		clients[i] = client_create(i * 40, i * 30, 256, 256);
+
+	start = bench_now();
+	for (frame = 0; frame < COMMIT_FRAMES; frame++) {
+		for (i = 0; i < NUM_CLIENTS; i++) {
+			damage_and_commit(clients[i]->surface, frame, &done[i]);
+			wl_display_flush(clients[i]->wl_display);
+		}
+
+		for (i = 0; i < NUM_CLIENTS; i++)
+			frame_callback_wait(clients[i], &done[i]);
+	}
+
+	snprintf(name, sizeof name, "shm-commit-%d-clients", NUM_CLIENTS);
+	bench_report(name, COMMIT_FRAMES, bench_now() - start);
+}
+
+TEST(subsurface_tree_commit)
+{
+	struct client *client;
+	struct wl_subcompositor *subco;
+	struct wl_surface *parent;
+	struct wl_subsurface *sub[TREE_DEPTH];
+	struct surface child[TREE_DEPTH];
+	char name[64];
+	uint64_t start;
+	int i, frame, done;
+
+	client = client_create(0, 0, 256, 256);
+	subco = get_subcompositor(client);
+
+	/* A chain of synchronized sub-surfaces, each one the parent of
+	 * the next, so that every commit of the root cascades down the
+	 * whole tree. */
+	parent = client->surface->wl_surface;
+	for (i = 0; i < TREE_DEPTH; i++) {
+		memset(&child[i], 0, sizeof child[i]);
+		child[i].width = 128;
+		child[i].height = 128;
+		child[i].wl_surface =
+			wl_compositor_create_surface(client->wl_compositor);
+		child[i].wl_buffer = create_shm_buffer(client, 128, 128,
+						       &child[i].data);
+		sub[i] = wl_subcompositor_get_subsurface(subco,
+							 child[i].wl_surface,
+							 parent);
+		wl_subsurface_set_position(sub[i], 4, 4);
+		parent = child[i].wl_surface;
+	}
+
+	start = bench_now();
+	for (frame = 0; frame < TREE_FRAMES; frame++) {
+		damage_and_commit(&child[frame % TREE_DEPTH], frame, NULL);
+		for (i = TREE_DEPTH - 1; i >= 0; i--)
+			wl_surface_commit(child[i].wl_surface);
+
+		frame_callback_set(client->surface->wl_surface, &done);
+		wl_surface_commit(client->surface->wl_surface);
+		frame_callback_wait(client, &done);
+	}
+
+	snprintf(name, sizeof name, "subsurface-tree-%d-commit", TREE_DEPTH);
+	bench_report(name, TREE_FRAMES, bench_now() - start);
+}
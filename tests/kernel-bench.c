@@ -0,0 +1,174 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "weston-bench.h"
+
+#include "../shared/matrix.h"
+#include "../src/vertex-clipping.h"
+#include "../src/wcap-encoder.h"
+
+#define WCAP_WIDTH 1024
+#define WCAP_HEIGHT 768
+
+static volatile float sink;
+
+static void
+bench_matrix_invert(void)
+{
+	struct weston_matrix m[16], inverse;
+	const int iterations = 1000000;
+	uint64_t start;
+	float angle;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		angle = i * M_PI / 8.0;
+		weston_matrix_init(&m[i]);
+		weston_matrix_translate(&m[i], -128.0f, -96.0f, 0.0f);
+		weston_matrix_rotate_xy(&m[i], cosf(angle), sinf(angle));
+		weston_matrix_scale(&m[i], 1.0f + i / 16.0f, 2.0f, 1.0f);
+		weston_matrix_translate(&m[i], 10.0f * i, 300.0f, 0.0f);
+	}
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		weston_matrix_invert(&inverse, &m[i & 15]);
+		sink += inverse.d[12];
+	}
+	bench_report("matrix-invert", iterations, bench_now() - start);
+}
+
+static void
+bench_clip_transformed(void)
+{
+	struct clip_context ctx;
+	struct polygon8 polygon[16];
+	float ex[8], ey[8], angle;
+	const int iterations = 1000000;
+	uint64_t start;
+	int i, j, n = 0;
+
+	/* Quads rotated around the corner of the clip box, so that every
+	 * one of them needs actual clipping. */
+	for (i = 0; i < 16; i++) {
+		angle = i * M_PI / 8.0 + 0.1f;
+		polygon[i].n = 4;
+		for (j = 0; j < 4; j++) {
+			polygon[i].x[j] = 100.0f +
+				80.0f * cosf(angle + j * M_PI / 2.0);
+			polygon[i].y[j] = 100.0f +
+				80.0f * sinf(angle + j * M_PI / 2.0);
+		}
+	}
+
+	ctx.clip.x1 = 50.0f;
+	ctx.clip.y1 = 50.0f;
+	ctx.clip.x2 = 150.0f;
+	ctx.clip.y2 = 150.0f;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++)
+		n += clip_transformed(&ctx, &polygon[i & 15], ex, ey);
+	bench_report("clip-transformed", iterations, bench_now() - start);
+
+	sink += n;
+}
+
+static void
+fill_desktop(uint32_t *p, int frame)
+{
+	int x, y;
+
+	/* Mostly flat areas with a few edges, like a desktop */
+	for (y = 0; y < WCAP_HEIGHT; y++)
+		for (x = 0; x < WCAP_WIDTH; x++)
+			*p++ = ((x + frame * 8) / 64 + y / 48) & 1 ?
+				0xff3465a4 : 0xffeeeeec;
+}
+
+static void
+fill_noise(uint32_t *p, int frame)
+{
+	uint32_t seed = 0x12345678 + frame;
+	int i;
+
+	for (i = 0; i < WCAP_WIDTH * WCAP_HEIGHT; i++) {
+		seed = seed * 1103515245 + 12345;
+		*p++ = 0xff000000 | (seed >> 8);
+	}
+}
+
+static void
+bench_wcap_encode(const char *name, void (*fill)(uint32_t *p, int frame))
+{
+	const int size = WCAP_WIDTH * WCAP_HEIGHT;
+	const int iterations = 100;
+	uint32_t *src[2], *frame, *out, *end;
+	uint64_t start, encoded = 0;
+	int i;
+
+	src[0] = malloc(size * sizeof *src[0]);
+	src[1] = malloc(size * sizeof *src[1]);
+	frame = calloc(size, sizeof *frame);
+	out = malloc(size * sizeof *out);
+	if (!src[0] || !src[1] || !frame || !out) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fill(src[0], 0);
+	fill(src[1], 1);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		end = wcap_encode_rect(out, src[i & 1], frame, WCAP_WIDTH,
+				       0, 0, WCAP_WIDTH, WCAP_HEIGHT, 0);
+		encoded += end - out;
+	}
+	bench_report(name, iterations, bench_now() - start);
+
+	sink += encoded;
+
+	free(src[0]);
+	free(src[1]);
+	free(frame);
+	free(out);
+}
+
+int
+main(int argc, char *argv[])
+{
+	bench_matrix_invert();
+	bench_clip_transformed();
+	bench_wcap_encode("wcap-encode-desktop", fill_desktop);
+	bench_wcap_encode("wcap-encode-noise", fill_noise);
+
+	return 0;
+}
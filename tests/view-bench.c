@@ -0,0 +1,176 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "../src/compositor.h"
+#include "weston-bench.h"
+
+/* Repaints a stack of overlapping translucent views, damaging all of
+ * them every frame, then feeds a storm of relative motion events
+ * through notify_motion(). Run with the pixman renderer, e.g. with
+ * "weston --backend=headless-backend.so --use-pixman --uncapped", as
+ * frames are counted through the output frame signal. */
+
+#define VIEW_COUNT 64
+#define WARMUP_FRAMES 10
+#define BENCH_FRAMES 300
+#define MOTION_EVENTS 200000
+
+struct view_bench {
+	struct weston_compositor *compositor;
+	struct weston_layer layer;
+	struct weston_surface *surfaces[VIEW_COUNT];
+	struct weston_view *views[VIEW_COUNT];
+	struct wl_listener frame_listener;
+	int frames;
+	uint64_t start;
+};
+
+static void
+motion_storm(struct view_bench *bench)
+{
+	struct weston_seat *seat;
+	uint64_t start;
+	wl_fixed_t dx, dy;
+	uint32_t time = 0;
+	int i;
+
+	seat = container_of(bench->compositor->seat_list.next,
+			    struct weston_seat, link);
+	assert(seat->pointer);
+
+	/* Sweep back and forth diagonally across the view stack */
+	start = bench_now();
+	for (i = 0; i < MOTION_EVENTS; i++) {
+		dx = wl_fixed_from_int((i / 512) & 1 ? -1 : 1);
+		dy = wl_fixed_from_double((i / 256) & 1 ? -0.75 : 0.75);
+		notify_motion(seat, time++, dx, dy);
+	}
+	bench_report("notify-motion", MOTION_EVENTS, bench_now() - start);
+}
+
+static void
+damage_views(void *data)
+{
+	struct view_bench *bench = data;
+	int i;
+
+	for (i = 0; i < VIEW_COUNT; i++)
+		weston_surface_damage(bench->surfaces[i]);
+}
+
+static void
+frame_notify(struct wl_listener *listener, void *data)
+{
+	struct view_bench *bench =
+		container_of(listener, struct view_bench, frame_listener);
+	struct wl_event_loop *loop;
+	char name[64];
+
+	bench->frames++;
+	if (bench->frames == WARMUP_FRAMES)
+		bench->start = bench_now();
+
+	if (bench->frames == WARMUP_FRAMES + BENCH_FRAMES) {
+		snprintf(name, sizeof name,
+			 "translucent-views-%d-repaint", VIEW_COUNT);
+		bench_report(name, BENCH_FRAMES, bench_now() - bench->start);
+		wl_list_remove(&bench->frame_listener.link);
+
+		motion_storm(bench);
+		wl_display_terminate(bench->compositor->wl_display);
+		return;
+	}
+
+	/* The repaint needed flag gets cleared once the frame signal
+	 * returns, so damage again only after that. */
+	loop = wl_display_get_event_loop(bench->compositor->wl_display);
+	wl_event_loop_add_idle(loop, damage_views, bench);
+}
+
+static void
+view_bench_setup(void *data)
+{
+	struct view_bench *bench = data;
+	struct weston_compositor *compositor = bench->compositor;
+	struct weston_output *output;
+	struct weston_surface *surface;
+	struct weston_view *view;
+	int i, w, h;
+
+	assert(!wl_list_empty(&compositor->output_list));
+	output = container_of(compositor->output_list.next,
+			      struct weston_output, link);
+	w = output->width / 2;
+	h = output->height / 2;
+
+	weston_layer_init(&bench->layer, &compositor->cursor_layer.link);
+
+	for (i = 0; i < VIEW_COUNT; i++) {
+		surface = weston_surface_create(compositor);
+		assert(surface);
+		view = weston_view_create(surface);
+		assert(view);
+
+		weston_surface_set_color(surface, (i & 1) ? 1.0 : 0.2,
+					 (i & 2) ? 1.0 : 0.2,
+					 (i & 4) ? 1.0 : 0.2, 0.5);
+		weston_surface_set_size(surface, w, h);
+		weston_view_set_position(view,
+					 output->x + (i * 37) % w,
+					 output->y + (i * 23) % h);
+		weston_layer_entry_insert(&bench->layer.view_list,
+					  &view->layer_link);
+
+		bench->surfaces[i] = surface;
+		bench->views[i] = view;
+	}
+
+	bench->frame_listener.notify = frame_notify;
+	wl_signal_add(&output->frame_signal, &bench->frame_listener);
+
+	damage_views(bench);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+	struct view_bench *bench;
+
+	bench = zalloc(sizeof *bench);
+	if (!bench)
+		return -1;
+
+	bench->compositor = compositor;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	wl_event_loop_add_idle(loop, view_bench_setup, bench);
+
+	return 0;
+}
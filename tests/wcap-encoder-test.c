@@ -0,0 +1,202 @@
+/*
+ * Copyright © 2008-2011 Kristian Høgsberg
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "weston-test-runner.h"
+
+#include "../src/wcap-encoder.h"
+#include "../wcap/wcap-decode.h"
+
+#define WIDTH 300
+#define HEIGHT 200
+
+static uint32_t seed = 1;
+
+static uint32_t
+random_pixel(void)
+{
+	seed = seed * 1103515245 + 12345;
+
+	return seed >> 4;
+}
+
+/* Runs of random colors of random length, with some noise */
+static void
+fill_rect(uint32_t *p, int count, int max_run)
+{
+	uint32_t color = 0;
+	int i, run = 0;
+
+	for (i = 0; i < count; i++) {
+		if (run-- == 0) {
+			color = random_pixel();
+			run = random_pixel() % max_run;
+		}
+		p[i] = color;
+	}
+}
+
+static void
+write_data(int fd, const void *data, size_t size)
+{
+	assert(write(fd, data, size) == (ssize_t) size);
+}
+
+static void
+encode_frames(int max_run, int yflip)
+{
+	uint32_t *frame, *decoded, *src, *out, *banded, *end;
+	struct wcap_band bands[8];
+	int i, j, x1, x2, y1, y2, y, width, height, rows, count, n;
+
+	frame = calloc(WIDTH * HEIGHT, sizeof *frame);
+	decoded = calloc(WIDTH * HEIGHT, sizeof *decoded);
+	src = malloc(WIDTH * HEIGHT * sizeof *src);
+	out = malloc(WIDTH * HEIGHT * sizeof *out);
+	banded = malloc(WIDTH * HEIGHT * sizeof *banded);
+	assert(frame && decoded && src && out && banded);
+
+	for (i = 0; i < 200; i++) {
+		x1 = random_pixel() % WIDTH;
+		x2 = x1 + 1 + random_pixel() % (WIDTH - x1);
+		y1 = random_pixel() % HEIGHT;
+		y2 = y1 + 1 + random_pixel() % (HEIGHT - y1);
+		width = x2 - x1;
+		height = y2 - y1;
+		count = width * height;
+		fill_rect(src, count, max_run);
+
+		/* The same rectangle split in bands, encoded in place
+		 * against a copy of the frame, must give the same data */
+		memcpy(banded, src, count * sizeof *src);
+		memcpy(decoded, frame, WIDTH * HEIGHT * sizeof *frame);
+		rows = (height + 7) / 8;
+		for (j = 0, n = 0; j < height; j += rows, n++) {
+			y = yflip ? y2 - j - 1 : y1 + j;
+			wcap_encode_band(&bands[n], banded + j * width,
+					 banded + j * width, decoded, WIDTH,
+					 x1, x2, y, yflip ? -1 : 1,
+					 height - j < rows ? height - j : rows);
+		}
+		end = wcap_encode_join(banded, bands, n);
+
+		n = wcap_encode_rect(out, src, frame, WIDTH,
+				     x1, y1, x2, y2, yflip) - out;
+		assert(end - banded == n);
+		assert(memcmp(out, banded, n * sizeof *out) == 0);
+		assert(memcmp(frame, decoded, WIDTH * HEIGHT * sizeof *frame) == 0);
+	}
+
+	free(frame);
+	free(decoded);
+	free(src);
+	free(out);
+	free(banded);
+}
+
+TEST(wcap_encode_bands_noise)
+{
+	encode_frames(1, 0);
+	encode_frames(1, 1);
+}
+
+TEST(wcap_encode_bands_runs)
+{
+	encode_frames(2000, 0);
+	encode_frames(2000, 1);
+}
+
+/* Records frames of one random rectangle each the way the recorder
+ * does and plays them back with the wcap-decode decoder. */
+TEST(wcap_encode_decode)
+{
+	struct wcap_header header = {
+		.magic = WCAP_HEADER_MAGIC,
+		.format = WCAP_FORMAT_XRGB8888,
+		.width = WIDTH,
+		.height = HEIGHT
+	};
+	struct wcap_frame_header frame_header;
+	struct wcap_rectangle rect;
+	struct wcap_decoder *decoder;
+	char file[] = "/tmp/weston-wcap-encoder-test-XXXXXX";
+	uint32_t *frame, *src, *out, *p;
+	int fd, i, y;
+
+	frame = calloc(WIDTH * HEIGHT, sizeof *frame);
+	src = malloc(WIDTH * HEIGHT * sizeof *src);
+	out = malloc(WIDTH * HEIGHT * sizeof *out);
+	assert(frame && src && out);
+
+	fd = mkstemp(file);
+	assert(fd >= 0);
+	write_data(fd, &header, sizeof header);
+
+	for (i = 0; i < 200; i++) {
+		rect.x1 = random_pixel() % WIDTH;
+		rect.x2 = rect.x1 + 1 + random_pixel() % (WIDTH - rect.x1);
+		rect.y1 = random_pixel() % HEIGHT;
+		rect.y2 = rect.y1 + 1 + random_pixel() % (HEIGHT - rect.y1);
+		fill_rect(src, (rect.x2 - rect.x1) * (rect.y2 - rect.y1), 300);
+
+		/* Bottom-up, as read back from GL */
+		p = wcap_encode_rect(out, src, frame, WIDTH,
+				     rect.x1, rect.y1, rect.x2, rect.y2, 1);
+
+		frame_header.msecs = i;
+		frame_header.nrects = 1;
+		write_data(fd, &frame_header, sizeof frame_header);
+		write_data(fd, &rect, sizeof rect);
+		write_data(fd, out, (p - out) * sizeof *out);
+	}
+
+	close(fd);
+
+	/* The decoder checks every rectangle decodes to its size */
+	decoder = wcap_decoder_create(file);
+	unlink(file);
+	assert(decoder);
+	assert(decoder->nframes == 200);
+
+	for (i = 0; i < 200; i++)
+		assert(wcap_decoder_get_frame(decoder));
+	assert(!wcap_decoder_get_frame(decoder));
+
+	/* Both keep the frame bottom-up */
+	for (y = 0; y < HEIGHT; y++)
+		for (i = 0; i < WIDTH; i++)
+			assert((frame[y * WIDTH + i] & 0xffffff) ==
+			       (decoder->frame[y * WIDTH + i] & 0xffffff));
+
+	wcap_decoder_destroy(decoder);
+	free(frame);
+	free(src);
+	free(out);
+}
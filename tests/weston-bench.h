@@ -0,0 +1,56 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#ifndef _WESTON_BENCH_H_
+#define _WESTON_BENCH_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+
+/* Every benchmark reports one line of JSON on stdout, so the results
+ * of "make bench" can be collected with grep and compared between
+ * builds. */
+
+static inline uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void
+bench_report(const char *name, uint64_t iterations, uint64_t elapsed_ns)
+{
+	printf("{\"benchmark\": \"%s\", \"iterations\": %" PRIu64 ", "
+	       "\"total_ns\": %" PRIu64 ", \"ns_per_iteration\": %.1f}\n",
+	       name, iterations, elapsed_ns,
+	       iterations ? (double) elapsed_ns / iterations : 0.0);
+	fflush(stdout);
+}
+
+#endif
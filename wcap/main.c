@@ -33,10 +33,44 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <cairo.h>
 
 #include "wcap-decode.h"
+#include "../shared/worker-pool.h"
+
+/* Converted frames queued for the writer thread, and the number of
+ * buffers they can be in */
+#define WRITER_QUEUE_LENGTH 8
+#define WRITER_BUFFERS 3
+
+struct yuv_writer {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	size_t size;
+	unsigned char *buffers[WRITER_BUFFERS];
+	int refs[WRITER_BUFFERS];
+	int last;
+
+	int queue[WRITER_QUEUE_LENGTH];
+	int head, queued, done, error;
+};
+
+struct yuv_converter {
+	struct wcap_decoder *decoder;
+	struct worker_pool *pool;
+	int depth, bands, band_rows;
+	unsigned char *out;
+};
 
 static void
 write_png(struct wcap_decoder *decoder, const char *filename)
@@ -95,17 +129,79 @@ int clamp_uv(int u)
 		return clamp;
 }
 
+#ifdef __SSE2__
+/* Four pixels at a time, with the same results as rgb_to_yuv(). All
+ * the products and sums fit in 24 bits, so they are exact in single
+ * precision. */
+static inline void
+rgb_to_yuv_sse2(uint32_t format, __m128i p, __m128i *y, __m128i *u, __m128i *v)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	__m128i r, g, b;
+	__m128 yf;
+
+	switch (format) {
+	case WCAP_FORMAT_XRGB8888:
+		r = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+		g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+		b = _mm_and_si128(p, mask);
+		break;
+	case WCAP_FORMAT_XBGR8888:
+		r = _mm_and_si128(p, mask);
+		g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+		b = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+		break;
+	default:
+		assert(0);
+	}
+
+	yf = _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(_mm_cvtepi32_ps(r), _mm_set1_ps(19595.0f)),
+		_mm_mul_ps(_mm_cvtepi32_ps(g), _mm_set1_ps(38469.0f))),
+		_mm_mul_ps(_mm_cvtepi32_ps(b), _mm_set1_ps(7472.0f)));
+	*y = _mm_cvttps_epi32(_mm_mul_ps(yf, _mm_set1_ps(1.0f / 65536.0f)));
+
+	*u = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(r, *y)),
+					 _mm_set1_ps(46727.0f)));
+	*v = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(b, *y)),
+					 _mm_set1_ps(36962.0f)));
+}
+
+/* clamp_uv() of four values, as bytes */
+static inline uint32_t
+clamp_uv_sse2(__m128i u)
+{
+	u = _mm_add_epi32(_mm_srai_epi32(u, 18), _mm_set1_epi32(128));
+	u = _mm_packs_epi32(u, u);
+
+	return _mm_cvtsi128_si32(_mm_packus_epi16(u, u));
+}
+
+static inline uint32_t
+pack_y_sse2(__m128i y)
+{
+	y = _mm_packs_epi32(y, y);
+
+	return _mm_cvtsi128_si32(_mm_packus_epi16(y, y));
+}
+#endif
+
 static void
-convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
+convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out,
+		int first, int last)
 {
 	unsigned char *y1, *y2, *u, *v;
 	uint32_t *p1, *p2, *end;
 	int i, u_accum, v_accum, stride0, stride1;
 	uint32_t format = decoder->format;
+#ifdef __SSE2__
+	__m128i ya, ua, va, yb, ub, vb;
+	uint32_t uv;
+#endif
 
 	stride0 = decoder->width;
 	stride1 = decoder->width / 2;
-	for (i = 0; i < decoder->height; i += 2) {
+	for (i = first; i < last; i += 2) {
 		y1 = out + stride0 * i;
 		y2 = y1 + stride0;
 		v = out + stride0 * decoder->height + stride1 * i / 2;
@@ -114,6 +210,40 @@ convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 		p2 = p1 + decoder->width;
 		end = p1 + decoder->width;
 
+#ifdef __SSE2__
+		for (; p1 + 4 <= end; p1 += 4, p2 += 4, y1 += 4, y2 += 4) {
+			rgb_to_yuv_sse2(format,
+					_mm_loadu_si128((__m128i *) p1),
+					&ya, &ua, &va);
+			rgb_to_yuv_sse2(format,
+					_mm_loadu_si128((__m128i *) p2),
+					&yb, &ub, &vb);
+
+			uv = pack_y_sse2(ya);
+			memcpy(y1, &uv, 4);
+			uv = pack_y_sse2(yb);
+			memcpy(y2, &uv, 4);
+
+			/* Sum up the 2x2 blocks in lanes 0 and 2 */
+			ua = _mm_add_epi32(ua, ub);
+			ua = _mm_add_epi32(ua, _mm_shuffle_epi32(ua,
+						_MM_SHUFFLE(2, 3, 0, 1)));
+			uv = clamp_uv_sse2(ua);
+			u[0] = uv;
+			u[1] = uv >> 16;
+
+			va = _mm_add_epi32(va, vb);
+			va = _mm_add_epi32(va, _mm_shuffle_epi32(va,
+						_MM_SHUFFLE(2, 3, 0, 1)));
+			uv = clamp_uv_sse2(va);
+			v[0] = uv;
+			v[1] = uv >> 16;
+
+			u += 2;
+			v += 2;
+		}
+#endif
+
 		while (p1 < end) {
 			u_accum = 0;
 			v_accum = 0;
@@ -134,8 +264,27 @@ convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 	}
 }
 
+#ifdef __SSE2__
+/* clamp_uv(u / .3) of four values, the division done in double
+ * precision as in the scalar code */
+static inline uint32_t
+clamp_uv444_sse2(__m128i u)
+{
+	const __m128d third = _mm_set1_pd(.3);
+	__m128i lo, hi;
+
+	lo = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(u), third));
+	hi = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(
+				_mm_shuffle_epi32(u, _MM_SHUFFLE(1, 0, 3, 2))),
+				third));
+
+	return clamp_uv_sse2(_mm_unpacklo_epi64(lo, hi));
+}
+#endif
+
 static void
-convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
+convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out,
+		  int first, int last)
 {
 
 	unsigned char *yp, *up, *vp;
@@ -143,15 +292,34 @@ convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
 	int u, v;
 	int i, stride, psize;
 	uint32_t format = decoder->format;
+#ifdef __SSE2__
+	__m128i y4, u4, v4;
+	uint32_t b;
+#endif
 
 	stride = decoder->width;
 	psize = stride * decoder->height;
-	for (i = 0; i < decoder->height; i++) {
+	for (i = first; i < last; i++) {
 		yp = out + stride * i;
 		up = yp + (psize * 2);
 		vp = yp + (psize * 1);
 		rp = decoder->frame + decoder->width * i;
-		end = rp + decoder->width;	
+		end = rp + decoder->width;
+
+#ifdef __SSE2__
+		for (; rp + 4 <= end; rp += 4, yp += 4, up += 4, vp += 4) {
+			rgb_to_yuv_sse2(format,
+					_mm_loadu_si128((__m128i *) rp),
+					&y4, &u4, &v4);
+			b = pack_y_sse2(y4);
+			memcpy(yp, &b, 4);
+			b = clamp_uv444_sse2(u4);
+			memcpy(up, &b, 4);
+			b = clamp_uv444_sse2(v4);
+			memcpy(vp, &b, 4);
+		}
+#endif
+
 		while (rp < end) {
 			u = 0;
 			v = 0;
@@ -167,27 +335,191 @@ convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
 }
 
 static void
-output_yuv_frame(struct wcap_decoder *decoder, int depth)
+convert_band(void *data, int index)
 {
-	static unsigned char *out;
-	int size;
+	struct yuv_converter *converter = data;
+	struct wcap_decoder *decoder = converter->decoder;
+	int first, last;
+
+	first = index * converter->band_rows;
+	last = first + converter->band_rows;
+	if (last > decoder->height)
+		last = decoder->height;
 
-	if (depth == 444) {
-		size = decoder->width * decoder->height * 3;
-	} else {
-		size = decoder->width * decoder->height * 3 / 2;
+	if (converter->depth == 444)
+		convert_to_yuv444(decoder, converter->out, first, last);
+	else
+		convert_to_yv12(decoder, converter->out, first, last);
+}
+
+static void
+convert_frame(struct yuv_converter *converter, unsigned char *out)
+{
+	converter->out = out;
+	worker_pool_run(converter->pool, converter->bands,
+			convert_band, converter);
+}
+
+static void
+yuv_converter_init(struct yuv_converter *converter,
+		   struct wcap_decoder *decoder, int depth)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int rows;
+
+	converter->decoder = decoder;
+	converter->depth = depth;
+	converter->pool = worker_pool_create(ncpus - 1);
+
+	/* A few bands per thread, each an even number of rows */
+	converter->bands = worker_pool_get_size(converter->pool) * 4;
+	rows = (decoder->height + converter->bands - 1) / converter->bands;
+	converter->band_rows = (rows + 1) & ~1;
+	converter->bands = (decoder->height + converter->band_rows - 1) /
+		converter->band_rows;
+}
+
+static void *
+yuv_writer_thread(void *data)
+{
+	static const char frame_header[] = "FRAME\n";
+	struct yuv_writer *writer = data;
+	struct iovec v[2];
+	ssize_t len;
+	int b, n;
+
+	pthread_mutex_lock(&writer->mutex);
+	for (;;) {
+		while (writer->queued == 0 && !writer->done)
+			pthread_cond_wait(&writer->cond, &writer->mutex);
+		if (writer->queued == 0)
+			break;
+		b = writer->queue[writer->head];
+		pthread_mutex_unlock(&writer->mutex);
+
+		v[0].iov_base = (void *) frame_header;
+		v[0].iov_len = sizeof frame_header - 1;
+		v[1].iov_base = writer->buffers[b];
+		v[1].iov_len = writer->size;
+		n = 2;
+		while (n > 0 && !writer->error) {
+			len = writev(STDOUT_FILENO, v + 2 - n, n);
+			if (len < 0) {
+				if (errno != EINTR)
+					writer->error = errno;
+				continue;
+			}
+			while (n > 0 && (size_t) len >= v[2 - n].iov_len) {
+				len -= v[2 - n].iov_len;
+				n--;
+			}
+			if (n > 0) {
+				v[2 - n].iov_base =
+					(char *) v[2 - n].iov_base + len;
+				v[2 - n].iov_len -= len;
+			}
+		}
+
+		pthread_mutex_lock(&writer->mutex);
+		writer->head = (writer->head + 1) % WRITER_QUEUE_LENGTH;
+		writer->queued--;
+		writer->refs[b]--;
+		pthread_cond_broadcast(&writer->cond);
+	}
+	pthread_mutex_unlock(&writer->mutex);
+
+	return NULL;
+}
+
+static int
+yuv_writer_init(struct yuv_writer *writer, size_t size)
+{
+	int i;
+
+	memset(writer, 0, sizeof *writer);
+	writer->size = size;
+	writer->last = -1;
+	for (i = 0; i < WRITER_BUFFERS; i++) {
+		writer->buffers[i] = malloc(size);
+		if (!writer->buffers[i])
+			return -1;
 	}
-	if (out == NULL)
-		out = malloc(size);
 
-	if (depth == 444) {
-		convert_to_yuv444(decoder, out);
-	} else {
-		convert_to_yv12(decoder, out);
+	pthread_mutex_init(&writer->mutex, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+
+	return pthread_create(&writer->thread, NULL, yuv_writer_thread,
+			      writer) == 0 ? 0 : -1;
+}
+
+/* Returns a buffer the writer is done with */
+static int
+yuv_writer_get_buffer(struct yuv_writer *writer)
+{
+	int b;
+
+	pthread_mutex_lock(&writer->mutex);
+	for (;;) {
+		for (b = 0; b < WRITER_BUFFERS; b++)
+			if (b != writer->last && writer->refs[b] == 0)
+				break;
+		if (b < WRITER_BUFFERS)
+			break;
+		pthread_cond_wait(&writer->cond, &writer->mutex);
+	}
+	pthread_mutex_unlock(&writer->mutex);
+
+	return b;
+}
+
+static void
+yuv_writer_queue(struct yuv_writer *writer, int b)
+{
+	pthread_mutex_lock(&writer->mutex);
+	while (writer->queued == WRITER_QUEUE_LENGTH)
+		pthread_cond_wait(&writer->cond, &writer->mutex);
+	writer->queue[(writer->head + writer->queued) % WRITER_QUEUE_LENGTH] = b;
+	writer->queued++;
+	writer->refs[b]++;
+	writer->last = b;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+}
+
+static int
+yuv_writer_finish(struct yuv_writer *writer)
+{
+	int i;
+
+	pthread_mutex_lock(&writer->mutex);
+	writer->done = 1;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+	pthread_join(writer->thread, NULL);
+
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->mutex);
+	for (i = 0; i < WRITER_BUFFERS; i++)
+		free(writer->buffers[i]);
+
+	return writer->error;
+}
+
+/* Frames repeated to keep up the frame rate are converted only once */
+static void
+output_yuv_frame(struct yuv_converter *converter, struct yuv_writer *writer,
+		 int repeat)
+{
+	int b;
+
+	if (repeat && writer->last >= 0) {
+		yuv_writer_queue(writer, writer->last);
+		return;
 	}
 
-	printf("FRAME\n");
-	fwrite(out, 1, size, stdout);
+	b = yuv_writer_get_buffer(writer);
+	convert_frame(converter, writer->buffers[b]);
+	yuv_writer_queue(writer, b);
 }
 
 static void
@@ -210,11 +542,14 @@ usage(int exit_code)
 int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
-	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
+	struct yuv_converter converter;
+	struct yuv_writer writer;
+	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, ret;
 	int num = 30, denom = 1;
 	char filename[200];
 	char *mode;
-	uint32_t msecs, frame_time;
+	size_t size;
+	uint32_t msecs = 0, frame_time, f, shown = 0;
 
 	for (i = 1, j = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--yuv4mpeg2-444") == 0) {
@@ -268,19 +603,30 @@ int main(int argc, char *argv[])
 	if (yuv4mpeg2) {
 		if (yuv4mpeg2 == 444) {
 			mode = "C444";
+			size = decoder->width * decoder->height * 3;
 		} else {
 			mode = "C420jpeg";
+			size = decoder->width * decoder->height * 3 / 2;
 		}
 		printf("YUV4MPEG2 %s W%d H%d F%d:%d Ip A0:0\n",
 					 mode, decoder->width, decoder->height, num, denom);
 		fflush(stdout);
+
+		yuv_converter_init(&converter, decoder, yuv4mpeg2);
+		if (yuv_writer_init(&writer, size) < 0) {
+			fprintf(stderr, "failed to set up yuv4mpeg2 output\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 
+	/* Step through the index at the output frame rate, and only
+	 * decode the frames that are written out. */
 	i = 0;
-	has_frame = wcap_decoder_get_frame(decoder);
-	msecs = decoder->msecs;
 	frame_time = 1000 * denom / num;
-	while (has_frame) {
+	for (f = 0; f < decoder->nframes; ) {
+		if (all || i == output_frame || yuv4mpeg2)
+			wcap_decoder_seek(decoder, f);
+
 		if (all || i == output_frame) {
 			snprintf(filename, sizeof filename,
 				 "wcap-frame-%d.png", i);
@@ -288,11 +634,26 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "wrote %s\n", filename);
 		}
 		if (yuv4mpeg2)
-			output_yuv_frame(decoder, yuv4mpeg2);
+			output_yuv_frame(&converter, &writer,
+					 i > 0 && f == shown);
+		shown = f;
+
+		if (i == 0)
+			msecs = decoder->index[0].msecs;
 		i++;
 		msecs += frame_time;
-		while (decoder->msecs < msecs && has_frame)
-			has_frame = wcap_decoder_get_frame(decoder);
+		while (f < decoder->nframes && decoder->index[f].msecs < msecs)
+			f++;
+	}
+
+	if (yuv4mpeg2) {
+		ret = yuv_writer_finish(&writer);
+		worker_pool_destroy(converter.pool);
+		if (ret) {
+			fprintf(stderr, "failed to write yuv4mpeg2 stream: %s\n",
+				strerror(ret));
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
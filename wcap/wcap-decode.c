@@ -33,55 +33,210 @@
 #include <string.h>
 #include <fcntl.h>
 
-#include <cairo.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "wcap-decode.h"
 
+/* Memory to spend on keyframes for seeking */
+#define KEYFRAME_MEMORY (256 * 1024 * 1024)
+
+static inline int
+run_length(uint32_t v)
+{
+	int l = v >> 24;
+
+	if (l < 0xe0)
+		return l + 1;
+	else
+		return 1 << (l - 0xe0 + 7);
+}
+
+/* Adds the delta to every color channel of n pixels */
+static void
+apply_run(uint32_t *d, int n, uint32_t v)
+{
+	unsigned char r, g, b, dr, dg, db;
+	int i = 0;
+
+#ifdef __SSE2__
+	const __m128i delta = _mm_set1_epi32(v & 0x00ffffff);
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	__m128i x;
+
+	for (; i + 4 <= n; i += 4) {
+		x = _mm_loadu_si128((__m128i *) (d + i));
+		x = _mm_or_si128(_mm_add_epi8(x, delta), alpha);
+		_mm_storeu_si128((__m128i *) (d + i), x);
+	}
+#endif
+
+	dr = (v >> 16);
+	dg = (v >>  8);
+	db = (v >>  0);
+	for (; i < n; i++) {
+		r = (d[i] >> 16) + dr;
+		g = (d[i] >>  8) + dg;
+		b = (d[i] >>  0) + db;
+		d[i] = 0xff000000 | (r << 16) | (g << 8) | b;
+	}
+}
+
 static void
 wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			      struct wcap_rectangle *rect)
 {
 	uint32_t v, *p = decoder->p, *d;
 	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
-	int x, i, j, k, l, count = width * height;
-	unsigned char r, g, b, dr, dg, db;
+	int x, i, j, n, count = width * height;
 
 	d = decoder->frame + (rect->y2 - 1) * decoder->width;
 	x = rect->x1;
 	i = 0;
 	while (i < count) {
 		v = *p++;
-		l = v >> 24;
-		if (l < 0xe0) {
-			j = l + 1;
-		} else {
-			j = 1 << (l - 0xe0 + 7);
-		}
+		j = run_length(v);
+		i += j;
 
-		dr = (v >> 16);
-		dg = (v >>  8);
-		db = (v >>  0);
-		for (k = 0; k < j; k++) {
-			r = (d[x] >> 16) + dr;
-			g = (d[x] >>  8) + dg;
-			b = (d[x] >>  0) + db;
-			d[x] = 0xff000000 | (r << 16) | (g << 8) | b;
-			x++;
+		/* Runs wrap around to the next row of the rectangle */
+		while (j > 0) {
+			n = rect->x2 - x < j ? rect->x2 - x : j;
+			apply_run(d + x, n, v);
+			x += n;
+			j -= n;
 			if (x == rect->x2) {
 				x = rect->x1;
 				d -= decoder->width;
 			}
 		}
-		i += j;
 	}
 
-	if (i != count)
-		printf("rle encoding longer than expected (%d expected %d)\n",
-		       i, count);
-
 	decoder->p = p;
 }
 
+/* Returns the end of the frame starting at p, or NULL if the frame is
+ * truncated or does not fit the screen. */
+static void *
+wcap_decoder_skip_frame(struct wcap_decoder *decoder, void *p)
+{
+	struct wcap_frame_header *header = p;
+	struct wcap_rectangle *rects;
+	uint32_t i, *w;
+	size_t count, n;
+
+	if (decoder->end - p < (ssize_t) sizeof *header)
+		return NULL;
+
+	rects = (void *) (header + 1);
+	if ((size_t) (decoder->end - (void *) rects) / sizeof *rects <
+	    header->nrects)
+		return NULL;
+
+	w = (uint32_t *) (rects + header->nrects);
+	for (i = 0; i < header->nrects; i++) {
+		if (rects[i].x1 < 0 || rects[i].x1 > rects[i].x2 ||
+		    rects[i].x2 > decoder->width ||
+		    rects[i].y1 < 0 || rects[i].y1 > rects[i].y2 ||
+		    rects[i].y2 > decoder->height)
+			return NULL;
+
+		count = (size_t) (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+		for (n = 0; n < count; w++) {
+			if ((void *) w >= decoder->end)
+				return NULL;
+			n += run_length(*w);
+		}
+
+		if (n != count) {
+			fprintf(stderr, "rle encoding longer than expected "
+				"(%zu expected %zu)\n", n, count);
+			return NULL;
+		}
+	}
+
+	return w;
+}
+
+static int
+wcap_decoder_build_index(struct wcap_decoder *decoder)
+{
+	struct wcap_frame_info *index = NULL, *new_index;
+	struct wcap_frame_header *header;
+	uint32_t size = 0, count = 0;
+	void *p, *next;
+
+	for (p = decoder->p; p < decoder->end; p = next) {
+		next = wcap_decoder_skip_frame(decoder, p);
+		if (!next) {
+			fprintf(stderr, "wcap file is damaged after %u frames, "
+				"ignoring the rest\n", count);
+			decoder->end = p;
+			break;
+		}
+
+		if (count == size) {
+			size = size ? size * 2 : 1024;
+			new_index = realloc(index, size * sizeof *index);
+			if (!new_index) {
+				free(index);
+				return -1;
+			}
+			index = new_index;
+		}
+
+		header = p;
+		index[count].offset = p - decoder->map;
+		index[count].msecs = header->msecs;
+		count++;
+	}
+
+	decoder->index = index;
+	decoder->nframes = count;
+
+	return 0;
+}
+
+static void
+wcap_decoder_save_keyframe(struct wcap_decoder *decoder)
+{
+	uint32_t frame = decoder->count - 1, k;
+	size_t size = decoder->width * decoder->height * 4;
+
+	if (!decoder->keyframes || frame % decoder->keyframe_interval != 0)
+		return;
+
+	k = frame / decoder->keyframe_interval;
+	if (decoder->keyframes[k])
+		return;
+
+	/* Without memory for it, seeking just decodes further */
+	decoder->keyframes[k] = malloc(size);
+	if (decoder->keyframes[k])
+		memcpy(decoder->keyframes[k], decoder->frame, size);
+}
+
+/* Keyframes only cost time when decoding straight through, so they
+ * are collected from the first time the decoder has to go back. */
+static void
+wcap_decoder_enable_keyframes(struct wcap_decoder *decoder)
+{
+	size_t frame_size = decoder->width * decoder->height * 4;
+	uint32_t max_keyframes;
+
+	if (decoder->keyframes)
+		return;
+
+	max_keyframes = KEYFRAME_MEMORY / frame_size;
+	if (max_keyframes < 1)
+		max_keyframes = 1;
+	decoder->keyframe_interval = decoder->nframes / max_keyframes + 1;
+	decoder->keyframes =
+		calloc(decoder->nframes / decoder->keyframe_interval + 1,
+		       sizeof *decoder->keyframes);
+}
+
 int
 wcap_decoder_get_frame(struct wcap_decoder *decoder)
 {
@@ -89,7 +244,7 @@ wcap_decoder_get_frame(struct wcap_decoder *decoder)
 	struct wcap_frame_header *header;
 	uint32_t i;
 
-	if (decoder->p == decoder->end)
+	if (decoder->p >= decoder->end)
 		return 0;
 
 	header = decoder->p;
@@ -101,6 +256,55 @@ wcap_decoder_get_frame(struct wcap_decoder *decoder)
 	for (i = 0; i < header->nrects; i++)
 		wcap_decoder_decode_rectangle(decoder, &rects[i]);
 
+	wcap_decoder_save_keyframe(decoder);
+
+	return 1;
+}
+
+/* Makes 'frame' the current frame, decoding from the closest keyframe
+ * before it unless the current frame is closer. */
+int
+wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t frame)
+{
+	uint32_t k = 0, start = 0;
+
+	if (frame >= decoder->nframes)
+		return 0;
+
+	if (decoder->count > frame + 1)
+		wcap_decoder_enable_keyframes(decoder);
+
+	if (decoder->keyframes) {
+		k = frame / decoder->keyframe_interval;
+		while (k > 0 && !decoder->keyframes[k])
+			k--;
+		start = k * decoder->keyframe_interval;
+	}
+
+	if (decoder->count > frame + 1 ||
+	    (decoder->keyframes && decoder->keyframes[k] &&
+	     decoder->count < start + 1)) {
+		if (decoder->keyframes && decoder->keyframes[k]) {
+			memcpy(decoder->frame, decoder->keyframes[k],
+			       decoder->width * decoder->height * 4);
+			decoder->msecs = decoder->index[start].msecs;
+			decoder->count = start + 1;
+			decoder->p = decoder->map +
+				(start + 1 < decoder->nframes ?
+				 decoder->index[start + 1].offset :
+				 (size_t) (decoder->end - decoder->map));
+		} else {
+			memset(decoder->frame, 0,
+			       decoder->width * decoder->height * 4);
+			decoder->count = 0;
+			decoder->p = decoder->map + decoder->index[0].offset;
+		}
+	}
+
+	while (decoder->count < frame + 1)
+		if (!wcap_decoder_get_frame(decoder))
+			return 0;
+
 	return 1;
 }
 
@@ -109,10 +313,10 @@ wcap_decoder_create(const char *filename)
 {
 	struct wcap_decoder *decoder;
 	struct wcap_header *header;
-	int frame_size;
+	size_t frame_size;
 	struct stat buf;
 
-	decoder = malloc(sizeof *decoder);
+	decoder = calloc(1, sizeof *decoder);
 	if (decoder == NULL)
 		return NULL;
 
@@ -124,14 +328,25 @@ wcap_decoder_create(const char *filename)
 
 	fstat(decoder->fd, &buf);
 	decoder->size = buf.st_size;
+	if (decoder->size < sizeof *header) {
+		fprintf(stderr, "not a wcap file\n");
+		close(decoder->fd);
+		free(decoder);
+		return NULL;
+	}
+
 	decoder->map = mmap(NULL, decoder->size,
 			    PROT_READ, MAP_PRIVATE, decoder->fd, 0);
 	if (decoder->map == MAP_FAILED) {
 		fprintf(stderr, "mmap failed\n");
+		close(decoder->fd);
 		free(decoder);
 		return NULL;
 	}
-		
+
+	/* The first pass is sequential, the second one mostly too */
+	madvise(decoder->map, decoder->size, MADV_SEQUENTIAL);
+
 	header = decoder->map;
 	decoder->format = header->format;
 	decoder->count = 0;
@@ -140,13 +355,13 @@ wcap_decoder_create(const char *filename)
 	decoder->p = header + 1;
 	decoder->end = decoder->map + decoder->size;
 
-	frame_size = header->width * header->height * 4;
-	decoder->frame = malloc(frame_size);
-	if (decoder->frame == NULL) {
-		free(decoder);
+	frame_size = (size_t) header->width * header->height * 4;
+	decoder->frame = calloc(1, frame_size);
+	if (frame_size == 0 || decoder->frame == NULL ||
+	    wcap_decoder_build_index(decoder) < 0) {
+		wcap_decoder_destroy(decoder);
 		return NULL;
 	}
-	memset(decoder->frame, 0, frame_size);
 
 	return decoder;
 }
@@ -154,6 +369,15 @@ wcap_decoder_create(const char *filename)
 void
 wcap_decoder_destroy(struct wcap_decoder *decoder)
 {
+	uint32_t i;
+
+	if (decoder->keyframes) {
+		for (i = 0; i <= decoder->nframes / decoder->keyframe_interval;
+		     i++)
+			free(decoder->keyframes[i]);
+		free(decoder->keyframes);
+	}
+	free(decoder->index);
 	munmap(decoder->map, decoder->size);
 	close(decoder->fd);
 	free(decoder->frame);
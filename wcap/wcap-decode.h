@@ -45,6 +45,13 @@ struct wcap_rectangle {
 	int32_t x1, y1, x2, y2;
 };
 
+/* Where every frame starts in the file, found by a first pass over
+ * the run lengths without decoding anything. */
+struct wcap_frame_info {
+	size_t offset;
+	uint32_t msecs;
+};
+
 struct wcap_decoder {
 	int fd;
 	size_t size;
@@ -54,9 +61,18 @@ struct wcap_decoder {
 	uint32_t msecs;
 	uint32_t count;
 	int width, height;
+
+	struct wcap_frame_info *index;
+	uint32_t nframes;
+
+	/* Copies of every keyframe_interval'th frame to seek back from,
+	 * taken as they are decoded once seeking back was needed */
+	uint32_t **keyframes;
+	uint32_t keyframe_interval;
 };
 
 int wcap_decoder_get_frame(struct wcap_decoder *decoder);
+int wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t frame);
 struct wcap_decoder *wcap_decoder_create(const char *filename);
 void wcap_decoder_destroy(struct wcap_decoder *decoder);
 